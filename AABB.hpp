@@ -0,0 +1,136 @@
+#pragma once
+#include <Eigen/Dense>
+#include "AffineTransform.hpp"
+#include <limits>
+#include <cmath>
+#include <algorithm>
+
+/// <summary>
+/// An Axis Aligned Bounding Box, stored as its minimum and maximum corners.
+/// A default constructed AABB is empty (min > max), so expanding it by any point
+/// or box gives that point or box.
+/// </summary>
+struct AABB
+{
+	Eigen::Vector3f min, max;
+
+	AABB()
+		:min(Eigen::Vector3f::Constant(std::numeric_limits<float>::max())),
+		max(Eigen::Vector3f::Constant(-std::numeric_limits<float>::max()))
+	{}
+
+	AABB(const Eigen::Vector3f& minCorner, const Eigen::Vector3f& maxCorner)
+		:min(minCorner), max(maxCorner)
+	{}
+
+	void expand(const Eigen::Vector3f& p)
+	{
+		min = min.cwiseMin(p);
+		max = max.cwiseMax(p);
+	}
+
+	void expand(const AABB& box)
+	{
+		min = min.cwiseMin(box.min);
+		max = max.cwiseMax(box.max);
+	}
+
+	/// <summary>
+	/// The overlap of this box and another, which is empty if they don't overlap.
+	/// </summary>
+	AABB intersection(const AABB& box) const
+	{
+		return AABB(min.cwiseMax(box.min), max.cwiseMin(box.max));
+	}
+
+	bool empty() const
+	{
+		return min.x() > max.x() || min.y() > max.y() || min.z() > max.z();
+	}
+
+	Eigen::Vector3f centroid() const
+	{
+		return .5f * (min + max);
+	}
+
+	Eigen::Vector3f extent() const
+	{
+		return max - min;
+	}
+
+	/// <summary>
+	/// Surface area of the box, used by the Surface Area Heuristic (SAH).
+	/// Empty boxes have zero area.
+	/// </summary>
+	float surfaceArea() const
+	{
+		if (empty()) return 0.f;
+		Eigen::Vector3f e = extent();
+		return 2.f * (e.x() * e.y() + e.y() * e.z() + e.z() * e.x());
+	}
+
+	/// <summary>
+	/// Index of the axis (0, 1 or 2) along which the box is longest.
+	/// </summary>
+	int longestAxis() const
+	{
+		Eigen::Vector3f e = extent();
+		if (e.x() > e.y() && e.x() > e.z()) return 0;
+		return e.y() > e.z() ? 1 : 2;
+	}
+
+	/// <summary>
+	/// Bounding box of this box after applying a transform, found by transforming all
+	/// eight corners.
+	/// </summary>
+	AABB transformed(const AffineTransform& transform) const
+	{
+		AABB box;
+		if (empty()) return box;
+		for (int c = 0; c < 8; ++c) {
+			Eigen::Vector3f corner(
+				(c & 1) ? max.x() : min.x(),
+				(c & 2) ? max.y() : min.y(),
+				(c & 4) ? max.z() : min.z());
+			box.expand(transform.position(corner));
+		}
+		return box;
+	}
+
+	/// <summary>
+	/// Slab test against a ray, given the ray origin and the reciprocal of its direction.
+	/// On a hit, tEntry is set to the distance at which the ray enters the box (clamped to minT).
+	/// </summary>
+	bool intersect(const Eigen::Vector3f& origin, const Eigen::Vector3f& invDir,
+		float minT, float maxT, float& tEntry) const
+	{
+		for (int a = 0; a < 3; a++) {
+			float t0 = (min[a] - origin[a]) * invDir[a];
+			float t1 = (max[a] - origin[a]) * invDir[a];
+
+			if (invDir[a] < 0)
+				std::swap(t0, t1);
+
+			if (t0 > minT) minT = t0;
+			if (t1 < maxT) maxT = t1;
+
+			if (maxT < minT)
+				return false;
+		}
+		tEntry = minT;
+		return true;
+	}
+};
+
+/// <summary>
+/// Reciprocal of a ray direction for SIMD slab tests. A zero component gives a large finite
+/// value of the same sign rather than infinity, so (plane - origin) * invDir is never
+/// 0 * inf = NaN, which min and max would otherwise let through or drop depending on operand order.
+/// </summary>
+Eigen::Vector3f slabInverse(const Eigen::Vector3f& direction)
+{
+	Eigen::Vector3f invDir;
+	for (int a = 0; a < 3; ++a)
+		invDir[a] = direction[a] != 0.f ? 1.f / direction[a] : std::copysign(1e30f, direction[a]);
+	return invDir;
+}
@@ -13,11 +13,27 @@ class AABBMesh : public Mesh
 {
 private:
 	Eigen::Vector3f min_, max_;
+
+	// Recompute the world-space AABB from the mesh's world-space triangles.
+	void updateBounds()
+	{
+		AABB box;
+		Mesh::bounds(box);
+		min_ = box.min;
+		max_ = box.max;
+	}
 public:
 	AABBMesh(const Shader* shader, const Model* model, bool culling=true, IntersectMask mask=DEFAULT_BITMASK)
 		:Mesh(shader, model, culling, mask)
 	{
-		modelToWorld(Eigen::Matrix4f::Identity());
+		// Mesh's constructor has already built the world-space triangles.
+		updateBounds();
+	}
+
+	virtual bool bounds(AABB& box) const override
+	{
+		box = AABB(min_, max_);
+		return true;
 	}
 
     virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
@@ -47,25 +63,21 @@ public:
 		return Mesh::intersect(ray, minT, maxT, info, mask);
     }
 
-	virtual void modelToWorld(const Eigen::Matrix4f& m) override
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
 	{
-		Entity::modelToWorld(m);
+		if (!checkMask(mask)) return false;
+
+		float tEntry;
+		if (!AABB(min_, max_).intersect(ray.origin, ray.direction.cwiseInverse(), minT, maxT, tEntry)) return false;
+		return Mesh::occluded(ray, minT, maxT, mask);
+	}
+
+	virtual void modelToWorld(const AffineTransform& m) override
+	{
+		Mesh::modelToWorld(m);
 
 		// When changing modelToWorld, also update the world-space AABB.
-		for (int i = 0; i < 3; ++i) {
-			min_[i] = std::numeric_limits<float>::max();
-			max_[i] = std::numeric_limits<float>::min();
-		}
-		for (int f = 0; f < model_->nfaces(); ++f) {
-			for (int v = 0; v < 3; ++v) {
-				Eigen::Vector3f v0 = model_->vert(model_->face(f)[v]);
-				v0 = transformPosition(Entity::modelToWorld(), v0);
-				for (int i = 0; i < 3; ++i) {
-					if (v0[i] < min_[i]) min_[i] = v0[i];
-					if (v0[i] > max_[i]) max_[i] = v0[i];
-				}
-			}
-		}
+		updateBounds();
 	}
 
 };
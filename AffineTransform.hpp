@@ -0,0 +1,95 @@
+#pragma once
+#include <Eigen/Dense>
+#include <cassert>
+
+/// <summary>
+/// An affine transform, stored as the upper 3x4 of a 4x4 matrix: a linear part and a translation.
+/// The bottom row is always (0, 0, 0, 1), so transforming a position needs no homogeneous divide,
+/// and it takes 48 bytes rather than 64.
+/// Can be made from a Matrix4f, such as those made in GeomUtil.hpp, as long as it is affine.
+/// </summary>
+class AffineTransform
+{
+private:
+	Eigen::Matrix3f linear_;
+	Eigen::Vector3f translation_;
+
+public:
+	AffineTransform()
+		:linear_(Eigen::Matrix3f::Identity()), translation_(Eigen::Vector3f::Zero())
+	{}
+
+	AffineTransform(const Eigen::Matrix3f& linear, const Eigen::Vector3f& translation)
+		:linear_(linear), translation_(translation)
+	{}
+
+	/// <summary>
+	/// Take the upper 3x4 of a 4x4 matrix, or of a matrix expression such as a product of them.
+	/// Its bottom row must be (0, 0, 0, 1).
+	/// </summary>
+	template <typename Derived>
+	explicit AffineTransform(const Eigen::MatrixBase<Derived>& m)
+		:linear_(m.template block<3, 3>(0, 0)), translation_(m.template block<3, 1>(0, 3))
+	{
+		static_assert(Derived::RowsAtCompileTime == 4 && Derived::ColsAtCompileTime == 4, "AffineTransform needs a 4x4 matrix");
+		assert(m.row(3) == Eigen::RowVector4f(0.f, 0.f, 0.f, 1.f) && "AffineTransform needs an affine matrix");
+	}
+
+	static AffineTransform Identity()
+	{
+		return AffineTransform();
+	}
+
+	const Eigen::Matrix3f& linear() const
+	{
+		return linear_;
+	}
+
+	const Eigen::Vector3f& translation() const
+	{
+		return translation_;
+	}
+
+	/// <summary>
+	/// The equivalent 4x4 matrix.
+	/// </summary>
+	Eigen::Matrix4f matrix() const
+	{
+		Eigen::Matrix4f m = Eigen::Matrix4f::Identity();
+		m.block<3, 3>(0, 0) = linear_;
+		m.block<3, 1>(0, 3) = translation_;
+		return m;
+	}
+
+	AffineTransform inverse() const
+	{
+		Eigen::Matrix3f inv = linear_.inverse();
+		return AffineTransform(inv, -(inv * translation_));
+	}
+
+	/// <summary>
+	/// Matrix taking normals through this transform: the inverse transpose of the linear part.
+	/// </summary>
+	Eigen::Matrix3f normalMatrix() const
+	{
+		return linear_.inverse().transpose();
+	}
+
+	Eigen::Vector3f position(const Eigen::Vector3f& p) const
+	{
+		return linear_ * p + translation_;
+	}
+
+	Eigen::Vector3f direction(const Eigen::Vector3f& d) const
+	{
+		return linear_ * d;
+	}
+
+	/// <summary>
+	/// Compose transforms, applying rhs first.
+	/// </summary>
+	AffineTransform operator *(const AffineTransform& rhs) const
+	{
+		return AffineTransform(linear_ * rhs.linear_, linear_ * rhs.translation_ + translation_);
+	}
+};
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+/// <summary>
+/// A std::vector allocator that aligns the array to Alignment bytes (a power of two), such as
+/// a cache line, so that nodes of a matching size never straddle two lines.
+/// The original allocation is stored just before the aligned array, to free it again.
+/// </summary>
+template <typename T, size_t Alignment = 64>
+struct AlignedAllocator
+{
+	typedef T value_type;
+
+	template <typename U>
+	struct rebind
+	{
+		typedef AlignedAllocator<U, Alignment> other;
+	};
+
+	AlignedAllocator()
+	{}
+
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment>&)
+	{}
+
+	T* allocate(size_t n)
+	{
+		void* raw = ::operator new(n * sizeof(T) + Alignment + sizeof(void*));
+		uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + Alignment - 1) & ~static_cast<uintptr_t>(Alignment - 1);
+		reinterpret_cast<void**>(aligned)[-1] = raw;
+		return reinterpret_cast<T*>(aligned);
+	}
+
+	void deallocate(T* p, size_t)
+	{
+		::operator delete(reinterpret_cast<void**>(p)[-1]);
+	}
+};
+
+template <typename T, typename U, size_t Alignment>
+bool operator ==(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&)
+{
+	return true;
+}
+
+template <typename T, typename U, size_t Alignment>
+bool operator !=(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&)
+{
+	return false;
+}
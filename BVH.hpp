@@ -0,0 +1,1112 @@
+#pragma once
+#include "AABB.hpp"
+#include "Morton.hpp"
+#include "BinaryIO.hpp"
+#include "AlignedAllocator.hpp"
+#include "RayPacket.hpp"
+#include <vector>
+#include <numeric>
+#include <chrono>
+#include <ostream>
+#include <atomic>
+#include <functional>
+
+/// <summary>
+/// A single node of a binary BVH. Interior nodes store the index of their left child,
+/// and the right child always directly follows it in the node array. Leaf nodes store
+/// the index of their first primitive reference and the number of primitives.
+/// Nodes are 32 bytes, so with cache-line aligned storage a pair of siblings fills one line.
+/// </summary>
+struct BVHNode
+{
+	AABB bounds;
+	int leftOrFirst; // Interior: index of left child. Leaf: index of first primitive reference.
+	int count; // Number of primitives in a leaf, zero for interior nodes.
+
+	bool isLeaf() const
+	{
+		return count > 0;
+	}
+};
+
+/// <summary>
+/// BVH node storage, aligned to cache lines.
+/// </summary>
+typedef std::vector<BVHNode, AlignedAllocator<BVHNode>> BVHNodeArray;
+
+/// <summary>
+/// Algorithms for building a BVH.
+/// </summary>
+enum class BVHBuildMethod
+{
+	SweepSAH, // Evaluates the SAH at every split position. Slow to build.
+	BinnedSAH, // Evaluates the SAH between bins of primitives, building subtrees in parallel.
+	LBVH, // Sorts primitives along a Morton curve and splits where the codes differ. Fastest, lowest quality.
+	SpatialSAH, // Binned SAH that may also split primitives across children (SBVH). Slowest, highest quality.
+};
+
+/// <summary>
+/// Orders for the nodes of a built BVH in memory. Sibling nodes are always stored together.
+/// </summary>
+enum class BVHNodeLayout
+{
+	BuildOrder, // As the builder made them. Parallel builds interleave the nodes of different subtrees.
+	DepthFirst, // The nodes of every subtree are contiguous, with the left subtree first.
+	Treelet, // van Emde Boas order: the top half of the levels of a subtree, then each subtree hanging below them, recursively.
+};
+
+/// <summary>
+/// Parameters controlling how a BVH is built.
+/// </summary>
+struct BVHBuildOptions
+{
+	BVHBuildMethod method = BVHBuildMethod::BinnedSAH;
+	int bins = 32; // Number of bins per axis for the binned SAH build.
+	int mortonBits = 30; // Morton code length for the LBVH build: 30 or 63.
+	int maxLeafSize = 4; // Nodes with more primitives than this are always split.
+	float traversalCost = 1.f; // SAH cost of visiting an interior node.
+	float intersectionCost = 1.f; // SAH cost of testing one primitive.
+	int width = 2; // Children per node for mesh BVHs: 2, 4 (SSE) or 8 (AVX). See WideBVH.
+	bool quantized = false; // Store wide BVH child bounds in 8 bits per plane. Ignored for width 2.
+	float rebuildCostRatio = 0.f; // Rebuild rather than refit once the SAH cost grows by this factor. 0 to always refit.
+	float spatialSplitBudget = 1.f; // Extra primitive references the SpatialSAH build may make, as a fraction of the primitive count.
+	BVHNodeLayout layout = BVHNodeLayout::DepthFirst; // Order of the nodes in memory, for cache use during traversal.
+};
+
+/// <summary>
+/// Summary of a built BVH, used to report build time and tree quality.
+/// </summary>
+struct BVHStats
+{
+	int primitives = 0, references = 0, nodes = 0, leaves = 0, maxDepth = 0; // More references than primitives after spatial splits.
+	float sahCost = 0.f; // Expected cost of a random ray, relative to the root box.
+	double buildMs = 0.0;
+};
+
+std::ostream& operator <<(std::ostream& str, const BVHStats& stats)
+{
+	str << stats.primitives << " primitives, ";
+	if (stats.references != stats.primitives)
+		str << stats.references << " references, ";
+	str << stats.nodes << " nodes (" << stats.leaves << " leaves), depth " << stats.maxDepth
+		<< ", SAH cost " << stats.sahCost
+		<< ", built in " << stats.buildMs << " ms";
+	return str;
+}
+
+/// <summary>
+/// Counts of the work done tracing rays through a BVH, for comparing tree quality.
+/// </summary>
+struct TraversalStats
+{
+	long long rays = 0, nodeVisits = 0, primitiveTests = 0;
+};
+
+/// <summary>
+/// Used by the SpatialSAH build to split a primitive by the plane at position along axis,
+/// giving the bounds of the parts on either side (which are empty if it doesn't cross it).
+/// </summary>
+typedef std::function<void(int primitive, int axis, float position, AABB& left, AABB& right)> PrimitiveSplitter;
+
+/// <summary>
+/// A Bounding Volume Hierarchy over a set of primitives, each described only by its
+/// bounding box. The BVH does not know what the primitives are: it reorders references
+/// to them, and during traversal hands each leaf's references back to a caller-supplied
+/// function which performs the actual primitive intersection.
+/// The tree is built top-down using the Surface Area Heuristic (SAH), either by sweeping every
+/// candidate split position along all three axes, or by binning primitives. For scenes that are
+/// rebuilt every frame, the LBVH build skips the SAH entirely, and for primitives with badly
+/// overlapping boxes the SpatialSAH build can split them (see BVHBuildMethod).
+/// </summary>
+class BVH
+{
+public:
+	static constexpr int MAX_DEPTH = 64; // Also the size of the traversal stack.
+
+private:
+	static constexpr int MAX_BINS = 64;
+	static constexpr int PARALLEL_TASK_SIZE = 4096; // Subtrees with more primitives than this are built as separate tasks.
+	static constexpr float SPATIAL_SPLIT_ALPHA = 1e-5f; // Only try spatial splits where children overlap by this much of the root's area.
+
+	BVHNodeArray nodes_;
+	std::vector<int> primIndices_; // Primitive references, in leaf order.
+	BVHBuildOptions options_;
+	BVHStats stats_;
+	float builtSahCost_ = 0.f; // SAH cost straight after the last build, to measure refit degradation.
+
+	/// <summary>
+	/// Data shared by all the nodes of a build. Nodes are allocated from the preallocated
+	/// nodes_ array with an atomic counter, so subtrees can be built in parallel.
+	/// </summary>
+	struct BuildState
+	{
+		const std::vector<AABB>& primBounds;
+		std::vector<Eigen::Vector3f> centroids;
+		std::atomic<int> nodeCount;
+
+		// Only used by the SpatialSAH build.
+		PrimitiveSplitter splitPrimitive;
+		float minOverlapArea = 0.f;
+
+		BuildState(const std::vector<AABB>& primBounds)
+			:primBounds(primBounds), centroids(primBounds.size()), nodeCount(1)
+		{}
+	};
+
+	/// <summary>
+	/// A reference to a primitive during the SpatialSAH build. Once a primitive has been
+	/// split, each of its references only bounds the part of it on its own side.
+	/// </summary>
+	struct Reference
+	{
+		AABB bounds;
+		int prim;
+	};
+
+	/// <summary>
+	/// Compute the bounds of node over primitive references [begin, end).
+	/// </summary>
+	void initNode(BuildState& state, int nodeIndex, int begin, int end)
+	{
+		BVHNode& node = nodes_[nodeIndex];
+		node.bounds = AABB();
+		for (int i = begin; i < end; ++i)
+			node.bounds.expand(state.primBounds[primIndices_[i]]);
+	}
+
+	/// <summary>
+	/// Decide from the SAH whether a node should be split, given the best split's
+	/// cost as a sum of child areas times child primitive counts.
+	/// If it shouldn't, the node is made a leaf.
+	/// </summary>
+	bool splitOrMakeLeaf(int nodeIndex, int begin, int end, float bestCost, bool canSplit)
+	{
+		BVHNode& node = nodes_[nodeIndex];
+		int count = end - begin;
+		float nodeArea = node.bounds.surfaceArea();
+		float leafCost = options_.intersectionCost * count;
+		float splitCost = options_.traversalCost +
+			(nodeArea > 0.f ? options_.intersectionCost * bestCost / nodeArea : leafCost);
+
+		if (!canSplit || (count <= options_.maxLeafSize && leafCost <= splitCost)) {
+			node.leftOrFirst = begin;
+			node.count = count;
+			return false;
+		}
+		return true;
+	}
+
+	int allocateChildren(BuildState& state, int nodeIndex)
+	{
+		int left = state.nodeCount.fetch_add(2);
+		nodes_[nodeIndex].leftOrFirst = left;
+		nodes_[nodeIndex].count = 0;
+		return left;
+	}
+
+	/// <summary>
+	/// Full-sweep SAH build: sorts the primitives by centroid along each axis and
+	/// evaluates every possible split position. High quality, but O(N log^2 N).
+	/// </summary>
+	void buildSweep(BuildState& state, int nodeIndex, int begin, int end, int depth)
+	{
+		initNode(state, nodeIndex, begin, end);
+		int count = end - begin;
+		const std::vector<AABB>& primBounds = state.primBounds;
+		const std::vector<Eigen::Vector3f>& centroids = state.centroids;
+
+		// Find the best split by sweeping over primitives sorted by centroid on each axis.
+		float bestCost = std::numeric_limits<float>::max();
+		int bestAxis = -1, bestSplit = -1;
+		if (count > 1 && depth < MAX_DEPTH - 1) {
+			std::vector<float> rightAreas(count);
+			std::vector<int> sorted(primIndices_.begin() + begin, primIndices_.begin() + end);
+			for (int axis = 0; axis < 3; ++axis) {
+				std::sort(sorted.begin(), sorted.end(), [&](int a, int b) {
+					return centroids[a][axis] < centroids[b][axis];
+				});
+
+				AABB rightBox;
+				for (int i = count - 1; i > 0; --i) {
+					rightBox.expand(primBounds[sorted[i]]);
+					rightAreas[i] = rightBox.surfaceArea();
+				}
+
+				AABB leftBox;
+				for (int i = 1; i < count; ++i) {
+					leftBox.expand(primBounds[sorted[i - 1]]);
+					float cost = leftBox.surfaceArea() * i + rightAreas[i] * (count - i);
+					if (cost < bestCost) {
+						bestCost = cost;
+						bestAxis = axis;
+						bestSplit = i;
+					}
+				}
+			}
+		}
+
+		if (!splitOrMakeLeaf(nodeIndex, begin, end, bestCost, bestAxis >= 0)) return;
+
+		// Partition the references at the chosen split, then recurse.
+		int mid = begin + bestSplit;
+		std::nth_element(primIndices_.begin() + begin, primIndices_.begin() + mid, primIndices_.begin() + end,
+			[&](int a, int b) {
+				return centroids[a][bestAxis] < centroids[b][bestAxis];
+			});
+
+		int left = allocateChildren(state, nodeIndex);
+		buildSweep(state, left, begin, mid, depth + 1);
+		buildSweep(state, left + 1, mid, end, depth + 1);
+	}
+
+	/// <summary>
+	/// Binned SAH build: primitives are put into equal-width bins by centroid along each
+	/// axis, and only splits between bins are evaluated, which is O(N) per node.
+	/// The bounds of the node and of its primitives' centroids are passed down from the
+	/// parent, which gets them from the bins. Large subtrees are built as parallel OpenMP tasks.
+	/// </summary>
+	void buildBinned(BuildState& state, int nodeIndex, int begin, int end, int depth,
+		const AABB& bounds, const AABB& centroidBounds)
+	{
+		nodes_[nodeIndex].bounds = bounds;
+		int count = end - begin;
+		const std::vector<AABB>& primBounds = state.primBounds;
+		const std::vector<Eigen::Vector3f>& centroids = state.centroids;
+
+		struct Bin { AABB bounds, centroidBounds; int count = 0; };
+		int binCount = std::max(2, std::min(options_.bins, static_cast<int>(MAX_BINS)));
+
+		float bestCost = std::numeric_limits<float>::max();
+		int bestAxis = -1, bestBin = -1;
+		std::vector<Bin> bins;
+		Eigen::Vector3f scale;
+		if (count > 1 && depth < MAX_DEPTH - 1) {
+			// Small nodes get fewer bins; there's no point in having many more bins than primitives.
+			binCount = std::max(2, std::min(binCount, 2 * count));
+			bins.resize(3 * binCount);
+			Eigen::Vector3f extent = centroidBounds.extent();
+			for (int axis = 0; axis < 3; ++axis)
+				scale[axis] = extent[axis] > 0.f ? binCount / extent[axis] : 0.f;
+
+			// Bin along all three axes in one pass over the primitives.
+			for (int i = begin; i < end; ++i) {
+				int p = primIndices_[i];
+				const Eigen::Vector3f& c = centroids[p];
+				for (int axis = 0; axis < 3; ++axis) {
+					int b = std::min(binCount - 1, static_cast<int>((c[axis] - centroidBounds.min[axis]) * scale[axis]));
+					bins[axis * binCount + b].count++;
+					bins[axis * binCount + b].bounds.expand(primBounds[p]);
+					bins[axis * binCount + b].centroidBounds.expand(c);
+				}
+			}
+
+			for (int axis = 0; axis < 3; ++axis) {
+				if (scale[axis] == 0.f) continue;
+
+				// Sweep from the right to get the cost of everything right of each split,
+				// then from the left to find the best split.
+				float rightCosts[MAX_BINS];
+				AABB rightBox;
+				int rightCount = 0;
+				for (int b = binCount - 1; b > 0; --b) {
+					rightBox.expand(bins[axis * binCount + b].bounds);
+					rightCount += bins[axis * binCount + b].count;
+					rightCosts[b] = rightCount > 0 ? rightBox.surfaceArea() * rightCount : 0.f;
+				}
+
+				AABB leftBox;
+				int leftCount = 0;
+				for (int b = 0; b < binCount - 1; ++b) {
+					leftBox.expand(bins[axis * binCount + b].bounds);
+					leftCount += bins[axis * binCount + b].count;
+					if (leftCount == 0 || leftCount == count) continue;
+					float cost = leftBox.surfaceArea() * leftCount + rightCosts[b + 1];
+					if (cost < bestCost) {
+						bestCost = cost;
+						bestAxis = axis;
+						bestBin = b;
+					}
+				}
+			}
+		}
+
+		// If all centroids coincide no split was found, but large nodes still have to be split.
+		bool canSplit = bestAxis >= 0 || (count > options_.maxLeafSize && depth < MAX_DEPTH - 1);
+		if (!splitOrMakeLeaf(nodeIndex, begin, end, bestCost, canSplit)) return;
+
+		int mid;
+		AABB leftBounds, rightBounds, leftCentroids, rightCentroids;
+		if (bestAxis >= 0) {
+			float axisMin = centroidBounds.min[bestAxis], axisScale = scale[bestAxis];
+			mid = static_cast<int>(std::partition(primIndices_.begin() + begin, primIndices_.begin() + end,
+				[&](int p) {
+					int b = std::min(binCount - 1, static_cast<int>((centroids[p][bestAxis] - axisMin) * axisScale));
+					return b <= bestBin;
+				}) - primIndices_.begin());
+			for (int b = 0; b < binCount; ++b) {
+				const Bin& bin = bins[bestAxis * binCount + b];
+				(b <= bestBin ? leftBounds : rightBounds).expand(bin.bounds);
+				(b <= bestBin ? leftCentroids : rightCentroids).expand(bin.centroidBounds);
+			}
+		}
+		else {
+			mid = begin + count / 2;
+			for (int i = begin; i < end; ++i) {
+				int p = primIndices_[i];
+				(i < mid ? leftBounds : rightBounds).expand(primBounds[p]);
+				(i < mid ? leftCentroids : rightCentroids).expand(centroids[p]);
+			}
+		}
+
+		int left = allocateChildren(state, nodeIndex);
+#pragma omp task shared(state) if(count > PARALLEL_TASK_SIZE)
+		buildBinned(state, left, begin, mid, depth + 1, leftBounds, leftCentroids);
+		buildBinned(state, left + 1, mid, end, depth + 1, rightBounds, rightCentroids);
+	}
+
+	/// <summary>
+	/// LBVH build over primitive references sorted by Morton code: each node is split where
+	/// the highest bit that differs between its first and last codes changes, found by binary
+	/// search. Every node takes O(log N) work, and bounds are merged bottom-up.
+	/// </summary>
+	template <typename Key>
+	void buildLBVH(BuildState& state, const std::vector<Key>& codes, int nodeIndex, int begin, int end, int depth)
+	{
+		BVHNode& node = nodes_[nodeIndex];
+		int count = end - begin;
+		if (count <= options_.maxLeafSize || depth >= MAX_DEPTH - 1) {
+			initNode(state, nodeIndex, begin, end);
+			node.leftOrFirst = begin;
+			node.count = count;
+			return;
+		}
+
+		int mid;
+		Key differing = codes[begin] ^ codes[end - 1];
+		if (differing == 0) {
+			// Identical codes, so split in the middle.
+			mid = begin + count / 2;
+		}
+		else {
+			Key highBit = Key(1) << (8 * sizeof(Key) - 1);
+			while (!(differing & highBit)) highBit >>= 1;
+			mid = static_cast<int>(std::partition_point(codes.begin() + begin, codes.begin() + end,
+				[&](Key code) { return !(code & highBit); }) - codes.begin());
+		}
+
+		int left = allocateChildren(state, nodeIndex);
+#pragma omp task shared(state, codes) if(count > PARALLEL_TASK_SIZE)
+		buildLBVH(state, codes, left, begin, mid, depth + 1);
+		buildLBVH(state, codes, left + 1, mid, end, depth + 1);
+#pragma omp taskwait
+
+		node.bounds = nodes_[left].bounds;
+		node.bounds.expand(nodes_[left + 1].bounds);
+	}
+
+	/// <summary>
+	/// Sort the primitive references by the Morton codes of their centroids, then build.
+	/// </summary>
+	template <typename Key>
+	void buildMorton(BuildState& state, Key (*mortonCode)(const Eigen::Vector3f&), int keyBits)
+	{
+		int primCount = static_cast<int>(primIndices_.size());
+		AABB centroidBounds;
+		for (int i = 0; i < primCount; ++i)
+			centroidBounds.expand(state.centroids[i]);
+		Eigen::Vector3f extent = centroidBounds.extent();
+		Eigen::Vector3f scale;
+		for (int a = 0; a < 3; ++a)
+			scale[a] = extent[a] > 0.f ? 1.f / extent[a] : 0.f;
+
+		std::vector<Key> codes(primCount);
+#pragma omp parallel for
+		for (int i = 0; i < primCount; ++i)
+			codes[i] = mortonCode((state.centroids[i] - centroidBounds.min).cwiseProduct(scale));
+		radixSort(codes, primIndices_, keyBits);
+
+#pragma omp parallel
+#pragma omp single nowait
+		buildLBVH(state, codes, 0, 0, primCount, 1);
+	}
+
+	/// <summary>
+	/// SpatialSAH build (SBVH), after Stich et al. 2009. The best binned object split is found
+	/// as in the binned build. If its children overlap, spatial splits are tried too: the node
+	/// is cut into equal slabs, and references that cross slab boundaries are split with
+	/// state.splitPrimitive, so they only add their clipped bounds to each slab. A spatial split
+	/// is taken if it is cheaper, and as long as the duplicated references fit in the node's
+	/// budget, which is shared out between its children.
+	/// When partitioning, references are only split if that is cheaper than moving them whole
+	/// to either side ("reference unsplitting").
+	/// Built serially, as the number of references isn't known in advance.
+	/// </summary>
+	void buildSpatial(BuildState& state, int nodeIndex, std::vector<Reference>& refs, int depth, int budget)
+	{
+		BVHNode& node = nodes_[nodeIndex];
+		int count = static_cast<int>(refs.size());
+		AABB centroidBounds;
+		node.bounds = AABB();
+		for (const Reference& ref : refs) {
+			node.bounds.expand(ref.bounds);
+			centroidBounds.expand(ref.bounds.centroid());
+		}
+
+		int binCount = std::max(2, std::min(std::min(options_.bins, static_cast<int>(MAX_BINS)), 2 * count));
+		float bestCost = std::numeric_limits<float>::max();
+		int bestAxis = -1, bestBin = -1;
+		bool spatial = false;
+		AABB bestLeft, bestRight;
+		int bestLeftCount = 0, bestRightCount = 0;
+		if (count > 1 && depth < MAX_DEPTH - 1) {
+			// Object split, binning reference centroids.
+			struct Bin { AABB bounds; int count = 0; };
+			Eigen::Vector3f extent = centroidBounds.extent();
+			for (int axis = 0; axis < 3; ++axis) {
+				if (extent[axis] <= 0.f) continue;
+				float scale = binCount / extent[axis];
+				std::vector<Bin> bins(binCount);
+				for (const Reference& ref : refs) {
+					int b = std::min(binCount - 1, static_cast<int>((ref.bounds.centroid()[axis] - centroidBounds.min[axis]) * scale));
+					bins[b].count++;
+					bins[b].bounds.expand(ref.bounds);
+				}
+				std::vector<AABB> rightBoxes(binCount);
+				AABB rightBox;
+				for (int b = binCount - 1; b > 0; --b) {
+					rightBox.expand(bins[b].bounds);
+					rightBoxes[b] = rightBox;
+				}
+				AABB leftBox;
+				int leftCount = 0;
+				for (int b = 0; b < binCount - 1; ++b) {
+					leftBox.expand(bins[b].bounds);
+					leftCount += bins[b].count;
+					if (leftCount == 0 || leftCount == count) continue;
+					float cost = leftBox.surfaceArea() * leftCount + rightBoxes[b + 1].surfaceArea() * (count - leftCount);
+					if (cost < bestCost) {
+						bestCost = cost;
+						bestAxis = axis;
+						bestBin = b;
+						bestLeft = leftBox;
+						bestRight = rightBoxes[b + 1];
+					}
+				}
+			}
+
+			// Spatial split, if the object split's children overlap.
+			bool overlapping = bestAxis < 0 || bestLeft.intersection(bestRight).surfaceArea() > state.minOverlapArea;
+			if (state.splitPrimitive && overlapping && budget > 0) {
+				struct SpatialBin { AABB bounds; int entries = 0, exits = 0; };
+				Eigen::Vector3f nodeExtent = node.bounds.extent();
+				for (int axis = 0; axis < 3; ++axis) {
+					if (nodeExtent[axis] <= 0.f) continue;
+					float axisMin = node.bounds.min[axis], scale = binCount / nodeExtent[axis];
+					auto binOf = [&](float x) { return std::min(binCount - 1, std::max(0, static_cast<int>((x - axisMin) * scale))); };
+
+					std::vector<SpatialBin> bins(binCount);
+					for (const Reference& ref : refs) {
+						int first = binOf(ref.bounds.min[axis]), last = binOf(ref.bounds.max[axis]);
+						bins[first].entries++;
+						bins[last].exits++;
+						AABB rest = ref.bounds;
+						for (int b = first; b < last; ++b) {
+							AABB left, right;
+							state.splitPrimitive(ref.prim, axis, axisMin + (b + 1) / scale, left, right);
+							left = left.intersection(rest);
+							if (!left.empty()) bins[b].bounds.expand(left);
+							rest = right.intersection(rest);
+						}
+						if (!rest.empty()) bins[last].bounds.expand(rest);
+					}
+
+					// Right of a split are the references that exit after it, left those that enter before it.
+					std::vector<AABB> rightBoxes(binCount);
+					std::vector<int> rightCounts(binCount);
+					AABB rightBox;
+					int rightCount = 0;
+					for (int b = binCount - 1; b > 0; --b) {
+						rightBox.expand(bins[b].bounds);
+						rightCount += bins[b].exits;
+						rightBoxes[b] = rightBox;
+						rightCounts[b] = rightCount;
+					}
+					AABB leftBox;
+					int leftCount = 0;
+					for (int b = 0; b < binCount - 1; ++b) {
+						leftBox.expand(bins[b].bounds);
+						leftCount += bins[b].entries;
+						rightCount = rightCounts[b + 1];
+						if (leftCount == 0 || rightCount == 0) continue;
+						if (leftCount + rightCount - count > budget) continue;
+						float cost = leftBox.surfaceArea() * leftCount + rightBoxes[b + 1].surfaceArea() * rightCount;
+						if (cost < bestCost) {
+							bestCost = cost;
+							bestAxis = axis;
+							bestBin = b;
+							bestLeft = leftBox;
+							bestRight = rightBoxes[b + 1];
+							bestLeftCount = leftCount;
+							bestRightCount = rightCount;
+							spatial = true;
+						}
+					}
+				}
+			}
+		}
+
+		int begin = static_cast<int>(primIndices_.size());
+		bool canSplit = bestAxis >= 0 || (count > options_.maxLeafSize && depth < MAX_DEPTH - 1);
+		if (!splitOrMakeLeaf(nodeIndex, begin, begin + count, bestCost, canSplit)) {
+			for (const Reference& ref : refs)
+				primIndices_.push_back(ref.prim);
+			return;
+		}
+
+		std::vector<Reference> left, right;
+		if (bestAxis < 0) {
+			// No split found, but large nodes still have to be split.
+			left.assign(refs.begin(), refs.begin() + count / 2);
+			right.assign(refs.begin() + count / 2, refs.end());
+		}
+		else if (!spatial) {
+			float scale = binCount / centroidBounds.extent()[bestAxis];
+			for (const Reference& ref : refs) {
+				int b = std::min(binCount - 1, static_cast<int>((ref.bounds.centroid()[bestAxis] - centroidBounds.min[bestAxis]) * scale));
+				(b <= bestBin ? left : right).push_back(ref);
+			}
+		}
+		else {
+			float axisMin = node.bounds.min[bestAxis], scale = binCount / node.bounds.extent()[bestAxis];
+			auto binOf = [&](float x) { return std::min(binCount - 1, std::max(0, static_cast<int>((x - axisMin) * scale))); };
+			for (const Reference& ref : refs) {
+				if (binOf(ref.bounds.max[bestAxis]) <= bestBin)
+					left.push_back(ref);
+				else if (binOf(ref.bounds.min[bestAxis]) > bestBin)
+					right.push_back(ref);
+				else {
+					// Reference unsplitting: if putting the whole reference on one side
+					// is cheaper than splitting it, do that instead.
+					float splitCost = bestLeft.surfaceArea() * bestLeftCount + bestRight.surfaceArea() * bestRightCount;
+					AABB leftUnsplit = bestLeft, rightUnsplit = bestRight;
+					leftUnsplit.expand(ref.bounds);
+					rightUnsplit.expand(ref.bounds);
+					float leftCost = leftUnsplit.surfaceArea() * bestLeftCount + bestRight.surfaceArea() * (bestRightCount - 1);
+					float rightCost = bestLeft.surfaceArea() * (bestLeftCount - 1) + rightUnsplit.surfaceArea() * bestRightCount;
+					if (leftCost < splitCost && leftCost <= rightCost) {
+						left.push_back(ref);
+						bestLeft = leftUnsplit;
+						bestRightCount--;
+						continue;
+					}
+					if (rightCost < splitCost) {
+						right.push_back(ref);
+						bestRight = rightUnsplit;
+						bestLeftCount--;
+						continue;
+					}
+
+					AABB leftPart, rightPart;
+					state.splitPrimitive(ref.prim, bestAxis, axisMin + (bestBin + 1) / scale, leftPart, rightPart);
+					leftPart = leftPart.intersection(ref.bounds);
+					rightPart = rightPart.intersection(ref.bounds);
+					if (!leftPart.empty()) left.push_back({ leftPart, ref.prim });
+					if (!rightPart.empty()) right.push_back({ rightPart, ref.prim });
+				}
+			}
+			if (left.empty() || right.empty()) {
+				// Unsplitting moved everything to one side, so fall back to a median split.
+				left.insert(left.end(), right.begin(), right.end());
+				right.assign(left.begin() + left.size() / 2, left.end());
+				left.resize(left.size() / 2);
+			}
+			budget -= static_cast<int>(left.size() + right.size()) - count;
+		}
+		std::vector<Reference>().swap(refs);
+
+		int leftIndex = allocateChildren(state, nodeIndex);
+		// Share the remaining budget between the children by size, so the top of the tree can't use it all up.
+		int leftBudget = static_cast<int>(static_cast<int64_t>(budget) * left.size() / (left.size() + right.size()));
+		int rightBudget = budget - leftBudget;
+		buildSpatial(state, leftIndex, left, depth + 1, leftBudget);
+		buildSpatial(state, leftIndex + 1, right, depth + 1, rightBudget);
+	}
+
+	/// <summary>
+	/// Append the interior nodes of the subtree under nodeIndex, down to levels levels below it,
+	/// in Treelet layout order. heights gives the levels of interior nodes under each node.
+	/// </summary>
+	void layoutTreelet(int nodeIndex, int levels, const std::vector<int>& heights, std::vector<int>& order) const
+	{
+		if (levels == 0 || nodes_[nodeIndex].isLeaf()) return;
+		if (levels == 1) {
+			order.push_back(nodeIndex);
+			return;
+		}
+
+		// Lay out the top levels, then each subtree hanging below them.
+		int top = levels / 2;
+		layoutTreelet(nodeIndex, top, heights, order);
+		std::vector<int> frontier(1, nodeIndex);
+		for (int level = 0; level < top; ++level) {
+			std::vector<int> next;
+			for (int n : frontier) {
+				if (nodes_[n].isLeaf()) continue;
+				next.push_back(nodes_[n].leftOrFirst);
+				next.push_back(nodes_[n].leftOrFirst + 1);
+			}
+			frontier.swap(next);
+		}
+		for (int n : frontier)
+			layoutTreelet(n, std::min(heights[n], levels - top), heights, order);
+	}
+
+	/// <summary>
+	/// Reorder the nodes into the given layout. The root stays first, and slot 1 is padding, so
+	/// that every sibling pair starts on a cache line. The padding mirrors the root, so it is
+	/// harmless to refit, but nothing points to it.
+	/// </summary>
+	void reorderNodes(BVHNodeLayout layout)
+	{
+		if (layout == BVHNodeLayout::BuildOrder || nodes_.size() < 3) return;
+
+		// Interior nodes in the order their child pairs will be stored.
+		std::vector<int> order;
+		order.reserve(nodes_.size() / 2);
+		if (layout == BVHNodeLayout::DepthFirst) {
+			std::vector<int> stack(1, 0);
+			while (!stack.empty()) {
+				int n = stack.back();
+				stack.pop_back();
+				if (nodes_[n].isLeaf()) continue;
+				order.push_back(n);
+				stack.push_back(nodes_[n].leftOrFirst + 1);
+				stack.push_back(nodes_[n].leftOrFirst);
+			}
+		}
+		else {
+			// Heights in interior node levels. Children are stored after their parent.
+			std::vector<int> heights(nodes_.size(), 0);
+			for (int n = static_cast<int>(nodes_.size()) - 1; n >= 0; --n) {
+				if (!nodes_[n].isLeaf())
+					heights[n] = 1 + std::max(heights[nodes_[n].leftOrFirst], heights[nodes_[n].leftOrFirst + 1]);
+			}
+			layoutTreelet(0, heights[0], heights, order);
+		}
+
+		std::vector<int> newIndex(nodes_.size(), 0);
+		int next = 2;
+		for (int n : order) {
+			newIndex[nodes_[n].leftOrFirst] = next;
+			newIndex[nodes_[n].leftOrFirst + 1] = next + 1;
+			next += 2;
+		}
+
+		BVHNodeArray reordered(next);
+		reordered[0] = nodes_[0];
+		for (int n : order) {
+			for (int c = 0; c < 2; ++c) {
+				int child = nodes_[n].leftOrFirst + c;
+				reordered[newIndex[child]] = nodes_[child];
+			}
+		}
+		for (BVHNode& node : reordered) {
+			if (!node.isLeaf()) node.leftOrFirst = newIndex[node.leftOrFirst];
+		}
+		reordered[1] = reordered[0];
+		nodes_.swap(reordered);
+	}
+
+	void computeStats()
+	{
+		stats_.references = static_cast<int>(primIndices_.size());
+		stats_.nodes = 0;
+		stats_.leaves = 0;
+		stats_.maxDepth = 0;
+		stats_.sahCost = 0.f;
+		if (nodes_.empty()) return;
+
+		// Children are always stored after their parents, so depths can be filled in order.
+		// Nodes left at depth 0 aren't in the tree (see reorderNodes).
+		std::vector<int> depths(nodes_.size(), 0);
+		depths[0] = 1;
+
+		float rootArea = nodes_[0].bounds.surfaceArea();
+		for (size_t n = 0; n < nodes_.size(); ++n) {
+			const BVHNode& node = nodes_[n];
+			if (depths[n] == 0) continue;
+			stats_.nodes++;
+			stats_.maxDepth = std::max(stats_.maxDepth, depths[n]);
+			float relArea = rootArea > 0.f ? node.bounds.surfaceArea() / rootArea : 1.f;
+			if (node.isLeaf()) {
+				stats_.leaves++;
+				stats_.sahCost += options_.intersectionCost * node.count * relArea;
+			}
+			else {
+				stats_.sahCost += options_.traversalCost * relArea;
+				depths[node.leftOrFirst] = depths[node.leftOrFirst + 1] = depths[n] + 1;
+			}
+		}
+	}
+
+public:
+	BVH()
+	{}
+
+	/// <summary>
+	/// Build the hierarchy over primitives with the given bounding boxes.
+	/// Primitive i is referred to by index i in primIndices(). The SpatialSAH build also
+	/// needs splitPrimitive; without it, it only makes object splits. With it, primitives
+	/// may be referred to by more than one leaf.
+	/// </summary>
+	void build(const std::vector<AABB>& primBounds, const BVHBuildOptions& options = BVHBuildOptions(),
+		const PrimitiveSplitter& splitPrimitive = nullptr)
+	{
+		auto startTime = std::chrono::steady_clock::now();
+
+		options_ = options;
+		stats_ = BVHStats();
+		stats_.primitives = static_cast<int>(primBounds.size());
+		nodes_.clear();
+		primIndices_.resize(primBounds.size());
+		std::iota(primIndices_.begin(), primIndices_.end(), 0);
+
+		if (!primBounds.empty()) {
+			int primCount = static_cast<int>(primBounds.size());
+			BuildState state(primBounds);
+#pragma omp parallel for
+			for (int i = 0; i < primCount; ++i)
+				state.centroids[i] = primBounds[i].centroid();
+
+			// A binary tree with at most one primitive reference per leaf has at most 2N - 1 nodes.
+			int maxReferences = primCount;
+			if (options_.method == BVHBuildMethod::SpatialSAH && splitPrimitive)
+				maxReferences += static_cast<int>(options_.spatialSplitBudget * primCount);
+			nodes_.resize(2 * static_cast<size_t>(maxReferences) - 1);
+
+			switch (options_.method) {
+			case BVHBuildMethod::SweepSAH:
+				buildSweep(state, 0, 0, primCount, 1);
+				break;
+			case BVHBuildMethod::BinnedSAH: {
+				AABB bounds, centroidBounds;
+				for (int i = 0; i < primCount; ++i) {
+					bounds.expand(primBounds[i]);
+					centroidBounds.expand(state.centroids[i]);
+				}
+#pragma omp parallel
+#pragma omp single nowait
+				buildBinned(state, 0, 0, primCount, 1, bounds, centroidBounds);
+				break;
+			}
+			case BVHBuildMethod::LBVH:
+				if (options_.mortonBits > 30)
+					buildMorton<uint64_t>(state, mortonCode63, 63);
+				else
+					buildMorton<uint32_t>(state, mortonCode30, 30);
+				break;
+			case BVHBuildMethod::SpatialSAH: {
+				std::vector<Reference> refs(primCount);
+				AABB bounds;
+				for (int i = 0; i < primCount; ++i) {
+					refs[i] = { primBounds[i], i };
+					bounds.expand(primBounds[i]);
+				}
+				state.splitPrimitive = splitPrimitive;
+				state.minOverlapArea = SPATIAL_SPLIT_ALPHA * bounds.surfaceArea();
+				primIndices_.clear();
+				primIndices_.reserve(maxReferences);
+				buildSpatial(state, 0, refs, 1, maxReferences - primCount);
+				break;
+			}
+			}
+
+			nodes_.resize(state.nodeCount);
+			reorderNodes(options_.layout);
+		}
+
+		computeStats();
+		builtSahCost_ = stats_.sahCost;
+		stats_.buildMs = std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - startTime).count();
+	}
+
+	/// <summary>
+	/// Update node bounds bottom-up for new primitive bounds, keeping the tree topology.
+	/// Much cheaper than a rebuild, but the tree quality degrades if primitives move far:
+	/// check needsRebuild afterwards.
+	/// </summary>
+	void refit(const std::vector<AABB>& primBounds)
+	{
+		// Children are always stored after their parent, so a reverse sweep visits
+		// both children of a node before the node itself.
+		for (int n = static_cast<int>(nodes_.size()) - 1; n >= 0; --n) {
+			BVHNode& node = nodes_[n];
+			node.bounds = AABB();
+			if (node.isLeaf()) {
+				for (int i = node.leftOrFirst; i < node.leftOrFirst + node.count; ++i)
+					node.bounds.expand(primBounds[primIndices_[i]]);
+			}
+			else {
+				node.bounds.expand(nodes_[node.leftOrFirst].bounds);
+				node.bounds.expand(nodes_[node.leftOrFirst + 1].bounds);
+			}
+		}
+		computeStats();
+	}
+
+	/// <summary>
+	/// Has refitting made the tree's SAH cost grow past options.rebuildCostRatio times
+	/// its cost when it was built?
+	/// </summary>
+	bool needsRebuild() const
+	{
+		return options_.rebuildCostRatio > 0.f && stats_.sahCost > options_.rebuildCostRatio * builtSahCost_;
+	}
+
+	/// <summary>
+	/// Write the built tree, for reading back with read. The format is the raw memory layout,
+	/// so it is only meant for caching on the same machine.
+	/// </summary>
+	void write(std::ostream& out) const
+	{
+		writeValue(out, options_);
+		writeValue(out, stats_);
+		writeValue(out, builtSahCost_);
+		writeArray(out, nodes_);
+		writeArray(out, primIndices_);
+	}
+
+	/// <summary>
+	/// Read a tree written by write. Returns false if the data is cut short.
+	/// </summary>
+	bool read(BinaryReader& in)
+	{
+		return in.read(options_) && in.read(stats_) && in.read(builtSahCost_)
+			&& in.readArray(nodes_) && in.readArray(primIndices_);
+	}
+
+	const BVHBuildOptions& options() const
+	{
+		return options_;
+	}
+
+	const BVHNodeArray& nodes() const
+	{
+		return nodes_;
+	}
+
+	const std::vector<int>& primIndices() const
+	{
+		return primIndices_;
+	}
+
+	const BVHStats& stats() const
+	{
+		return stats_;
+	}
+
+	AABB bounds() const
+	{
+		return nodes_.empty() ? AABB() : nodes_[0].bounds;
+	}
+
+	size_t memoryBytes() const
+	{
+		return nodes_.size() * sizeof(BVHNode) + primIndices_.size() * sizeof(int);
+	}
+
+	/// <summary>
+	/// Walk the tree front-to-back along a ray. For each primitive reference in a leaf the
+	/// ray reaches, intersectPrimitive(ref, maxT) is called, where ref indexes primIndices().
+	/// It should return true on a hit, after reducing maxT to the hit distance. Subtrees
+	/// further away than the closest hit so far are skipped.
+	/// If stats is given, the nodes visited and primitives tested are added to it.
+	/// </summary>
+	template <typename IntersectPrimitive>
+	bool traverse(const Eigen::Vector3f& origin, const Eigen::Vector3f& direction,
+		float minT, float& maxT, IntersectPrimitive intersectPrimitive, TraversalStats* stats = nullptr) const
+	{
+		if (stats) stats->rays++;
+		if (nodes_.empty()) return false;
+
+		Eigen::Vector3f invDir = direction.cwiseInverse();
+		float tEntry;
+		if (!nodes_[0].bounds.intersect(origin, invDir, minT, maxT, tEntry)) return false;
+
+		struct StackEntry { int node; float tEntry; };
+		StackEntry stack[MAX_DEPTH];
+		int stackSize = 0;
+
+		bool hit = false;
+		int nodeIndex = 0;
+		while (true) {
+			const BVHNode& node = nodes_[nodeIndex];
+			if (stats) stats->nodeVisits++;
+			if (node.isLeaf()) {
+				if (stats) stats->primitiveTests += node.count;
+				for (int i = node.leftOrFirst; i < node.leftOrFirst + node.count; ++i) {
+					if (intersectPrimitive(i, maxT)) hit = true;
+				}
+			}
+			else {
+				int left = node.leftOrFirst, right = left + 1;
+				float tLeft, tRight;
+				bool hitLeft = nodes_[left].bounds.intersect(origin, invDir, minT, maxT, tLeft);
+				bool hitRight = nodes_[right].bounds.intersect(origin, invDir, minT, maxT, tRight);
+
+				if (hitLeft && hitRight) {
+					// Visit the nearer child first, and come back for the other if needed.
+					if (tRight < tLeft) {
+						std::swap(left, right);
+						std::swap(tLeft, tRight);
+					}
+					stack[stackSize++] = { right, tRight };
+					nodeIndex = left;
+					continue;
+				}
+				if (hitLeft) { nodeIndex = left; continue; }
+				if (hitRight) { nodeIndex = right; continue; }
+			}
+
+			// Pop the next subtree that could still contain a closer hit.
+			while (stackSize > 0 && stack[stackSize - 1].tEntry > maxT)
+				--stackSize;
+			if (stackSize == 0) break;
+			nodeIndex = stack[--stackSize].node;
+		}
+
+		return hit;
+	}
+
+	/// <summary>
+	/// Walk the tree along a ray until any primitive is hit between minT and maxT, for
+	/// occlusion queries. For each primitive reference in a leaf the ray reaches,
+	/// hitsPrimitive(ref) is called, and should return true if the ray hits it in that range.
+	/// Returns true as soon as one does, without looking for the closest.
+	/// </summary>
+	template <typename HitsPrimitive>
+	bool traverseAny(const Eigen::Vector3f& origin, const Eigen::Vector3f& direction,
+		float minT, float maxT, HitsPrimitive hitsPrimitive, TraversalStats* stats = nullptr) const
+	{
+		if (stats) stats->rays++;
+		if (nodes_.empty()) return false;
+
+		Eigen::Vector3f invDir = direction.cwiseInverse();
+		float tEntry;
+		if (!nodes_[0].bounds.intersect(origin, invDir, minT, maxT, tEntry)) return false;
+
+		int stack[MAX_DEPTH];
+		int stackSize = 0;
+
+		int nodeIndex = 0;
+		while (true) {
+			const BVHNode& node = nodes_[nodeIndex];
+			if (stats) stats->nodeVisits++;
+			if (node.isLeaf()) {
+				for (int i = node.leftOrFirst; i < node.leftOrFirst + node.count; ++i) {
+					if (stats) stats->primitiveTests++;
+					if (hitsPrimitive(i)) return true;
+				}
+			}
+			else {
+				int left = node.leftOrFirst, right = left + 1;
+				bool hitLeft = nodes_[left].bounds.intersect(origin, invDir, minT, maxT, tEntry);
+				bool hitRight = nodes_[right].bounds.intersect(origin, invDir, minT, maxT, tEntry);
+
+				if (hitLeft && hitRight) {
+					stack[stackSize++] = right;
+					nodeIndex = left;
+					continue;
+				}
+				if (hitLeft) { nodeIndex = left; continue; }
+				if (hitRight) { nodeIndex = right; continue; }
+			}
+
+			if (stackSize == 0) break;
+			nodeIndex = stack[--stackSize];
+		}
+
+		return false;
+	}
+	/// <summary>
+	/// Walk the tree with a packet of rays, testing each node against PACKET_LANES rays at a
+	/// time. For each primitive reference in a leaf reached by any of the rays in active,
+	/// intersectPrimitive(ref, rays) is called with the mask of rays that reached it. maxT is
+	/// each ray's far limit, which intersectPrimitive may reduce as it finds hits.
+	/// Children are visited nearest first along the first ray still active.
+	/// </summary>
+	template <typename IntersectPrimitive>
+	void traversePacket(const RayPacket& packet, uint64_t active, float minT, const float* maxT,
+		IntersectPrimitive intersectPrimitive) const
+	{
+		if (nodes_.empty() || !active) return;
+
+		alignas(32) float invDir[3][RayPacket::MAX_SIZE];
+		for (int axis = 0; axis < 3; ++axis) {
+			for (int i = 0; i < packet.size; ++i)
+				invDir[axis][i] = 1.f / packet.direction[axis][i];
+		}
+
+		// Mask of the rays in rays that hit a box within their range.
+		PacketFloat minTs = PacketFloat::broadcast(minT);
+		auto raysHitting = [&](const AABB& box, uint64_t rays) {
+			uint64_t result = 0;
+			for (int first = 0; first < packet.size; first += PACKET_LANES) {
+				if (!RayPacket::laneBits(rays, first)) continue;
+				PacketFloat tNear = minTs, tFar = PacketFloat::load(&maxT[first]);
+				for (int axis = 0; axis < 3; ++axis) {
+					PacketFloat origin = PacketFloat::load(&packet.origin[axis][first]);
+					PacketFloat inv = PacketFloat::load(&invDir[axis][first]);
+					PacketFloat t0 = (PacketFloat::broadcast(box.min[axis]) - origin) * inv;
+					PacketFloat t1 = (PacketFloat::broadcast(box.max[axis]) - origin) * inv;
+					tNear = max(tNear, min(t0, t1));
+					tFar = min(tFar, max(t0, t1));
+				}
+				result |= static_cast<uint64_t>((tNear <= tFar).bits()) << first;
+			}
+			return result & rays;
+		};
+
+		struct StackEntry { int node; uint64_t rays; };
+		StackEntry stack[MAX_DEPTH];
+		int stackSize = 0;
+
+		uint64_t rays = raysHitting(nodes_[0].bounds, active);
+		int nodeIndex = 0;
+		while (true) {
+			const BVHNode& node = nodes_[nodeIndex];
+			if (rays && node.isLeaf()) {
+				for (int i = node.leftOrFirst; i < node.leftOrFirst + node.count; ++i)
+					intersectPrimitive(i, rays);
+			}
+			else if (rays) {
+				int left = node.leftOrFirst, right = left + 1;
+				uint64_t leftRays = raysHitting(nodes_[left].bounds, rays);
+				uint64_t rightRays = raysHitting(nodes_[right].bounds, rays);
+
+				if (leftRays && rightRays) {
+					int lead = 0;
+					while (!(rays >> lead & 1)) ++lead;
+					Eigen::Vector3f leadDir(packet.direction[0][lead], packet.direction[1][lead], packet.direction[2][lead]);
+					if (leadDir.dot(nodes_[right].bounds.centroid() - nodes_[left].bounds.centroid()) < 0.f) {
+						std::swap(left, right);
+						std::swap(leftRays, rightRays);
+					}
+					stack[stackSize++] = { right, rightRays };
+					nodeIndex = left;
+					rays = leftRays;
+					continue;
+				}
+				if (leftRays) { nodeIndex = left; rays = leftRays; continue; }
+				if (rightRays) { nodeIndex = right; rays = rightRays; continue; }
+			}
+
+			if (stackSize == 0) break;
+			--stackSize;
+			nodeIndex = stack[stackSize].node;
+			// Rays may have found closer hits since the node was pushed.
+			rays = raysHitting(nodes_[nodeIndex].bounds, stack[stackSize].rays);
+		}
+	}
+};
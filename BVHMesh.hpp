@@ -0,0 +1,38 @@
+#pragma once
+#include "MeshInstance.hpp"
+
+/// <summary>
+/// A BVHMesh is a triangle mesh accelerated by a Bounding Volume Hierarchy built over its
+/// faces when it is constructed. Rays only test the triangles in the leaves they pass through,
+/// so intersection cost grows roughly logarithmically with the number of triangles,
+/// rather than linearly as with Mesh and AABBMesh.
+/// The hierarchy is built in object space, and rays are transformed into object space to
+/// traverse it, so changing modelToWorld is free.
+/// To place more copies of the same mesh, make MeshInstances from sharedBVH().
+/// After moving the Model's vertices, call update (or update the containing Scene) to refit
+/// the hierarchy, which also refits it for all those instances.
+/// </summary>
+class BVHMesh : public MeshInstance
+{
+private:
+	std::shared_ptr<MeshBVH> ownedBVH_;
+
+	BVHMesh(const Shader* shader, std::shared_ptr<MeshBVH> bvh, bool culling, IntersectMask mask)
+		:MeshInstance(shader, bvh, culling, mask), ownedBVH_(bvh)
+	{}
+
+public:
+	/// <summary>
+	/// Build the BVH, or load it from cacheDirectory if it has been built before (see MeshBVH).
+	/// </summary>
+	BVHMesh(const Shader* shader, const Model* model, bool culling=true, IntersectMask mask=DEFAULT_BITMASK,
+		const BVHBuildOptions& options=BVHBuildOptions(), const std::string& cacheDirectory="")
+		:BVHMesh(shader, std::make_shared<MeshBVH>(model, options, cacheDirectory), culling, mask)
+	{}
+
+	virtual bool update() override
+	{
+		ownedBVH_->update();
+		return MeshInstance::update();
+	}
+};
@@ -0,0 +1,244 @@
+#pragma once
+#include "Renderable.hpp"
+#include "Camera.hpp"
+#include "AABB.hpp"
+#include "Scene.hpp"
+#include "GridScene.hpp"
+#include "Sphere.hpp"
+#include "Model.hpp"
+#include "MeshBVH.hpp"
+#include "KdTreeMesh.hpp"
+#include "PerfCounter.hpp"
+#include "WavefrontRenderer.hpp"
+#include <chrono>
+#include <random>
+#include <string>
+#include <iostream>
+
+/// <summary>
+/// Make a camera looking down the z axis at a bounding box, framing it so the
+/// whole box is in view. Used to benchmark intersection against a single object.
+/// </summary>
+Camera makeBenchmarkCamera(const AABB& bounds, int pixWidth, int pixHeight)
+{
+	float fov = .785f;
+	float radius = .5f * bounds.extent().norm();
+	Eigen::Vector3f centre = bounds.centroid();
+	float distance = radius / tanf(fov / 2.f) + radius;
+	return Camera(
+		centre - Eigen::Vector3f(0.f, 0.f, distance),
+		Eigen::Vector3f(0.f, 0.f, 1.f),
+		Eigen::Vector3f(0.f, 1.f, 0.f),
+		pixWidth, pixHeight, fov);
+}
+
+/// <summary>
+/// Trace one primary ray per pixel against a single Renderable and return the
+/// throughput in millions of rays per second. The image is traced repeatedly
+/// for at least minSeconds, to even out timing noise.
+/// </summary>
+double measureRayThroughput(const Renderable& renderable, const Camera& cam, int pixWidth, int pixHeight,
+	double minSeconds=.25)
+{
+	auto startTime = std::chrono::steady_clock::now();
+	double seconds = 0.0;
+	int passes = 0;
+
+	do {
+#pragma omp parallel for
+		for (int y = 0; y < pixHeight; ++y) {
+			for (int x = 0; x < pixWidth; ++x) {
+				Ray ray = cam.getRay(x, y);
+				HitInfo hitInfo;
+				renderable.intersect(ray, 1e-6f, 1e6f, hitInfo, VISIBLE_BITMASK);
+			}
+		}
+		++passes;
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	} while (seconds < minSeconds);
+
+	return static_cast<double>(pixWidth) * pixHeight * passes / seconds * 1e-6;
+}
+
+/// <summary>
+/// As measureRayThroughput, but tracing the primary rays in packets of side x side pixels
+/// with intersectPacket.
+/// </summary>
+double measurePacketThroughput(const Renderable& renderable, const Camera& cam, int pixWidth, int pixHeight, int side,
+	double minSeconds=.25)
+{
+	int blocksX = (pixWidth + side - 1) / side, blocksY = (pixHeight + side - 1) / side;
+	auto startTime = std::chrono::steady_clock::now();
+	double seconds = 0.0;
+	int passes = 0;
+
+	do {
+#pragma omp parallel for
+		for (int by = 0; by < blocksY; ++by) {
+			RayPacket packet;
+			for (int bx = 0; bx < blocksX; ++bx) {
+				uint64_t active = cam.getPacket(bx * side, by * side, side, packet);
+				PacketHits hits(packet.size, 1e6f);
+				renderable.intersectPacket(packet, active, 1e-6f, hits, VISIBLE_BITMASK);
+			}
+		}
+		++passes;
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	} while (seconds < minSeconds);
+
+	return static_cast<double>(pixWidth) * pixHeight * passes / seconds * 1e-6;
+}
+
+/// <summary>
+/// Trace one primary ray per pixel through a Renderable one ray at a time and in 4x4 and 8x8
+/// packets, and print the throughput of each.
+/// </summary>
+void reportPrimaryThroughput(const std::string& name, const Renderable& renderable, const Camera& cam, int pixWidth, int pixHeight)
+{
+	std::cout << name << ": " << measureRayThroughput(renderable, cam, pixWidth, pixHeight) << " Mrays/s, 4x4 packets "
+		<< measurePacketThroughput(renderable, cam, pixWidth, pixHeight, 4) << " Mrays/s, 8x8 packets "
+		<< measurePacketThroughput(renderable, cam, pixWidth, pixHeight, 8) << " Mrays/s" << std::endl;
+}
+
+/// <summary>
+/// Render a whole image with a WavefrontRenderer one tile at a time on one thread, throwing
+/// the pixels away, and return its ray counts and timings.
+/// </summary>
+WavefrontStats measureWavefront(const WavefrontRenderer& renderer, int pixWidth, int pixHeight, int tileSize=64)
+{
+	std::vector<Eigen::Vector3f> colors(tileSize * tileSize);
+	std::unique_ptr<bool[]> hit(new bool[tileSize * tileSize]);
+	WavefrontStats stats;
+	for (int y0 = 0; y0 < pixHeight; y0 += tileSize) {
+		for (int x0 = 0; x0 < pixWidth; x0 += tileSize) {
+			renderer.renderTile(x0, y0, std::min(tileSize, pixWidth - x0), std::min(tileSize, pixHeight - y0),
+				colors.data(), hit.get(), stats);
+		}
+	}
+	return stats;
+}
+
+/// <summary>
+/// Trace rays along each axis, both ways, from a grid of points over each side of a mesh's
+/// bounds through two BVHs over the same model, and count the rays on which they disagree:
+/// whether there is a hit, how far away it is, or whether the ray is occluded at all.
+/// Axis-aligned rays have zero direction components, which slab tests have to cope with.
+/// </summary>
+int countAxisAlignedMismatches(const MeshBVH& reference, const MeshBVH& bvh, int raysPerSide=32)
+{
+	AABB bounds = reference.bounds();
+	Eigen::Vector3f extent = bounds.extent();
+	int mismatches = 0;
+	for (int axis = 0; axis < 3; ++axis) {
+		int u = (axis + 1) % 3, v = (axis + 2) % 3;
+		for (float sign : { 1.f, -1.f }) {
+			for (int i = 0; i < raysPerSide; ++i) {
+				for (int j = 0; j < raysPerSide; ++j) {
+					Ray ray;
+					ray.origin[axis] = sign > 0.f ? bounds.min[axis] - extent[axis] : bounds.max[axis] + extent[axis];
+					ray.origin[u] = bounds.min[u] + (i + .5f) / raysPerSide * extent[u];
+					ray.origin[v] = bounds.min[v] + (j + .5f) / raysPerSide * extent[v];
+					ray.direction = Eigen::Vector3f::Zero();
+					ray.direction[axis] = sign;
+
+					MeshHit referenceHit, hit;
+					bool referenceHits = reference.intersect(ray, 1e-6f, 1e6f, false, referenceHit);
+					bool hits = bvh.intersect(ray, 1e-6f, 1e6f, false, hit);
+					if (referenceHits != hits || (hits && std::abs(referenceHit.t - hit.t) > 1e-4f * extent[axis])
+						|| bvh.occluded(ray, 1e-6f, 1e6f, false) != referenceHits)
+						mismatches++;
+				}
+			}
+		}
+	}
+	return mismatches;
+}
+
+/// <summary>
+/// Trace one primary ray per pixel through a MeshBVH (in its object space) and count the
+/// nodes visited and triangles tested. Runs on one thread, as it is for comparing tree
+/// quality rather than speed.
+/// </summary>
+TraversalStats measureTraversal(const MeshBVH& bvh, const Camera& cam, int pixWidth, int pixHeight)
+{
+	TraversalStats stats;
+	for (int y = 0; y < pixHeight; ++y) {
+		for (int x = 0; x < pixWidth; ++x) {
+			MeshHit hit;
+			bvh.intersect(cam.getRay(x, y), 1e-6f, 1e6f, false, hit, &stats);
+		}
+	}
+	return stats;
+}
+
+/// <summary>
+/// Trace one primary ray per pixel through a MeshBVH on one thread, and count a hardware event
+/// such as cache misses per ray. Returns -1 if the event can't be counted on this system.
+/// </summary>
+double measurePerfEvent(const MeshBVH& bvh, const Camera& cam, int pixWidth, int pixHeight, PerfEvent event)
+{
+	PerfCounter counter(event);
+	if (!counter.available()) return -1.0;
+
+	counter.start();
+	for (int y = 0; y < pixHeight; ++y) {
+		for (int x = 0; x < pixWidth; ++x) {
+			MeshHit hit;
+			bvh.intersect(cam.getRay(x, y), 1e-6f, 1e6f, false, hit);
+		}
+	}
+	return static_cast<double>(counter.stop()) / (static_cast<double>(pixWidth) * pixHeight);
+}
+
+/// <summary>
+/// Trace one primary ray per pixel through a KdTreeMesh (in its object space) and count the
+/// nodes visited and triangles tested, as for a MeshBVH.
+/// </summary>
+TraversalStats measureTraversal(const KdTreeMesh& mesh, const Camera& cam, int pixWidth, int pixHeight)
+{
+	TraversalStats stats;
+	for (int y = 0; y < pixHeight; ++y) {
+		for (int x = 0; x < pixWidth; ++x) {
+			MeshHit hit;
+			mesh.intersect(cam.getRay(x, y), 1e-6f, 1e6f, hit, &stats);
+		}
+	}
+	return stats;
+}
+
+/// <summary>
+/// Fill a scene with randomly placed spheres. The cloud grows with the number of
+/// spheres so that their density stays the same. Works with any container with a renderables
+/// vector, such as Scene and GridScene.
+/// </summary>
+template <typename Container>
+void makeSphereCloud(Container& scene, int count, const Shader* shader, unsigned int seed=1)
+{
+	std::mt19937 g(seed);
+	float halfSize = 2.f * cbrtf(static_cast<float>(count));
+	std::uniform_real_distribution<float> position(-halfSize, halfSize);
+	std::uniform_real_distribution<float> radius(.1f, .5f);
+	for (int i = 0; i < count; ++i) {
+		scene.renderables.push_back(std::make_unique<Sphere>(shader, radius(g)));
+		scene.renderables.back()->modelToWorld(AffineTransform(makeTranslationMatrix(
+			Eigen::Vector3f(position(g), position(g), position(g)))));
+	}
+}
+
+/// <summary>
+/// Deform a model by displacing its rest-pose vertices along a sine wave, as a stand-in
+/// for an animated mesh. The displacement is amplitude times the size of the model.
+/// </summary>
+void deformModel(Model& model, const std::vector<Eigen::Vector3f>& restVerts, float amplitude)
+{
+	AABB bounds;
+	for (const Eigen::Vector3f& v : restVerts)
+		bounds.expand(v);
+	float size = bounds.extent().norm();
+	float frequency = 20.f / size;
+	for (int i = 0; i < static_cast<int>(restVerts.size()); ++i) {
+		const Eigen::Vector3f& v = restVerts[i];
+		model.setVert(i, v + amplitude * size * Eigen::Vector3f(
+			sinf(frequency * v.y()), sinf(frequency * v.z()), sinf(frequency * v.x())));
+	}
+}
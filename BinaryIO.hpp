@@ -0,0 +1,162 @@
+#pragma once
+#include <ostream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/// <summary>
+/// A read-only memory mapping of a whole file. The pages are only read from disk as they
+/// are touched, so opening even a large file is nearly free.
+/// </summary>
+class MappedFile
+{
+private:
+	const char* data_;
+	size_t size_;
+#ifdef _WIN32
+	HANDLE file_, mapping_;
+#else
+	int file_;
+#endif
+
+public:
+	MappedFile(const std::string& filename)
+		:data_(nullptr), size_(0)
+	{
+#ifdef _WIN32
+		mapping_ = nullptr;
+		file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file_ == INVALID_HANDLE_VALUE) return;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) return;
+		mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping_) return;
+		data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+		if (data_) size_ = static_cast<size_t>(size.QuadPart);
+#else
+		file_ = open(filename.c_str(), O_RDONLY);
+		if (file_ < 0) return;
+		struct stat info;
+		if (fstat(file_, &info) != 0 || info.st_size == 0) return;
+		void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file_, 0);
+		if (data == MAP_FAILED) return;
+		data_ = static_cast<const char*>(data);
+		size_ = static_cast<size_t>(info.st_size);
+#endif
+	}
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (data_) UnmapViewOfFile(data_);
+		if (mapping_) CloseHandle(mapping_);
+		if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+#else
+		if (data_) munmap(const_cast<char*>(data_), size_);
+		if (file_ >= 0) close(file_);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator =(const MappedFile&) = delete;
+
+	/// <summary>
+	/// Did the file open? Missing and empty files don't.
+	/// </summary>
+	bool isOpen() const
+	{
+		return data_ != nullptr;
+	}
+
+	const char* data() const
+	{
+		return data_;
+	}
+
+	size_t size() const
+	{
+		return size_;
+	}
+};
+
+/// <summary>
+/// Reads plain values and arrays back out of a block of memory, such as a MappedFile,
+/// in the layout written by writeValue and writeArray. Every read is bounds checked, and
+/// returns false once the data runs out.
+/// </summary>
+class BinaryReader
+{
+private:
+	const char* pos_;
+	const char* end_;
+
+public:
+	BinaryReader(const char* data, size_t size)
+		:pos_(data), end_(data + size)
+	{}
+
+	template <typename T>
+	bool read(T& value)
+	{
+		if (static_cast<size_t>(end_ - pos_) < sizeof(T)) return false;
+		std::memcpy(&value, pos_, sizeof(T));
+		pos_ += sizeof(T);
+		return true;
+	}
+
+	template <typename T, typename Allocator>
+	bool readArray(std::vector<T, Allocator>& values)
+	{
+		uint64_t count;
+		if (!read(count) || static_cast<uint64_t>(end_ - pos_) / sizeof(T) < count) return false;
+		values.resize(static_cast<size_t>(count));
+		if (count > 0) std::memcpy(static_cast<void*>(values.data()), pos_, static_cast<size_t>(count) * sizeof(T));
+		pos_ += count * sizeof(T);
+		return true;
+	}
+};
+
+/// <summary>
+/// Write the raw bytes of a value. Only for types that can be copied with memcpy.
+/// </summary>
+template <typename T>
+void writeValue(std::ostream& out, const T& value)
+{
+	out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+/// <summary>
+/// Write an element count followed by the raw bytes of the elements.
+/// </summary>
+template <typename T, typename Allocator>
+void writeArray(std::ostream& out, const std::vector<T, Allocator>& values)
+{
+	writeValue(out, static_cast<uint64_t>(values.size()));
+	out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+}
+
+/// <summary>
+/// 64-bit FNV-1a hash of a block of memory. Pass a previous result as hash to continue it.
+/// Inline, as Model.cpp uses it too.
+/// </summary>
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t hash=14695981039346656037ull)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
@@ -1,15 +1,18 @@
 #pragma once
 #include "Ray.hpp"
+#include "RayPacket.hpp"
 
 /// <summary>
 /// Movable camera class. Provide the camera location, forward direction and an up
 /// vector, along with the image dimensions and vertical Field of View angle (radians).
-/// The camera can then produce a ray passing through each pixel location.
+/// The camera can then produce a ray passing through each pixel location, or a packet of
+/// rays through a square block of pixels.
 /// </summary>
 class Camera
 {
 private:
 	Eigen::Vector3f location_, bottomLeftPix_, right1pix_, up1pix_;
+	int pixWidth_, pixHeight_;
 
 public:
 	Camera(
@@ -18,7 +21,7 @@ public:
 		const Eigen::Vector3f& up,
 		int pixWidth, int pixHeight,
 		float vertFov)
-		:location_(location)
+		:location_(location), pixWidth_(pixWidth), pixHeight_(pixHeight)
 	{
 		Eigen::Vector3f forwardVec = forward.normalized();
 		Eigen::Vector3f rightVec = (up.cross(forwardVec)).normalized();
@@ -35,7 +38,7 @@ public:
 		up1pix_ = upVec * halfHeight * 2.f / static_cast<float>(pixHeight);
 	}
 
-	Ray getRay(int pixX, int pixY)
+	Ray getRay(int pixX, int pixY) const
 	{
 		Ray ray;
 		ray.origin = location_;
@@ -46,5 +49,23 @@ public:
 		ray.direction = (pixelPos - location_).normalized();
 		return ray;
 	}
+
+	/// <summary>
+	/// Fill a packet with the rays through the side x side block of pixels with its bottom
+	/// left corner at (pixX, pixY), row by row, so ray i is for pixel
+	/// (pixX + i % side, pixY + i / side). side should be 4 or 8.
+	/// Returns the mask of rays whose pixels are inside the image.
+	/// </summary>
+	uint64_t getPacket(int pixX, int pixY, int side, RayPacket& packet) const
+	{
+		packet.size = side * side;
+		uint64_t inside = 0;
+		for (int i = 0; i < packet.size; ++i) {
+			int x = pixX + i % side, y = pixY + i / side;
+			packet.setRay(i, getRay(x, y));
+			if (x < pixWidth_ && y < pixHeight_) inside |= 1ull << i;
+		}
+		return inside;
+	}
 };
 
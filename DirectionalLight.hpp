@@ -11,13 +11,14 @@ public:
 	{}
 
 
-	virtual bool visibilityCheck(const Eigen::Vector3f& location, const Renderable* renderable) const override
+	virtual Ray shadowRay(const Eigen::Vector3f& location, float& minT, float& maxT) const override
 	{
 		Ray shadowRay;
 		shadowRay.origin = location;
 		shadowRay.direction = -direction_;
-		HitInfo info;
-		return !renderable->intersect(shadowRay, 1e-4f, 1e4f, info, SHADOW_BITMASK);
+		minT = 1e-4f;
+		maxT = 1e4f;
+		return shadowRay;
 	}
 
 	virtual Eigen::Vector3f getIntensity(const Eigen::Vector3f& location) const override
@@ -1,36 +1,63 @@
 #pragma once
 #include <Eigen/Dense>
+#include "AffineTransform.hpp"
 
 /// <summary>
 /// An Entity is any object in the world with a 6DoF transform
-/// encoded as a 4x4 modelToWorld matrix.
+/// encoded as an affine modelToWorld transform.
+/// Its inverse and normal matrix are worked out once when it is set, since renderables use
+/// them for every ray.
 /// </summary>
 class Entity
 {
 private:
-	Eigen::Matrix4f modelToWorld_;
+	AffineTransform modelToWorld_;
+	AffineTransform worldToModel_;
+	Eigen::Matrix3f normalMatrix_;
+	unsigned int transformVersion_;
 
 public:
 	Entity()
-		:modelToWorld_(Eigen::Matrix4f::Identity())
+		:normalMatrix_(Eigen::Matrix3f::Identity()), transformVersion_(0)
 	{}
 
 	virtual ~Entity() throw()
 	{}
 
-	Eigen::Matrix4f modelToWorld() const
+	const AffineTransform& modelToWorld() const
 	{
 		return modelToWorld_;
 	}
 
-	Eigen::Matrix4f worldToModel() const
+	const AffineTransform& worldToModel() const
 	{
-		return modelToWorld_.inverse();
+		return worldToModel_;
 	}
 
-	virtual void modelToWorld(const Eigen::Matrix4f& m)
+	/// <summary>
+	/// Matrix taking model space normals to world space: the inverse transpose of the upper
+	/// left 3x3 of modelToWorld.
+	/// </summary>
+	const Eigen::Matrix3f& normalMatrix() const
+	{
+		return normalMatrix_;
+	}
+
+	virtual void modelToWorld(const AffineTransform& m)
 	{
 		modelToWorld_ = m;
+		worldToModel_ = m.inverse();
+		normalMatrix_ = m.normalMatrix();
+		++transformVersion_;
+	}
+
+	/// <summary>
+	/// Counter incremented every time modelToWorld is set, so containers can tell
+	/// whether an Entity has moved since they last looked at it.
+	/// </summary>
+	unsigned int transformVersion() const
+	{
+		return transformVersion_;
 	}
 };
 
@@ -1,6 +1,7 @@
 #pragma once
 # define M_PI           3.14159265358979323846
 #include <Eigen/Dense>
+#include "AffineTransform.hpp"
 
 // Note all matrices in these functions are designed for left multiplication
 // I.e. M*x not x*M.
@@ -91,13 +92,30 @@ Eigen::Vector3f transformDirection(const Eigen::Matrix4f& transform, const Eigen
 	return transformed.block<3, 1>(0, 0);
 }
 
+/// <summary>
+/// Apply an affine transform to a position, with no homogeneous divide.
+/// </summary>
+Eigen::Vector3f transformPosition(const AffineTransform& transform, const Eigen::Vector3f& position)
+{
+	return transform.position(position);
+}
+
+/// <summary>
+/// Apply an affine transform to a direction, ignoring its translation.
+/// </summary>
+Eigen::Vector3f transformDirection(const AffineTransform& transform, const Eigen::Vector3f& direction)
+{
+	return transform.direction(direction);
+}
+
 /// <summary>
 /// Apply a transform to a normal vector. This multiplies by the inverse transpose of the 
 /// 3x3 upper left corner of the matrix.
+/// Where the transform is an Entity's, use its cached normalMatrix() instead.
 /// </summary>
 Eigen::Vector3f transformNormal(const Eigen::Matrix4f& transform, const Eigen::Vector3f& normal)
 {
-	Eigen::Matrix3f normMat = transform.block<3, 3>(0, 0).inverse();
+	Eigen::Matrix3f normMat = transform.block<3, 3>(0, 0).inverse().transpose();
 	return normMat * normal;
 }
 
@@ -144,5 +162,41 @@ Eigen::Vector3f coefftWiseMul(const Eigen::Vector3f& left, const Eigen::Vector3f
 {
 	return (left.array() * right.array()).matrix();
 }
-	
 
+/// <summary>
+/// Moller-Trumbore ray/triangle intersection, for a triangle given as a vertex v0 and the
+/// two edges v0v1 = v1 - v0 and v0v2 = v2 - v0. On a hit, sets the distance along the ray t
+/// and the barycentric coordinates u, v of the hit (weights of v1 and v2 respectively).
+/// Does not check t against any range.
+/// Code from https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection.html
+/// </summary>
+bool intersectTriangle(const Eigen::Vector3f& origin, const Eigen::Vector3f& direction,
+	const Eigen::Vector3f& v0, const Eigen::Vector3f& v0v1, const Eigen::Vector3f& v0v2,
+	bool culling, float& t, float& u, float& v)
+{
+	Eigen::Vector3f pvec = direction.cross(v0v2);
+	float det = v0v1.dot(pvec);
+
+	if (culling) {
+		// if the determinant is negative, the triangle is 'back facing'
+		// if the determinant is close to 0, the ray misses the triangle
+		if (det < 1e-6) return false;
+	}
+	else {
+		// ray and triangle are parallel if det is close to 0
+		if (fabs(det) < 1e-6) return false;
+	}
+
+	float invDet = 1 / det;
+
+	Eigen::Vector3f tvec = origin - v0;
+	u = tvec.dot(pvec) * invDet;
+	if (u < 0 || u > 1) return false;
+
+	Eigen::Vector3f qvec = tvec.cross(v0v1);
+	v = direction.dot(qvec) * invDet;
+	if (v < 0 || u + v > 1) return false;
+
+	t = v0v2.dot(qvec) * invDet;
+	return true;
+}
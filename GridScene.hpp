@@ -0,0 +1,415 @@
+#pragma once
+#include "Renderable.hpp"
+#include "GeomUtil.hpp"
+#include "AABB.hpp"
+#include <vector>
+#include <memory>
+#include <limits>
+#include <cmath>
+
+struct GridBuildOptions
+{
+	float density = 2.f; // Grid cells per object.
+	int maxResolution = 256; // Most cells along any axis.
+	int subGridThreshold = 0; // Cells with more objects than this get a sub-grid of their own. 0 for a uniform grid.
+	float topLevelDensity = .125f; // Cells per object in the top level of a two-level grid.
+};
+
+/// <summary>
+/// A GridScene is a container for other Renderable objects, like Scene, but with the bounded
+/// objects sorted into a uniform grid of cells. Rays walk the cells they pass through in order
+/// (3D-DDA), testing the objects overlapping each, and stop at the first cell holding a hit.
+/// Building the grid only takes a pass over the objects, so for large numbers of small, evenly
+/// spread objects (such as particles) it is much cheaper than a Scene BVH.
+/// With options.subGridThreshold set, crowded cells get a grid of their own (a two-level grid),
+/// which copes better with uneven distributions.
+/// Add objects by pushing them into the renderables vector, then call buildGrid.
+/// Unbounded objects are always tested. After moving objects or adding new ones, call update
+/// to rebuild the grid.
+/// </summary>
+class GridScene : public Renderable
+{
+private:
+	/// <summary>
+	/// A uniform grid. The objects overlapping cell c are cellObjects[cellStart[c], cellStart[c + 1]).
+	/// </summary>
+	struct Grid
+	{
+		AABB bounds;
+		int resolution[3];
+		Eigen::Vector3f cellSize, invCellSize;
+		std::vector<int> cellStart;
+		std::vector<int> cellObjects; // Indices into renderables.
+		std::vector<int> subGrids; // Per cell, an index into subGrids_, or -1. Only used by the top level.
+
+		int cellIndex(int x, int y, int z) const
+		{
+			return (z * resolution[1] + y) * resolution[0] + x;
+		}
+
+		/// <summary>
+		/// Range of cells overlapped by box along axis.
+		/// </summary>
+		void cellRange(const AABB& box, int axis, int& first, int& last) const
+		{
+			first = static_cast<int>((box.min[axis] - bounds.min[axis]) * invCellSize[axis]);
+			last = static_cast<int>((box.max[axis] - bounds.min[axis]) * invCellSize[axis]);
+			first = std::min(std::max(first, 0), resolution[axis] - 1);
+			last = std::min(std::max(last, 0), resolution[axis] - 1);
+		}
+
+		/// <summary>
+		/// Sort the objects with the given bounds into cells, with density cells per object.
+		/// </summary>
+		void build(const AABB& gridBounds, const std::vector<int>& objects, const std::vector<AABB>& objectBounds,
+			float density, int maxResolution)
+		{
+			bounds = gridBounds;
+
+			// With nothing to sort there is a single empty cell, and rays skip the grid.
+			if (objects.empty() || bounds.empty()) {
+				bounds = AABB();
+				for (int a = 0; a < 3; ++a)
+					resolution[a] = 1;
+				cellSize = invCellSize = Eigen::Vector3f::Zero();
+				cellStart.assign(2, 0);
+				cellObjects.clear();
+				subGrids.assign(1, -1);
+				return;
+			}
+
+			// Pick cubic cells, giving about density * objects cells. Flat grids are given some depth.
+			Eigen::Vector3f extent = bounds.extent().cwiseMax(1e-3f * bounds.extent().maxCoeff());
+			float cellsPerUnit = std::cbrt(density * objects.size() / (extent.x() * extent.y() * extent.z()));
+			for (int a = 0; a < 3; ++a) {
+				resolution[a] = std::min(std::max(static_cast<int>(std::round(extent[a] * cellsPerUnit)), 1), maxResolution);
+				cellSize[a] = bounds.extent()[a] / resolution[a];
+				invCellSize[a] = cellSize[a] > 0.f ? 1.f / cellSize[a] : 0.f;
+			}
+
+			// Count the objects in each cell, turn the counts into offsets, then fill the cells.
+			int cellCount = resolution[0] * resolution[1] * resolution[2];
+			cellStart.assign(cellCount + 1, 0);
+			for (int pass = 0; pass < 2; ++pass) {
+				for (int object : objects) {
+					int first[3], last[3];
+					for (int a = 0; a < 3; ++a)
+						cellRange(objectBounds[object], a, first[a], last[a]);
+					for (int z = first[2]; z <= last[2]; ++z) {
+						for (int y = first[1]; y <= last[1]; ++y) {
+							for (int x = first[0]; x <= last[0]; ++x) {
+								if (pass == 0)
+									cellStart[cellIndex(x, y, z) + 1]++;
+								else
+									cellObjects[cellStart[cellIndex(x, y, z)]++] = object;
+							}
+						}
+					}
+				}
+				if (pass == 0) {
+					for (int c = 0; c < cellCount; ++c)
+						cellStart[c + 1] += cellStart[c];
+					cellObjects.resize(cellStart[cellCount]);
+				}
+			}
+			// Filling the cells moved each start up to the next cell's start.
+			for (int c = cellCount; c > 0; --c)
+				cellStart[c] = cellStart[c - 1];
+			cellStart[0] = 0;
+			subGrids.assign(cellCount, -1);
+		}
+
+		AABB cellBounds(int c) const
+		{
+			int x = c % resolution[0], y = (c / resolution[0]) % resolution[1], z = c / (resolution[0] * resolution[1]);
+			Eigen::Vector3f min = bounds.min + Eigen::Vector3f(x * cellSize.x(), y * cellSize.y(), z * cellSize.z());
+			return AABB(min, min + cellSize);
+		}
+
+		/// <summary>
+		/// Walk the cells the ray passes through between minT and maxT, in order, calling
+		/// visitCell(cell, tEntry, tExit, maxT). It should lower maxT when it finds a closer hit,
+		/// and the walk stops once the closest hit is inside the cell just visited.
+		/// </summary>
+		template <typename VisitCell>
+		void walk(const Eigen::Vector3f& origin, const Eigen::Vector3f& direction, const Eigen::Vector3f& invDir,
+			float minT, float& maxT, VisitCell visitCell) const
+		{
+			if (bounds.empty()) return;
+
+			float tEntry = minT, tMax = maxT;
+			for (int a = 0; a < 3; ++a) {
+				float t0 = (bounds.min[a] - origin[a]) * invDir[a], t1 = (bounds.max[a] - origin[a]) * invDir[a];
+				if (invDir[a] < 0.f) std::swap(t0, t1);
+				tEntry = std::max(tEntry, t0);
+				tMax = std::min(tMax, t1);
+				if (tMax < tEntry) return;
+			}
+
+			// Set up the DDA: the cell containing the entry point, and the distance along the ray to
+			// the next cell boundary on each axis.
+			Eigen::Vector3f entry = origin + tEntry * direction;
+			int cell[3], step[3], end[3];
+			float tNext[3], tDelta[3];
+			for (int a = 0; a < 3; ++a) {
+				cell[a] = std::min(std::max(static_cast<int>((entry[a] - bounds.min[a]) * invCellSize[a]), 0), resolution[a] - 1);
+				if (direction[a] > 0.f) {
+					step[a] = 1;
+					end[a] = resolution[a];
+					tNext[a] = (bounds.min[a] + (cell[a] + 1) * cellSize[a] - origin[a]) * invDir[a];
+					tDelta[a] = cellSize[a] * invDir[a];
+				}
+				else if (direction[a] < 0.f) {
+					step[a] = -1;
+					end[a] = -1;
+					tNext[a] = (bounds.min[a] + cell[a] * cellSize[a] - origin[a]) * invDir[a];
+					tDelta[a] = -cellSize[a] * invDir[a];
+				}
+				else {
+					step[a] = 0;
+					end[a] = -1;
+					tNext[a] = std::numeric_limits<float>::infinity();
+					tDelta[a] = 0.f;
+				}
+			}
+
+			while (true) {
+				int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+				visitCell(cellIndex(cell[0], cell[1], cell[2]), tEntry, std::min(tNext[axis], tMax), maxT);
+
+				// A hit before the end of this cell can't be beaten by anything in a later one.
+				if (tNext[axis] >= std::min(maxT, tMax)) return;
+
+				cell[axis] += step[axis];
+				if (cell[axis] == end[axis]) return;
+				tEntry = tNext[axis];
+				tNext[axis] += tDelta[axis];
+			}
+		}
+	};
+
+	GridBuildOptions gridOptions_;
+	bool useGrid_;
+	Grid grid_;
+	std::vector<Grid> subGrids_;
+	std::vector<int> unboundedChildren_; // Indices into renderables.
+	std::vector<unsigned int> childVersions_; // transformVersion of each child at the last build.
+
+	/// <summary>
+	/// Is the grid in sync with the renderables vector?
+	/// If not, intersect falls back to testing every child.
+	/// </summary>
+	bool gridValid() const
+	{
+		return useGrid_ && childVersions_.size() == renderables.size();
+	}
+
+public:
+	GridScene(IntersectMask mask=DEFAULT_BITMASK)
+		:Renderable(nullptr, mask), useGrid_(false)
+	{}
+
+	std::vector<std::unique_ptr<Renderable>> renderables;
+
+	/// <summary>
+	/// Build the grid over the bounds of the objects currently in the scene.
+	/// Child containers are brought up to date first.
+	/// </summary>
+	void buildGrid(const GridBuildOptions& options=GridBuildOptions())
+	{
+		useGrid_ = true;
+		gridOptions_ = options;
+
+		std::vector<int> boundedChildren;
+		std::vector<AABB> childBounds(renderables.size());
+		AABB bounds;
+		unboundedChildren_.clear();
+		childVersions_.resize(renderables.size());
+		for (size_t i = 0; i < renderables.size(); ++i) {
+			renderables[i]->update();
+			if (renderables[i]->bounds(childBounds[i])) {
+				boundedChildren.push_back(static_cast<int>(i));
+				bounds.expand(childBounds[i]);
+			}
+			else {
+				unboundedChildren_.push_back(static_cast<int>(i));
+			}
+			childVersions_[i] = renderables[i]->transformVersion();
+		}
+		// Children whose boxes are all empty have nowhere to go in the grid, so are always tested.
+		if (bounds.empty()) {
+			unboundedChildren_.insert(unboundedChildren_.end(), boundedChildren.begin(), boundedChildren.end());
+			boundedChildren.clear();
+		}
+
+		bool twoLevel = options.subGridThreshold > 0;
+		grid_.build(bounds, boundedChildren, childBounds, twoLevel ? options.topLevelDensity : options.density,
+			options.maxResolution);
+
+		subGrids_.clear();
+		if (!twoLevel) return;
+		int cellCount = static_cast<int>(grid_.subGrids.size());
+		for (int c = 0; c < cellCount; ++c) {
+			if (grid_.cellStart[c + 1] - grid_.cellStart[c] <= options.subGridThreshold) continue;
+			std::vector<int> cellObjects(grid_.cellObjects.begin() + grid_.cellStart[c], grid_.cellObjects.begin() + grid_.cellStart[c + 1]);
+			grid_.subGrids[c] = static_cast<int>(subGrids_.size());
+			subGrids_.emplace_back();
+			subGrids_.back().build(grid_.cellBounds(c), cellObjects, childBounds, options.density, options.maxResolution);
+		}
+	}
+
+	/// <summary>
+	/// Rebuild the grid if objects were added, removed or moved.
+	/// </summary>
+	virtual bool update() override
+	{
+		bool moved = false;
+		for (const auto& object : renderables) {
+			if (object->update()) moved = true;
+		}
+
+		if (!useGrid_) return moved;
+
+		if (childVersions_.size() == renderables.size()) {
+			for (size_t i = 0; i < renderables.size(); ++i) {
+				if (childVersions_[i] != renderables[i]->transformVersion()) moved = true;
+			}
+			if (!moved) return false;
+		}
+
+		buildGrid(gridOptions_);
+		return true;
+	}
+
+	/// <summary>
+	/// Number of cells in the top-level grid and in all the sub-grids.
+	/// </summary>
+	size_t cellCount() const
+	{
+		size_t count = grid_.subGrids.size();
+		for (const Grid& grid : subGrids_)
+			count += grid.subGrids.size();
+		return count;
+	}
+
+	size_t subGridCount() const
+	{
+		return subGrids_.size();
+	}
+
+	virtual bool bounds(AABB& box) const override
+	{
+		AABB sceneBox;
+		for (const auto& object : renderables) {
+			AABB childBox;
+			if (!object->bounds(childBox)) return false;
+			sceneBox.expand(childBox);
+		}
+		box = sceneBox.transformed(modelToWorld());
+		return true;
+	}
+
+	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		// Transform ray from world space to scene space.
+		Ray tRay;
+		tRay.origin = transformPosition(worldToModel(), ray.origin);
+		tRay.direction = transformDirection(worldToModel(), ray.direction);
+
+		// Identify closest valid hit. Each hit narrows the range for the following tests.
+		float t = maxT;
+		const Renderable* closestChild = nullptr;
+		HitInfo currInfo;
+		auto testChild = [&](const Renderable* object, float& closestT) {
+			if (object->intersect(tRay, minT, closestT, currInfo, mask) && currInfo.hitT <= closestT) {
+				info = currInfo;
+				closestT = currInfo.hitT;
+				closestChild = object;
+			}
+		};
+
+		if (gridValid()) {
+			// Unbounded objects first, so the walk can stop early at any hit on them.
+			for (int i : unboundedChildren_)
+				testChild(renderables[i].get(), t);
+
+			Eigen::Vector3f invDir = tRay.direction.cwiseInverse();
+			auto testCell = [&](const Grid& grid, int c, float& closestT) {
+				for (int i = grid.cellStart[c]; i < grid.cellStart[c + 1]; ++i)
+					testChild(renderables[grid.cellObjects[i]].get(), closestT);
+			};
+			grid_.walk(tRay.origin, tRay.direction, invDir, minT, t, [&](int c, float tEntry, float tExit, float& closestT) {
+				if (grid_.subGrids[c] < 0) {
+					testCell(grid_, c, closestT);
+					return;
+				}
+				// Walk the sub-grid over the part of the ray inside this cell. Hits beyond it still
+				// lower closestT, so later cells can skip objects behind them.
+				const Grid& subGrid = subGrids_[grid_.subGrids[c]];
+				float subMaxT = std::min(closestT, tExit);
+				subGrid.walk(tRay.origin, tRay.direction, invDir, tEntry, subMaxT, [&](int sc, float, float, float& subClosestT) {
+					testCell(subGrid, sc, closestT);
+					subClosestT = std::min(subClosestT, closestT);
+				});
+			});
+		}
+		else {
+			for (const auto& object : renderables)
+				testChild(object.get(), t);
+		}
+
+		if (!closestChild) return false;
+
+		// Only the closest hit needs its surface worked out. Transform it back into world space.
+		closestChild->computeSurface(tRay, info);
+		info.location = transformPosition(modelToWorld(), info.location);
+		info.normal = (normalMatrix() * info.normal).normalized();
+
+		return true;
+	}
+
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		Ray tRay;
+		tRay.origin = transformPosition(worldToModel(), ray.origin);
+		tRay.direction = transformDirection(worldToModel(), ray.direction);
+
+		if (!gridValid()) {
+			for (const auto& object : renderables) {
+				if (object->occluded(tRay, minT, maxT, mask)) return true;
+			}
+			return false;
+		}
+
+		for (int i : unboundedChildren_) {
+			if (renderables[i]->occluded(tRay, minT, maxT, mask)) return true;
+		}
+
+		// On a hit, setting the walk's maxT below minT ends it.
+		bool hit = false;
+		auto testCell = [&](const Grid& grid, int c, float& walkMaxT) {
+			for (int i = grid.cellStart[c]; i < grid.cellStart[c + 1] && !hit; ++i)
+				hit = renderables[grid.cellObjects[i]]->occluded(tRay, minT, maxT, mask);
+			if (hit) walkMaxT = -std::numeric_limits<float>::max();
+		};
+		Eigen::Vector3f invDir = tRay.direction.cwiseInverse();
+		float t = maxT;
+		grid_.walk(tRay.origin, tRay.direction, invDir, minT, t, [&](int c, float tEntry, float tExit, float& walkMaxT) {
+			if (grid_.subGrids[c] < 0) {
+				testCell(grid_, c, walkMaxT);
+				return;
+			}
+			const Grid& subGrid = subGrids_[grid_.subGrids[c]];
+			float subMaxT = tExit;
+			subGrid.walk(tRay.origin, tRay.direction, invDir, tEntry, subMaxT, [&](int sc, float, float, float& subWalkMaxT) {
+				testCell(subGrid, sc, subWalkMaxT);
+			});
+			if (hit) walkMaxT = -std::numeric_limits<float>::max();
+		});
+		return hit;
+	}
+};
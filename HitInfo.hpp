@@ -2,13 +2,20 @@
 #include <Eigen/Dense>
 
 class Shader;
+class Renderable;
 
 /// <summary>
 /// Structure encoding information from an intersection test.
+/// Renderable::intersect fills in the hit itself: where along the ray, which object and which
+/// part of it. The surface at the hit (from normal on) is only worked out by computeSurface,
+/// once the closest hit is known.
 /// </summary>
 struct HitInfo
 {
 	float hitT; // Distance along the ray the hit occurred at.
+	const Renderable* object; // Object hit.
+	int primitive; // Part of the object hit, such as a mesh face.
+	float u, v; // Barycentric coordinates of the hit within the primitive, where it has them.
 	Eigen::Vector3f 
 		normal, // Normal vector of the object at the hit location.
 		location, // World-space location of hit point.
@@ -0,0 +1,502 @@
+#pragma once
+#include "AABB.hpp"
+#include "BVH.hpp"
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+/// <summary>
+/// A node of a KdTree, packed into 8 bytes. Interior nodes split their box in two by an
+/// axis-aligned plane. The child below the plane directly follows its parent in the node array;
+/// the index of the child above it is stored. Leaves store a range of primitive references.
+/// </summary>
+struct KdTreeNode
+{
+	union {
+		float split; // Interior: position of the splitting plane.
+		int first; // Leaf: index of first primitive reference.
+	};
+	uint32_t flags; // Low 2 bits: split axis, or 3 for a leaf. The rest: index of the above child, or primitive count.
+
+	bool isLeaf() const
+	{
+		return (flags & 3) == 3;
+	}
+
+	int axis() const
+	{
+		return flags & 3;
+	}
+
+	int aboveChild() const
+	{
+		return static_cast<int>(flags >> 2);
+	}
+
+	int count() const
+	{
+		return static_cast<int>(flags >> 2);
+	}
+};
+
+struct KdTreeBuildOptions
+{
+	float traversalCost = 1.f; // SAH cost of visiting an interior node.
+	float intersectionCost = 1.5f; // SAH cost of testing one primitive.
+	float emptyBonus = .8f; // Scales the cost of splits that cut off empty space, to favour them.
+	int maxDepth = 0; // 0 to pick one from the primitive count.
+};
+
+/// <summary>
+/// Used by the KdTree build to clip a primitive to a box, giving the bounds of the part of it
+/// inside the box (which is empty if there is none).
+/// </summary>
+typedef std::function<AABB(int primitive, const AABB& box)> PrimitiveClipper;
+
+/// <summary>
+/// A kd-tree over a set of primitives, each described by its bounding box. Like BVH, it only
+/// stores references to the primitives and hands them back to a caller-supplied function during
+/// traversal. Unlike a BVH, its cells never overlap: a primitive crossing a splitting plane is
+/// referred to from both sides, and rays visit cells strictly front to back, so traversal stops
+/// at the first cell holding a hit.
+/// The tree is built with the SAH in O(N log N) by sorting the boundaries of the primitives'
+/// boxes along each axis once at the root (as "events"), and keeping the event lists sorted
+/// as they are split between children. With a PrimitiveClipper, primitives crossing a plane are
+/// clipped to each child's box, which gives much tighter trees than their bounding boxes alone.
+/// </summary>
+class KdTree
+{
+public:
+	static constexpr int MAX_DEPTH = 64; // Also the size of the traversal stack.
+
+private:
+	/// <summary>
+	/// A box boundary of a primitive reference along one axis. Boxes that are flat along the
+	/// axis give one Planar event; others give a Start and an End.
+	/// </summary>
+	struct Event
+	{
+		enum Type : uint8_t { End, Planar, Start };
+
+		float position;
+		int prim;
+		uint8_t axis;
+		Type type;
+
+		// Sorted by axis, then position, with ends before planars before starts at the same position.
+		bool operator <(const Event& e) const
+		{
+			if (axis != e.axis) return axis < e.axis;
+			if (position != e.position) return position < e.position;
+			return type < e.type;
+		}
+	};
+
+	enum Side : uint8_t { Both, LeftOnly, RightOnly };
+
+	/// <summary>
+	/// Data shared by all the nodes of a build.
+	/// </summary>
+	struct BuildState
+	{
+		const std::vector<AABB>& primBounds;
+		const PrimitiveClipper& clipPrimitive;
+		std::vector<uint8_t> sides; // Per primitive, the Side of the split being made.
+		int maxDepth;
+
+		BuildState(const std::vector<AABB>& primBounds, const PrimitiveClipper& clipPrimitive)
+			:primBounds(primBounds), clipPrimitive(clipPrimitive), sides(primBounds.size())
+		{}
+	};
+
+	std::vector<KdTreeNode> nodes_;
+	std::vector<int> primIndices_; // Primitive references, in leaf order.
+	AABB bounds_;
+	KdTreeBuildOptions options_;
+	BVHStats stats_;
+
+	static void addEvents(std::vector<Event>& events, int prim, const AABB& box)
+	{
+		for (uint8_t a = 0; a < 3; ++a) {
+			if (box.min[a] == box.max[a]) {
+				events.push_back({ box.min[a], prim, a, Event::Planar });
+			}
+			else {
+				events.push_back({ box.min[a], prim, a, Event::Start });
+				events.push_back({ box.max[a], prim, a, Event::End });
+			}
+		}
+	}
+
+	/// <summary>
+	/// SAH cost of splitting box at position along axis, with leftCount and rightCount
+	/// primitives on either side.
+	/// </summary>
+	float splitCost(const AABB& box, float invArea, int axis, float position, int leftCount, int rightCount) const
+	{
+		AABB left = box, right = box;
+		left.max[axis] = position;
+		right.min[axis] = position;
+		float cost = options_.traversalCost + options_.intersectionCost
+			* (left.surfaceArea() * invArea * leftCount + right.surfaceArea() * invArea * rightCount);
+		return (leftCount == 0 || rightCount == 0) ? options_.emptyBonus * cost : cost;
+	}
+
+	/// <summary>
+	/// Build the subtree for a node with the given box, whose references have the given events.
+	/// </summary>
+	void build(BuildState& state, std::vector<Event>& events, const AABB& box, int depth)
+	{
+		int nodeIndex = static_cast<int>(nodes_.size());
+		nodes_.emplace_back();
+		stats_.maxDepth = std::max(stats_.maxDepth, depth);
+
+		// Every reference has exactly one Start or Planar event per axis.
+		int count = 0;
+		for (const Event& e : events) {
+			if (e.axis == 0 && e.type != Event::End) ++count;
+		}
+
+		// Sweep the sorted events on each axis, counting the references on each side of every
+		// candidate plane. Planar references on the plane go to whichever side is cheaper.
+		float area = box.surfaceArea();
+		float invArea = area > 0.f ? 1.f / area : 0.f;
+		float bestCost = std::numeric_limits<float>::max();
+		int bestAxis = -1;
+		float bestPosition = 0.f;
+		bool bestPlanarLeft = false;
+		int leftCount = 0, rightCount = count, axis = -1;
+		for (size_t i = 0; i < events.size() && area > 0.f;) {
+			if (events[i].axis != axis) {
+				axis = events[i].axis;
+				leftCount = 0;
+				rightCount = count;
+			}
+			float position = events[i].position;
+			int ends = 0, planars = 0, starts = 0;
+			for (; i < events.size() && events[i].axis == axis && events[i].position == position && events[i].type == Event::End; ++i) ++ends;
+			for (; i < events.size() && events[i].axis == axis && events[i].position == position && events[i].type == Event::Planar; ++i) ++planars;
+			for (; i < events.size() && events[i].axis == axis && events[i].position == position && events[i].type == Event::Start; ++i) ++starts;
+
+			rightCount -= planars + ends;
+			// Planes on the box's own faces would cut off nothing.
+			if (position > box.min[axis] && position < box.max[axis]) {
+				float costLeft = splitCost(box, invArea, axis, position, leftCount + planars, rightCount);
+				float costRight = splitCost(box, invArea, axis, position, leftCount, rightCount + planars);
+				float cost = std::min(costLeft, costRight);
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestPosition = position;
+					bestPlanarLeft = costLeft < costRight;
+				}
+			}
+			leftCount += starts + planars;
+		}
+
+		if (bestAxis < 0 || bestCost >= options_.intersectionCost * count || depth >= state.maxDepth) {
+			nodes_[nodeIndex].first = static_cast<int>(primIndices_.size());
+			nodes_[nodeIndex].flags = (static_cast<uint32_t>(count) << 2) | 3;
+			for (const Event& e : events) {
+				if (e.axis == 0 && e.type != Event::End) primIndices_.push_back(e.prim);
+			}
+			stats_.leaves++;
+			stats_.sahCost += options_.intersectionCost * count * area;
+			return;
+		}
+		stats_.sahCost += options_.traversalCost * area;
+
+		// Sort the references into those entirely on one side of the plane, and those crossing it.
+		std::vector<uint8_t>& sides = state.sides;
+		for (const Event& e : events) {
+			if (e.axis == 0 && e.type != Event::End) sides[e.prim] = Both;
+		}
+		for (const Event& e : events) {
+			if (e.axis != bestAxis) continue;
+			if (e.type == Event::End && e.position <= bestPosition)
+				sides[e.prim] = LeftOnly;
+			else if (e.type == Event::Start && e.position >= bestPosition)
+				sides[e.prim] = RightOnly;
+			else if (e.type == Event::Planar) {
+				if (e.position < bestPosition || (e.position == bestPosition && bestPlanarLeft))
+					sides[e.prim] = LeftOnly;
+				else
+					sides[e.prim] = RightOnly;
+			}
+		}
+
+		// The events of one-sided references stay sorted. Crossing references get new events
+		// for their part in each child, which are sorted and merged in.
+		AABB leftBox = box, rightBox = box;
+		leftBox.max[bestAxis] = bestPosition;
+		rightBox.min[bestAxis] = bestPosition;
+		std::vector<Event> leftOnly, rightOnly, leftBoth, rightBoth;
+		for (const Event& e : events) {
+			if (sides[e.prim] == LeftOnly)
+				leftOnly.push_back(e);
+			else if (sides[e.prim] == RightOnly)
+				rightOnly.push_back(e);
+			else if (e.axis == 0 && e.type != Event::End) {
+				AABB leftPart, rightPart;
+				if (state.clipPrimitive) {
+					leftPart = state.clipPrimitive(e.prim, leftBox).intersection(leftBox);
+					rightPart = state.clipPrimitive(e.prim, rightBox).intersection(rightBox);
+				}
+				else {
+					leftPart = state.primBounds[e.prim].intersection(leftBox);
+					rightPart = state.primBounds[e.prim].intersection(rightBox);
+				}
+				if (!leftPart.empty()) addEvents(leftBoth, e.prim, leftPart);
+				if (!rightPart.empty()) addEvents(rightBoth, e.prim, rightPart);
+			}
+		}
+		std::vector<Event>().swap(events);
+
+		std::sort(leftBoth.begin(), leftBoth.end());
+		std::sort(rightBoth.begin(), rightBoth.end());
+		std::vector<Event> leftEvents(leftOnly.size() + leftBoth.size());
+		std::merge(leftOnly.begin(), leftOnly.end(), leftBoth.begin(), leftBoth.end(), leftEvents.begin());
+		std::vector<Event>().swap(leftOnly);
+		std::vector<Event>().swap(leftBoth);
+		std::vector<Event> rightEvents(rightOnly.size() + rightBoth.size());
+		std::merge(rightOnly.begin(), rightOnly.end(), rightBoth.begin(), rightBoth.end(), rightEvents.begin());
+		std::vector<Event>().swap(rightOnly);
+		std::vector<Event>().swap(rightBoth);
+
+		build(state, leftEvents, leftBox, depth + 1);
+		int above = static_cast<int>(nodes_.size());
+		nodes_[nodeIndex].split = bestPosition;
+		nodes_[nodeIndex].flags = (static_cast<uint32_t>(above) << 2) | static_cast<uint32_t>(bestAxis);
+		build(state, rightEvents, rightBox, depth + 1);
+	}
+
+public:
+	KdTree()
+	{}
+
+	/// <summary>
+	/// Build the tree over primitives with the given bounding boxes. Primitive i is referred
+	/// to by index i in primIndices(), and may be referred to by more than one leaf.
+	/// If clipPrimitive is given, it is used to find the bounds of primitives crossing a plane.
+	/// </summary>
+	void build(const std::vector<AABB>& primBounds, const KdTreeBuildOptions& options = KdTreeBuildOptions(),
+		const PrimitiveClipper& clipPrimitive = nullptr)
+	{
+		auto startTime = std::chrono::steady_clock::now();
+
+		options_ = options;
+		stats_ = BVHStats();
+		stats_.primitives = static_cast<int>(primBounds.size());
+		nodes_.clear();
+		primIndices_.clear();
+		bounds_ = AABB();
+
+		std::vector<Event> events;
+		events.reserve(6 * primBounds.size());
+		for (int i = 0; i < static_cast<int>(primBounds.size()); ++i) {
+			if (primBounds[i].empty()) continue;
+			bounds_.expand(primBounds[i]);
+			addEvents(events, i, primBounds[i]);
+		}
+		std::sort(events.begin(), events.end());
+
+		BuildState state(primBounds, clipPrimitive);
+		state.maxDepth = options_.maxDepth > 0 ? options_.maxDepth
+			: static_cast<int>(8.f + 1.3f * std::log2(static_cast<float>(std::max<size_t>(primBounds.size(), 1))));
+		state.maxDepth = std::min(state.maxDepth, MAX_DEPTH);
+		build(state, events, bounds_, 1);
+
+		stats_.references = static_cast<int>(primIndices_.size());
+		stats_.nodes = static_cast<int>(nodes_.size());
+		float rootArea = bounds_.surfaceArea();
+		stats_.sahCost = rootArea > 0.f ? stats_.sahCost / rootArea : 0.f;
+		stats_.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+	}
+
+	const std::vector<KdTreeNode>& nodes() const
+	{
+		return nodes_;
+	}
+
+	/// <summary>
+	/// Primitive references, in leaf order. Leaves refer to ranges of this array.
+	/// </summary>
+	const std::vector<int>& primIndices() const
+	{
+		return primIndices_;
+	}
+
+	/// <summary>
+	/// Build statistics. The SAH cost is in the same units as a BVH's.
+	/// </summary>
+	const BVHStats& stats() const
+	{
+		return stats_;
+	}
+
+	AABB bounds() const
+	{
+		return bounds_;
+	}
+
+	size_t memoryBytes() const
+	{
+		return nodes_.size() * sizeof(KdTreeNode) + primIndices_.size() * sizeof(int);
+	}
+
+	/// <summary>
+	/// Trace a ray through the tree, visiting cells front to back. As with BVH::traverse,
+	/// intersectPrimitive(reference, maxT) is called for each primitive reference in each leaf
+	/// and should return true and lower maxT if it finds a closer hit. Traversal stops after
+	/// the first leaf whose cell holds the closest hit.
+	/// If stats is given, the nodes visited and primitives tested are added to it.
+	/// </summary>
+	template <typename IntersectPrimitive>
+	bool traverse(const Eigen::Vector3f& origin, const Eigen::Vector3f& direction,
+		float minT, float& maxT, IntersectPrimitive intersectPrimitive, TraversalStats* stats = nullptr) const
+	{
+		if (stats) stats->rays++;
+		if (nodes_.empty()) return false;
+
+		Eigen::Vector3f invDir = direction.cwiseInverse();
+		// The part of the ray inside the current cell is [tMin, tMax].
+		float tMin = minT, tMax = maxT;
+		for (int a = 0; a < 3; ++a) {
+			float t0 = (bounds_.min[a] - origin[a]) * invDir[a], t1 = (bounds_.max[a] - origin[a]) * invDir[a];
+			if (invDir[a] < 0.f) std::swap(t0, t1);
+			tMin = std::max(tMin, t0);
+			tMax = std::min(tMax, t1);
+			if (tMax < tMin) return false;
+		}
+
+		struct StackEntry { int node; float tMin, tMax; };
+		StackEntry stack[MAX_DEPTH];
+		int stackSize = 0;
+
+		bool hit = false;
+		int nodeIndex = 0;
+		while (true) {
+			const KdTreeNode& node = nodes_[nodeIndex];
+			if (stats) stats->nodeVisits++;
+			if (node.isLeaf()) {
+				if (stats) stats->primitiveTests += node.count();
+				for (int i = node.first; i < node.first + node.count(); ++i) {
+					if (intersectPrimitive(i, maxT)) hit = true;
+				}
+				// Hits past this cell may be beaten by something in a later cell.
+				if (hit && maxT <= tMax) break;
+			}
+			else {
+				int axis = node.axis();
+				float tPlane = (node.split - origin[axis]) * invDir[axis];
+				bool belowFirst = origin[axis] < node.split || (origin[axis] == node.split && direction[axis] <= 0.f);
+				int first = belowFirst ? nodeIndex + 1 : node.aboveChild();
+				int second = belowFirst ? node.aboveChild() : nodeIndex + 1;
+
+				if (tPlane > tMax || tPlane <= 0.f) {
+					nodeIndex = first;
+				}
+				else if (tPlane < tMin) {
+					nodeIndex = second;
+				}
+				else if (tPlane == tPlane) {
+					stack[stackSize++] = { second, tPlane, tMax };
+					nodeIndex = first;
+					tMax = tPlane;
+				}
+				else {
+					// The ray lies in the plane: visit both sides over the whole interval.
+					stack[stackSize++] = { second, tMin, tMax };
+					nodeIndex = first;
+				}
+				continue;
+			}
+
+			// Pop the next cell that could still contain a closer hit.
+			while (stackSize > 0 && stack[stackSize - 1].tMin > maxT)
+				--stackSize;
+			if (stackSize == 0) break;
+			--stackSize;
+			nodeIndex = stack[stackSize].node;
+			tMin = stack[stackSize].tMin;
+			tMax = stack[stackSize].tMax;
+		}
+
+		return hit;
+	}
+
+	/// <summary>
+	/// Walk the tree along a ray until any primitive is hit between minT and maxT, for
+	/// occlusion queries. As with BVH::traverseAny, hitsPrimitive(ref) is called for each
+	/// primitive reference in each leaf the ray reaches, and should return true if the ray
+	/// hits it in that range. Returns true as soon as one does, without looking for the closest.
+	/// </summary>
+	template <typename HitsPrimitive>
+	bool traverseAny(const Eigen::Vector3f& origin, const Eigen::Vector3f& direction,
+		float minT, float maxT, HitsPrimitive hitsPrimitive, TraversalStats* stats = nullptr) const
+	{
+		if (stats) stats->rays++;
+		if (nodes_.empty()) return false;
+
+		Eigen::Vector3f invDir = direction.cwiseInverse();
+		float tMin = minT, tMax = maxT;
+		for (int a = 0; a < 3; ++a) {
+			float t0 = (bounds_.min[a] - origin[a]) * invDir[a], t1 = (bounds_.max[a] - origin[a]) * invDir[a];
+			if (invDir[a] < 0.f) std::swap(t0, t1);
+			tMin = std::max(tMin, t0);
+			tMax = std::min(tMax, t1);
+			if (tMax < tMin) return false;
+		}
+
+		struct StackEntry { int node; float tMin, tMax; };
+		StackEntry stack[MAX_DEPTH];
+		int stackSize = 0;
+
+		int nodeIndex = 0;
+		while (true) {
+			const KdTreeNode& node = nodes_[nodeIndex];
+			if (stats) stats->nodeVisits++;
+			if (node.isLeaf()) {
+				for (int i = node.first; i < node.first + node.count(); ++i) {
+					if (stats) stats->primitiveTests++;
+					if (hitsPrimitive(i)) return true;
+				}
+			}
+			else {
+				int axis = node.axis();
+				float tPlane = (node.split - origin[axis]) * invDir[axis];
+				bool belowFirst = origin[axis] < node.split || (origin[axis] == node.split && direction[axis] <= 0.f);
+				int first = belowFirst ? nodeIndex + 1 : node.aboveChild();
+				int second = belowFirst ? node.aboveChild() : nodeIndex + 1;
+
+				if (tPlane > tMax || tPlane <= 0.f) {
+					nodeIndex = first;
+				}
+				else if (tPlane < tMin) {
+					nodeIndex = second;
+				}
+				else if (tPlane == tPlane) {
+					stack[stackSize++] = { second, tPlane, tMax };
+					nodeIndex = first;
+					tMax = tPlane;
+				}
+				else {
+					stack[stackSize++] = { second, tMin, tMax };
+					nodeIndex = first;
+				}
+				continue;
+			}
+
+			if (stackSize == 0) break;
+			--stackSize;
+			nodeIndex = stack[stackSize].node;
+			tMin = stack[stackSize].tMin;
+			tMax = stack[stackSize].tMax;
+		}
+
+		return false;
+	}
+};
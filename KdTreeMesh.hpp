@@ -0,0 +1,207 @@
+#pragma once
+#include "Renderable.hpp"
+#include "KdTree.hpp"
+#include "Model.hpp"
+#include "GeomUtil.hpp"
+#include "PackedTriangle.hpp"
+#include "MeshHit.hpp"
+#include <stdexcept>
+
+/// <summary>
+/// A KdTreeMesh is a triangle mesh accelerated by an SAH kd-tree built over its faces when it
+/// is constructed. Rays visit the tree's cells front to back and stop at the first cell holding
+/// a hit, which can beat a BVH for static, heavily occluded models. BVHMesh is better for models
+/// that deform, as the tree has to be rebuilt rather than refitted.
+/// Like BVHMesh, the tree is built in object space, so changing modelToWorld is free.
+/// </summary>
+class KdTreeMesh : public Renderable
+{
+private:
+	const Model* model_;
+	bool culling_;
+	KdTreeBuildOptions options_;
+	KdTree tree_;
+	std::vector<PackedTriangle> triangles_; // Object-space triangles, in leaf order.
+	unsigned int modelVersion_; // Model version the tree was built for.
+
+	/// <summary>
+	/// Bounds of the part of the triangle with corners v[0..2] inside box, found by clipping
+	/// it against each face of the box in turn.
+	/// </summary>
+	static AABB clipTriangle(const Eigen::Vector3f* v, const AABB& box)
+	{
+		// Each of the six clips adds at most one vertex.
+		Eigen::Vector3f polygon[9], clipped[9];
+		int count = 3;
+		for (int i = 0; i < 3; ++i)
+			polygon[i] = v[i];
+
+		for (int plane = 0; plane < 6 && count > 0; ++plane) {
+			int axis = plane % 3;
+			float position = plane < 3 ? box.min[axis] : box.max[axis];
+			float sign = plane < 3 ? 1.f : -1.f; // Inside is where sign * (p - position) >= 0.
+			int clippedCount = 0;
+			for (int i = 0; i < count; ++i) {
+				const Eigen::Vector3f& a = polygon[i];
+				const Eigen::Vector3f& b = polygon[(i + 1) % count];
+				float da = sign * (a[axis] - position), db = sign * (b[axis] - position);
+				if (da >= 0.f) clipped[clippedCount++] = a;
+				if ((da < 0.f && db > 0.f) || (da > 0.f && db < 0.f)) {
+					Eigen::Vector3f crossing = a + da / (da - db) * (b - a);
+					crossing[axis] = position;
+					clipped[clippedCount++] = crossing;
+				}
+			}
+			count = clippedCount;
+			for (int i = 0; i < count; ++i)
+				polygon[i] = clipped[i];
+		}
+
+		AABB bounds;
+		for (int i = 0; i < count; ++i)
+			bounds.expand(polygon[i]);
+		return bounds;
+	}
+
+	void build()
+	{
+		int nfaces = model_->nfaces();
+		std::vector<Eigen::Vector3f> corners(3 * static_cast<size_t>(nfaces));
+		std::vector<AABB> triBounds(nfaces);
+		const int* indices = model_->vertIndices();
+		for (int f = 0; f < nfaces; ++f) {
+			for (int v = 0; v < 3; ++v) {
+				corners[3 * f + v] = model_->vert(indices[3 * f + v]);
+				triBounds[f].expand(corners[3 * f + v]);
+			}
+		}
+
+		tree_.build(triBounds, options_, [&corners](int f, const AABB& box) {
+			return clipTriangle(&corners[3 * f], box);
+		});
+
+		const std::vector<int>& order = tree_.primIndices();
+		triangles_.resize(order.size());
+		for (size_t i = 0; i < order.size(); ++i) {
+			const Eigen::Vector3f* v = &corners[3 * order[i]];
+			triangles_[i] = PackedTriangle(v[0], v[1], v[2], order[i]);
+		}
+		modelVersion_ = model_->version();
+	}
+
+public:
+	KdTreeMesh(const Shader* shader, const Model* model, bool culling=true, IntersectMask mask=DEFAULT_BITMASK,
+		const KdTreeBuildOptions& options=KdTreeBuildOptions())
+		:Renderable(shader, mask), model_(model), culling_(culling), options_(options), modelVersion_(0)
+	{
+		build();
+	}
+
+	const KdTree& tree() const
+	{
+		return tree_;
+	}
+
+	/// <summary>
+	/// Memory used by the tree and its copy of the triangles (not counting the Model).
+	/// </summary>
+	size_t memoryBytes() const
+	{
+		return tree_.memoryBytes() + triangles_.size() * sizeof(PackedTriangle);
+	}
+
+	/// <summary>
+	/// A kd-tree can't be refitted, so it is rebuilt if the model's vertices have changed.
+	/// </summary>
+	virtual bool update() override
+	{
+		if (model_->version() == modelVersion_) return false;
+		build();
+		return true;
+	}
+
+	virtual bool bounds(AABB& box) const override
+	{
+		box = tree_.bounds().transformed(modelToWorld());
+		return true;
+	}
+
+	/// <summary>
+	/// Find the closest triangle hit by an object-space ray with minT <= t <= maxT.
+	/// If stats is given, the traversal work is added to it.
+	/// </summary>
+	bool intersect(const Ray& ray, float minT, float maxT, MeshHit& hit, TraversalStats* stats = nullptr) const
+	{
+		return tree_.traverse(ray.origin, ray.direction, minT, maxT,
+			[&](int ref, float& closestT) {
+				const PackedTriangle& tri = triangles_[ref];
+				float t, u, v;
+				if (!intersectTriangle(ray.origin, ray.direction, tri.v0, tri.e1, tri.e2, culling_, t, u, v))
+					return false;
+				if (t < minT || t > closestT) return false;
+
+				closestT = t;
+				hit.t = t;
+				hit.face = tri.face;
+				hit.u = u;
+				hit.v = v;
+				return true;
+			}, stats);
+	}
+
+	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		// Transform ray from world space to object space.
+		Ray tRay;
+		tRay.origin = transformPosition(worldToModel(), ray.origin);
+		tRay.direction = transformDirection(worldToModel(), ray.direction);
+
+		MeshHit hit;
+		if (!intersect(tRay, minT, maxT, hit)) return false;
+
+		info.hitT = hit.t;
+		info.object = this;
+		info.primitive = hit.face;
+		info.u = hit.u;
+		info.v = hit.v;
+		return true;
+	}
+
+	virtual void computeSurface(const Ray& ray, HitInfo& info) const override
+	{
+		info.inDirection = ray.direction;
+		info.location = ray.origin + info.hitT * ray.direction;
+		info.shader = shader();
+
+		Eigen::Vector3f normal;
+		model_->interpolate(info.primitive, info.u, info.v, normal, info.texCoords);
+		info.normal = (normalMatrix() * normal).normalized();
+	}
+
+	/// <summary>
+	/// Does an object-space ray hit any triangle with minT <= t <= maxT?
+	/// Returns at the first one found.
+	/// </summary>
+	bool occluded(const Ray& ray, float minT, float maxT, TraversalStats* stats = nullptr) const
+	{
+		return tree_.traverseAny(ray.origin, ray.direction, minT, maxT,
+			[&](int ref) {
+				const PackedTriangle& tri = triangles_[ref];
+				float t, u, v;
+				return intersectTriangle(ray.origin, ray.direction, tri.v0, tri.e1, tri.e2, culling_, t, u, v)
+					&& t >= minT && t <= maxT;
+			}, stats);
+	}
+
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		Ray tRay;
+		tRay.origin = transformPosition(worldToModel(), ray.origin);
+		tRay.direction = transformDirection(worldToModel(), ray.direction);
+		return occluded(tRay, minT, maxT);
+	}
+};
@@ -8,8 +8,21 @@ class Light
 public:
 	virtual ~Light() throw()
 	{}
-	virtual bool visibilityCheck(const Eigen::Vector3f& location, const Renderable* renderable) const = 0;
+
+	/// <summary>
+	/// The shadow ray from location towards the light: location can see the light if nothing
+	/// with the SHADOW_BITMASK bit set is hit between minT and maxT.
+	/// Shaders hand this to visibilityCheck, or queue it to be traced later with others.
+	/// </summary>
+	virtual Ray shadowRay(const Eigen::Vector3f& location, float& minT, float& maxT) const = 0;
+
+	bool visibilityCheck(const Eigen::Vector3f& location, const Renderable* renderable) const
+	{
+		float minT, maxT;
+		Ray ray = shadowRay(location, minT, maxT);
+		return !renderable->occluded(ray, minT, maxT, SHADOW_BITMASK);
+	}
+
 	virtual Eigen::Vector3f getIntensity(const Eigen::Vector3f& location) const = 0;
 	virtual Eigen::Vector3f getVecToLight(const Eigen::Vector3f& location) const = 0;
 };
-
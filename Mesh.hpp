@@ -2,106 +2,220 @@
 #include "Renderable.hpp"
 #include "GeomUtil.hpp"
 #include "Model.hpp"
+#include "PackedTriangle.hpp"
+#include <stdexcept>
 
 /// <summary>
 /// An Mesh is a regular triangle mesh. Intersections are found by testing all triangles in the
 /// mesh, which is slow for larger meshes.
-/// See AABBMesh for a faster alternative.
+/// Whenever modelToWorld is set, the triangles are transformed into world space and stored in a
+/// flat buffer, so testing a triangle needs no transforms or allocations.
+/// See AABBMesh and BVHMesh for faster alternatives.
 /// </summary>
 class Mesh : public Renderable
 {
 protected:
 	const Model* model_;
 	bool culling_;
-public:
-	Mesh(const Shader* shader, const Model* model, bool culling=true, IntersectMask mask=DEFAULT_BITMASK)
-		:Renderable(shader, mask), model_(model), culling_(culling)
-	{}
-
-	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
+	std::vector<PackedTriangle> triangles_; // World-space triangles, in face order.
+	unsigned int modelVersion_; // Model version the world-space buffers were made from.
+
+	/// <summary>
+	/// Test PACKET_LANES rays at a time against each triangle in turn, with the same test as
+	/// intersectTriangle. For each group of rays in active starting at ray first, calls
+	/// recordHits(first, lanes, tri, t, u, v) with lanes set for the rays hitting tri with
+	/// minT <= t <= maxT[i]. It returns which of the group's rays to go on testing, and may
+	/// lower their maxT.
+	/// </summary>
+	template <typename RecordHits>
+	void packetTriangleHits(const RayPacket& packet, uint64_t active, float minT, const float* maxTs, RecordHits recordHits) const
 	{
-		if (!checkMask(mask)) return false;
-
-		float closestT = std::numeric_limits<float>::max();
-		HitInfo hitInfo;
-
-		for (int f = 0; f < model_->nfaces(); ++f) {
-			if (model_->face(f).size() != 3) {
-				throw std::runtime_error("Supplied model file does not have triangular faces!");
+		PacketFloat minTs = PacketFloat::broadcast(minT), zero = PacketFloat::broadcast(0.f), one = PacketFloat::broadcast(1.f);
+		PacketFloat epsilon = PacketFloat::broadcast(1e-6f), minusEpsilon = PacketFloat::broadcast(-1e-6f);
+
+		for (int first = 0; first < packet.size; first += PACKET_LANES) {
+			int lanes = RayPacket::laneBits(active, first);
+			if (!lanes) continue;
+
+			PacketFloat ox = PacketFloat::load(&packet.origin[0][first]);
+			PacketFloat oy = PacketFloat::load(&packet.origin[1][first]);
+			PacketFloat oz = PacketFloat::load(&packet.origin[2][first]);
+			PacketFloat dx = PacketFloat::load(&packet.direction[0][first]);
+			PacketFloat dy = PacketFloat::load(&packet.direction[1][first]);
+			PacketFloat dz = PacketFloat::load(&packet.direction[2][first]);
+			PacketFloat maxT = PacketFloat::load(&maxTs[first]);
+			int found = 0; // Lanes that have hit a triangle of this mesh.
+
+			for (const PackedTriangle& tri : triangles_) {
+				PacketFloat e1x = PacketFloat::broadcast(tri.e1.x()), e1y = PacketFloat::broadcast(tri.e1.y()), e1z = PacketFloat::broadcast(tri.e1.z());
+				PacketFloat e2x = PacketFloat::broadcast(tri.e2.x()), e2y = PacketFloat::broadcast(tri.e2.y()), e2z = PacketFloat::broadcast(tri.e2.z());
+
+				// pvec = direction x e2, det = e1 . pvec
+				PacketFloat px = dy * e2z - dz * e2y, py = dz * e2x - dx * e2z, pz = dx * e2y - dy * e2x;
+				PacketFloat det = e1x * px + e1y * py + e1z * pz;
+				int valid = culling_ ? (det > epsilon).bits() : ((det > epsilon) | (det < minusEpsilon)).bits();
+				valid &= lanes;
+				if (!valid) continue;
+				PacketFloat invDet = one / det;
+
+				PacketFloat tx = ox - PacketFloat::broadcast(tri.v0.x());
+				PacketFloat ty = oy - PacketFloat::broadcast(tri.v0.y());
+				PacketFloat tz = oz - PacketFloat::broadcast(tri.v0.z());
+				PacketFloat u = (tx * px + ty * py + tz * pz) * invDet;
+
+				// qvec = tvec x e1
+				PacketFloat qx = ty * e1z - tz * e1y, qy = tz * e1x - tx * e1z, qz = tx * e1y - ty * e1x;
+				PacketFloat v = (dx * qx + dy * qy + dz * qz) * invDet;
+				PacketFloat t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+
+				// As in intersect, a hit at maxT counts, but doesn't replace an equally close one
+				// found earlier in this mesh.
+				valid &= ((u >= zero) & (v >= zero) & (u + v <= one) & (t >= minTs)).bits();
+				valid &= (t < maxT).bits() | ((t <= maxT).bits() & ~found);
+				if (!valid) continue;
+				found |= valid;
+
+				lanes = recordHits(first, valid, tri, t, u, v);
+				if (!lanes) break;
+				maxT = PacketFloat::load(&maxTs[first]);
 			}
+		}
+	}
 
-			Eigen::Vector3f v0 = model_->vert(model_->face(f)[0]);
-			Eigen::Vector3f v1 = model_->vert(model_->face(f)[1]);
-			Eigen::Vector3f v2 = model_->vert(model_->face(f)[2]);
-
-
-			// Intersection code from
-			// https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection.html
-			Eigen::Vector3f v0World = transformPosition(modelToWorld(), v0);
-			Eigen::Vector3f v1World = transformPosition(modelToWorld(), v1);
-			Eigen::Vector3f v2World = transformPosition(modelToWorld(), v2);
+public:
+	Mesh(const Shader* shader, const Model* model, bool culling=true, IntersectMask mask=DEFAULT_BITMASK)
+		:Renderable(shader, mask), model_(model), culling_(culling), modelVersion_(model->version())
+	{
+		Mesh::modelToWorld(AffineTransform::Identity());
+	}
 
-			Eigen::Vector3f v0v1 = v1World - v0World;
-			Eigen::Vector3f v0v2 = v2World - v0World;
-			Eigen::Vector3f pvec = ray.direction.cross(v0v2);
-			float det = v0v1.dot(pvec);
+	virtual void modelToWorld(const AffineTransform& m) override
+	{
+		Entity::modelToWorld(m);
+
+		// Update the world-space triangle buffer.
+		const int* face = model_->vertIndices();
+		triangles_.resize(model_->nfaces());
+		for (int f = 0; f < model_->nfaces(); ++f, face += 3) {
+			triangles_[f] = PackedTriangle(
+				transformPosition(m, model_->vert(face[0])),
+				transformPosition(m, model_->vert(face[1])),
+				transformPosition(m, model_->vert(face[2])),
+				f);
+		}
+		modelVersion_ = model_->version();
+	}
 
-			if (culling_) {
-				// if the determinant is negative, the triangle is 'back facing'
-				// if the determinant is close to 0, the ray misses the triangle
-				if (det < 1e-6) continue;
-			}
-			else {
-				// ray and triangle are parallel if det is close to 0
-				if (fabs(det) < 1e-6) continue;
-			}
+	/// <summary>
+	/// Remake the world-space buffers if the model's vertices have changed.
+	/// </summary>
+	virtual bool update() override
+	{
+		if (model_->version() == modelVersion_) return false;
+		modelToWorld(Entity::modelToWorld());
+		return true;
+	}
 
-			float invDet = 1 / det;
+	virtual bool bounds(AABB& box) const override
+	{
+		box = AABB();
+		for (const PackedTriangle& tri : triangles_) {
+			box.expand(tri.v0);
+			box.expand(tri.v0 + tri.e1);
+			box.expand(tri.v0 + tri.e2);
+		}
+		return true;
+	}
 
-			Eigen::Vector3f tvec = ray.origin - v0World;
-			float u = tvec.dot(pvec) * invDet;
-			if (u < 0 || u > 1) continue;
+	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
 
-			Eigen::Vector3f qvec = tvec.cross(v0v1);
-			float v = ray.direction.dot(qvec) * invDet;
-			if (v < 0 || u + v > 1) continue;
+		float closestT = std::numeric_limits<float>::max();
+		int closestF = -1;
+		float closestU = 0.f, closestV = 0.f;
 
-			float t = v0v2.dot(qvec) * invDet;
+		for (const PackedTriangle& tri : triangles_) {
+			float t, u, v;
+			if (!intersectTriangle(ray.origin, ray.direction, tri.v0, tri.e1, tri.e2, culling_, t, u, v)) continue;
 
 			if (t >= closestT) continue;
 
 			if (t < minT || t > maxT) continue;
 
-			info.hitT = t;
-			info.inDirection = ray.direction;
-			info.location = ray.origin + t * ray.direction;
-			info.shader = shader();
-
-			if (model_->hasNormals()) {
-				Eigen::Vector3f vn0 = model_->vn(model_->nface(f)[0]);
-				Eigen::Vector3f vn1 = model_->vn(model_->nface(f)[1]);
-				Eigen::Vector3f vn2 = model_->vn(model_->nface(f)[2]);
-				vn0 = transformNormal(modelToWorld(), vn0);
-				vn1 = transformNormal(modelToWorld(), vn1);
-				vn2 = transformNormal(modelToWorld(), vn2);
-				info.normal = ((1 - (u + v)) * vn0 + u * vn1 + v * vn2).normalized();
-			}
-			else 
-				info.normal = v0v1.cross(v0v2).normalized();
-
-			Eigen::Vector2f vt0 = model_->vt(model_->tface(f)[0]);
-			Eigen::Vector2f vt1 = model_->vt(model_->tface(f)[1]);
-			Eigen::Vector2f vt2 = model_->vt(model_->tface(f)[2]);
-			info.texCoords = (1 - (u + v)) * vt0 + u * vt1 + v * vt2;
-
 			closestT = t;
+			closestF = tri.face;
+			closestU = u;
+			closestV = v;
 		}
 
-		if (closestT == std::numeric_limits<float>::max()) {
+		if (closestF < 0) {
 			return false;
 		}
 
+		info.hitT = closestT;
+		info.object = this;
+		info.primitive = closestF;
+		info.u = closestU;
+		info.v = closestV;
 		return true;
 	}
-};
 
+	virtual void intersectPacket(const RayPacket& packet, uint64_t active, float minT, PacketHits& hits, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return;
+
+		packetTriangleHits(packet, active, minT, hits.t,
+			[&](int first, int lanes, const PackedTriangle& tri, const PacketFloat& t, const PacketFloat& u, const PacketFloat& v) {
+				float ts[PACKET_LANES], us[PACKET_LANES], vs[PACKET_LANES];
+				t.store(ts);
+				u.store(us);
+				v.store(vs);
+				for (int i = 0; i < PACKET_LANES; ++i) {
+					if (lanes >> i & 1)
+						hits.record(first + i, ts[i], this, tri.face, us[i], vs[i]);
+				}
+				return RayPacket::laneBits(active, first);
+			});
+	}
+
+	/// <summary>
+	/// Rays stop being tested as soon as they hit a triangle.
+	/// </summary>
+	virtual uint64_t occludedPacket(const RayPacket& packet, uint64_t active, float minT, const float* maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return 0;
+
+		uint64_t result = 0;
+		packetTriangleHits(packet, active, minT, maxT,
+			[&](int first, int lanes, const PackedTriangle&, const PacketFloat&, const PacketFloat&, const PacketFloat&) {
+				result |= static_cast<uint64_t>(lanes) << first;
+				return RayPacket::laneBits(active & ~result, first);
+			});
+		return result;
+	}
+
+	virtual void computeSurface(const Ray& ray, HitInfo& info) const override
+	{
+		info.inDirection = ray.direction;
+		info.location = ray.origin + info.hitT * ray.direction;
+		info.shader = shader();
+
+		Eigen::Vector3f normal;
+		model_->interpolate(info.primitive, info.u, info.v, normal, info.texCoords);
+		info.normal = (normalMatrix() * normal).normalized();
+	}
+
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		for (const PackedTriangle& tri : triangles_) {
+			float t, u, v;
+			if (intersectTriangle(ray.origin, ray.direction, tri.v0, tri.e1, tri.e2, culling_, t, u, v)
+				&& t >= minT && t <= maxT)
+				return true;
+		}
+		return false;
+	}
+};
@@ -0,0 +1,447 @@
+#pragma once
+#include "BVH.hpp"
+#include "WideBVH.hpp"
+#include "MeshHit.hpp"
+#include "Model.hpp"
+#include "Ray.hpp"
+#include "GeomUtil.hpp"
+#include "PackedTriangle.hpp"
+#include <stdexcept>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <random>
+
+/// <summary>
+/// A MeshBVH is a BVH over the triangles of a Model, built in the model's own (object) space.
+/// Triangles are copied into leaf order when the hierarchy is built, so traversal never
+/// needs to go back to the Model.
+/// Since it is in object space, one MeshBVH is valid for any modelToWorld transform: rays
+/// should be transformed into object space before querying it.
+/// With a build width of 4 or 8, the binary BVH is collapsed into a WideBVH for traversal,
+/// which may have quantized child bounds to save memory.
+/// The SpatialSAH build method may put a triangle in more than one leaf.
+/// If the model's vertices are moved, call update to refit the hierarchy.
+/// Given a cache directory, the built hierarchy is saved there in a file named after a hash of
+/// the model file's contents and the build options, and later runs memory-map it instead of
+/// building again. A hierarchy stored in the model's mesh file (see writeHierarchy) is used
+/// in the same way, ahead of the cache.
+/// </summary>
+class MeshBVH
+{
+private:
+	const Model* model_;
+	BVHBuildOptions options_;
+	BVH bvh_;
+	std::vector<PackedTriangle> triangles_; // Object-space triangles, in leaf order.
+	std::unique_ptr<WideBVH<4>> bvh4_;
+	std::unique_ptr<WideBVH<8>> bvh8_;
+	std::unique_ptr<WideBVH<4, true>> qbvh4_; // Quantized wide BVHs, used instead with options.quantized.
+	std::unique_ptr<WideBVH<8, true>> qbvh8_;
+	unsigned int modelVersion_; // Model version the hierarchy was last built or refitted for.
+	unsigned int version_; // Incremented on every refit or rebuild.
+	bool loadedFromCache_;
+
+	static constexpr uint64_t CACHE_MAGIC = 0x3230485642545221ull; // "!RTBVH02": bump when the format changes.
+	static constexpr uint32_t CACHE_KEY_VERSION = 2; // Bump when what goes into cacheKey changes.
+
+	/// <summary>
+	/// Get the object-space bounds of every triangle, in face order.
+	/// </summary>
+	std::vector<AABB> triangleBounds() const
+	{
+		int nfaces = model_->nfaces();
+		std::vector<AABB> triBounds(nfaces);
+		const int* indices = model_->vertIndices();
+#pragma omp parallel for
+		for (int f = 0; f < nfaces; ++f) {
+			for (int v = 0; v < 3; ++v)
+				triBounds[f].expand(model_->vert(indices[3 * f + v]));
+		}
+		return triBounds;
+	}
+
+	/// <summary>
+	/// Copy the model's triangles into triangles_, in the BVH's leaf order.
+	/// </summary>
+	void gatherTriangles()
+	{
+		const std::vector<int>& order = bvh_.primIndices();
+		int count = static_cast<int>(order.size());
+		triangles_.resize(count);
+		const int* indices = model_->vertIndices();
+#pragma omp parallel for
+		for (int i = 0; i < count; ++i) {
+			const int* face = indices + 3 * order[i];
+			triangles_[i] = PackedTriangle(
+				model_->vert(face[0]), model_->vert(face[1]), model_->vert(face[2]), order[i]);
+		}
+	}
+
+	/// <summary>
+	/// Split the triangle with corners v[0..2] by an axis-aligned plane, for the SpatialSAH build:
+	/// each edge adds its vertices to the side they're on, and the point where it crosses the
+	/// plane to both.
+	/// </summary>
+	static void splitTriangle(const Eigen::Vector3f* v, int axis, float position, AABB& left, AABB& right)
+	{
+		for (int i = 0; i < 3; ++i) {
+			const Eigen::Vector3f& a = v[i];
+			const Eigen::Vector3f& b = v[(i + 1) % 3];
+			if (a[axis] <= position) left.expand(a);
+			if (a[axis] >= position) right.expand(a);
+			if ((a[axis] < position && b[axis] > position) || (a[axis] > position && b[axis] < position)) {
+				Eigen::Vector3f crossing = a + (position - a[axis]) / (b[axis] - a[axis]) * (b - a);
+				crossing[axis] = position;
+				left.expand(crossing);
+				right.expand(crossing);
+			}
+		}
+	}
+
+	void build()
+	{
+		// Wide BVH leaves are tested a packet of width triangles at a time, so fill them.
+		BVHBuildOptions binaryOptions = options_;
+		binaryOptions.maxLeafSize = std::max(options_.maxLeafSize, options_.width);
+
+		// Spatial splits clip triangles many times over, so give them the corners in a flat array.
+		std::vector<Eigen::Vector3f> corners;
+		PrimitiveSplitter splitPrimitive;
+		if (options_.method == BVHBuildMethod::SpatialSAH) {
+			corners.resize(3 * static_cast<size_t>(model_->nfaces()));
+			const int* indices = model_->vertIndices();
+			for (size_t c = 0; c < corners.size(); ++c)
+				corners[c] = model_->vert(indices[c]);
+			splitPrimitive = [&corners](int f, int axis, float position, AABB& left, AABB& right) {
+				splitTriangle(&corners[3 * f], axis, position, left, right);
+			};
+		}
+		bvh_.build(triangleBounds(), binaryOptions, splitPrimitive);
+		gatherTriangles();
+
+		bvh4_.reset();
+		bvh8_.reset();
+		qbvh4_.reset();
+		qbvh8_.reset();
+		if (options_.width == 4 && options_.quantized)
+			qbvh4_ = std::make_unique<WideBVH<4, true>>(bvh_, triangles_);
+		else if (options_.width == 4)
+			bvh4_ = std::make_unique<WideBVH<4>>(bvh_, triangles_);
+		else if (options_.width == 8 && options_.quantized)
+			qbvh8_ = std::make_unique<WideBVH<8, true>>(bvh_, triangles_);
+		else if (options_.width == 8)
+			bvh8_ = std::make_unique<WideBVH<8>>(bvh_, triangles_);
+
+		modelVersion_ = model_->version();
+		++version_;
+	}
+
+	/// <summary>
+	/// Hash of the model file's contents, the model's version and the build options, identifying
+	/// a saved hierarchy. Options are hashed field by field, as the struct has padding bytes
+	/// whose values aren't defined.
+	/// </summary>
+	uint64_t cacheKey() const
+	{
+		uint64_t hash = model_->contentHash();
+		auto hashValue = [&hash](auto value) {
+			hash = hashBytes(&value, sizeof(value), hash);
+		};
+		hashValue(CACHE_KEY_VERSION);
+		hashValue(model_->version());
+		hashValue(static_cast<int32_t>(options_.method));
+		hashValue(static_cast<int32_t>(options_.bins));
+		hashValue(static_cast<int32_t>(options_.mortonBits));
+		hashValue(static_cast<int32_t>(options_.maxLeafSize));
+		hashValue(options_.traversalCost);
+		hashValue(options_.intersectionCost);
+		hashValue(static_cast<int32_t>(options_.width));
+		hashValue(static_cast<uint8_t>(options_.quantized));
+		hashValue(options_.rebuildCostRatio);
+		hashValue(options_.spatialSplitBudget);
+		hashValue(static_cast<int32_t>(options_.layout));
+		return hash;
+	}
+
+	/// <summary>
+	/// Name of the cache file for this model and these build options.
+	/// </summary>
+	std::string cacheFilename(const std::string& cacheDirectory) const
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.bvh", static_cast<unsigned long long>(cacheKey()));
+		return cacheDirectory + "/" + name;
+	}
+
+	/// <summary>
+	/// Read the hierarchy from a cache file. Returns false if the file is missing or isn't valid.
+	/// </summary>
+	bool load(const std::string& filename)
+	{
+		MappedFile file(filename);
+		return file.isOpen() && read(BinaryReader(file.data(), file.size()));
+	}
+
+	/// <summary>
+	/// Read the hierarchy as written by write. Returns false if it isn't valid.
+	/// </summary>
+	bool read(BinaryReader in)
+	{
+		uint64_t magic;
+		int nfaces;
+		if (!in.read(magic) || magic != CACHE_MAGIC || !in.read(nfaces) || nfaces != model_->nfaces()) return false;
+		if (!bvh_.read(in) || !in.readArray(triangles_)) return false;
+		if (options_.width == 4 && options_.quantized) {
+			qbvh4_ = std::make_unique<WideBVH<4, true>>();
+			if (!qbvh4_->read(in)) return false;
+		}
+		else if (options_.width == 4) {
+			bvh4_ = std::make_unique<WideBVH<4>>();
+			if (!bvh4_->read(in)) return false;
+		}
+		else if (options_.width == 8 && options_.quantized) {
+			qbvh8_ = std::make_unique<WideBVH<8, true>>();
+			if (!qbvh8_->read(in)) return false;
+		}
+		else if (options_.width == 8) {
+			bvh8_ = std::make_unique<WideBVH<8>>();
+			if (!bvh8_->read(in)) return false;
+		}
+
+		modelVersion_ = model_->version();
+		++version_;
+		return true;
+	}
+
+	/// <summary>
+	/// Write the hierarchy in the layout read by read.
+	/// </summary>
+	void write(std::ostream& out) const
+	{
+		writeValue(out, CACHE_MAGIC);
+		writeValue(out, model_->nfaces());
+		bvh_.write(out);
+		writeArray(out, triangles_);
+		if (bvh4_) bvh4_->write(out);
+		if (bvh8_) bvh8_->write(out);
+		if (qbvh4_) qbvh4_->write(out);
+		if (qbvh8_) qbvh8_->write(out);
+	}
+
+	/// <summary>
+	/// Read a hierarchy stored in the model's mesh file by writeHierarchy, if it was built with
+	/// the same options.
+	/// </summary>
+	bool loadFromModel()
+	{
+		if (!model_->hierarchy()) return false;
+		BinaryReader in(model_->hierarchy(), model_->hierarchySize());
+		uint64_t key;
+		return in.read(key) && key == cacheKey() && read(in);
+	}
+
+	/// <summary>
+	/// Write the hierarchy to a cache file. It is written to a temporary file first and then
+	/// renamed, so other processes never see a partly written cache file.
+	/// </summary>
+	bool save(const std::string& filename) const
+	{
+		std::string tempFilename = filename + "." + std::to_string(std::random_device()()) + ".tmp";
+		{
+			std::ofstream out(tempFilename, std::ofstream::binary);
+			if (!out) return false;
+			write(out);
+			if (!out) return false;
+		}
+		if (std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+			std::remove(tempFilename.c_str());
+			return false;
+		}
+		return true;
+	}
+
+public:
+	/// <summary>
+	/// Build the hierarchy over the model's triangles, unless the model's mesh file holds one
+	/// built with the same options, or a cache directory is given and it holds a matching cache
+	/// file, in which case it is loaded from there. Otherwise the newly built hierarchy is saved
+	/// in the cache directory.
+	/// </summary>
+	MeshBVH(const Model* model, const BVHBuildOptions& options = BVHBuildOptions(), const std::string& cacheDirectory = "")
+		:model_(model), options_(options), modelVersion_(0), version_(0), loadedFromCache_(false)
+	{
+		if (options_.width != 2 && options_.width != 4 && options_.width != 8) {
+			throw std::runtime_error("BVH width must be 2, 4 or 8!");
+		}
+
+		loadedFromCache_ = loadFromModel();
+		if (loadedFromCache_) return;
+
+		if (cacheDirectory.empty()) {
+			build();
+			return;
+		}
+
+		std::string filename = cacheFilename(cacheDirectory);
+		loadedFromCache_ = load(filename);
+		if (!loadedFromCache_) {
+			build();
+			save(filename);
+		}
+	}
+
+	/// <summary>
+	/// Was the hierarchy read from a cache file or the model's mesh file, rather than built?
+	/// </summary>
+	bool loadedFromCache() const
+	{
+		return loadedFromCache_;
+	}
+
+	/// <summary>
+	/// Write the hierarchy in the form Model::save stores in a mesh file, tagged with the build
+	/// options so that only a MeshBVH built with the same options uses it.
+	/// </summary>
+	void writeHierarchy(std::ostream& out) const
+	{
+		writeValue(out, cacheKey());
+		write(out);
+	}
+
+	/// <summary>
+	/// Update the hierarchy in place for new vertex positions in the model, keeping its
+	/// topology. If that degrades it past options.rebuildCostRatio, it is rebuilt instead.
+	/// </summary>
+	void refit()
+	{
+		bvh_.refit(triangleBounds());
+		if (bvh_.needsRebuild()) {
+			build();
+			return;
+		}
+
+		gatherTriangles();
+		if (bvh4_) bvh4_->refit(bvh_, triangles_);
+		if (bvh8_) bvh8_->refit(bvh_, triangles_);
+		if (qbvh4_) qbvh4_->refit(bvh_, triangles_);
+		if (qbvh8_) qbvh8_->refit(bvh_, triangles_);
+
+		modelVersion_ = model_->version();
+		++version_;
+	}
+
+	/// <summary>
+	/// Refit if the model's vertices have changed since the last build or refit.
+	/// Returns true if it did.
+	/// </summary>
+	bool update()
+	{
+		if (model_->version() == modelVersion_) return false;
+		refit();
+		return true;
+	}
+
+	/// <summary>
+	/// Counter incremented whenever the hierarchy is refitted or rebuilt, so users of a
+	/// shared MeshBVH can tell that its bounds may have changed.
+	/// </summary>
+	unsigned int version() const
+	{
+		return version_;
+	}
+
+	const Model* model() const
+	{
+		return model_;
+	}
+
+	const BVHStats& stats() const
+	{
+		return bvh_.stats();
+	}
+
+	int width() const
+	{
+		return options_.width;
+	}
+
+	AABB bounds() const
+	{
+		return bvh_.bounds();
+	}
+
+	/// <summary>
+	/// Memory used by the hierarchy and its copy of the triangles (not counting the Model).
+	/// </summary>
+	size_t memoryBytes() const
+	{
+		size_t bytes = bvh_.memoryBytes() + triangles_.size() * sizeof(PackedTriangle);
+		if (bvh4_) bytes += bvh4_->memoryBytes();
+		if (bvh8_) bytes += bvh8_->memoryBytes();
+		if (qbvh4_) bytes += qbvh4_->memoryBytes();
+		if (qbvh8_) bytes += qbvh8_->memoryBytes();
+		return bytes;
+	}
+
+	/// <summary>
+	/// Memory used by the nodes of the hierarchy that is traversed: the wide BVH if there is one.
+	/// </summary>
+	size_t nodeBytes() const
+	{
+		if (bvh4_) return bvh4_->nodeBytes();
+		if (bvh8_) return bvh8_->nodeBytes();
+		if (qbvh4_) return qbvh4_->nodeBytes();
+		if (qbvh8_) return qbvh8_->nodeBytes();
+		return bvh_.nodes().size() * sizeof(BVHNode);
+	}
+
+	/// <summary>
+	/// Find the closest triangle hit by an object-space ray with minT <= t <= maxT.
+	/// If stats is given, the traversal work is added to it.
+	/// </summary>
+	bool intersect(const Ray& ray, float minT, float maxT, bool culling, MeshHit& hit, TraversalStats* stats = nullptr) const
+	{
+		if (bvh4_) return bvh4_->intersect(ray, minT, maxT, culling, hit, stats);
+		if (bvh8_) return bvh8_->intersect(ray, minT, maxT, culling, hit, stats);
+		if (qbvh4_) return qbvh4_->intersect(ray, minT, maxT, culling, hit, stats);
+		if (qbvh8_) return qbvh8_->intersect(ray, minT, maxT, culling, hit, stats);
+
+		return bvh_.traverse(ray.origin, ray.direction, minT, maxT,
+			[&](int ref, float& closestT) {
+				const PackedTriangle& tri = triangles_[ref];
+				float t, u, v;
+				if (!intersectTriangle(ray.origin, ray.direction, tri.v0, tri.e1, tri.e2, culling, t, u, v))
+					return false;
+				if (t < minT || t > closestT) return false;
+
+				closestT = t;
+				hit.t = t;
+				hit.face = tri.face;
+				hit.u = u;
+				hit.v = v;
+				return true;
+			}, stats);
+	}
+
+	/// <summary>
+	/// Does an object-space ray hit any triangle with minT <= t <= maxT? Stops at the first
+	/// hit found, for shadow rays.
+	/// </summary>
+	bool occluded(const Ray& ray, float minT, float maxT, bool culling) const
+	{
+		if (bvh4_) return bvh4_->occluded(ray, minT, maxT, culling);
+		if (bvh8_) return bvh8_->occluded(ray, minT, maxT, culling);
+		if (qbvh4_) return qbvh4_->occluded(ray, minT, maxT, culling);
+		if (qbvh8_) return qbvh8_->occluded(ray, minT, maxT, culling);
+
+		return bvh_.traverseAny(ray.origin, ray.direction, minT, maxT,
+			[&](int ref) {
+				const PackedTriangle& tri = triangles_[ref];
+				float t, u, v;
+				return intersectTriangle(ray.origin, ray.direction, tri.v0, tri.e1, tri.e2, culling, t, u, v)
+					&& t >= minT && t <= maxT;
+			});
+	}
+};
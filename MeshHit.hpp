@@ -0,0 +1,12 @@
+#pragma once
+
+/// <summary>
+/// Result of a ray query against a MeshBVH: which face was hit, where along the ray,
+/// and the barycentric coordinates of the hit within the face.
+/// </summary>
+struct MeshHit
+{
+	float t;
+	int face;
+	float u, v;
+};
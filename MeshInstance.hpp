@@ -0,0 +1,94 @@
+#pragma once
+#include "Renderable.hpp"
+#include "MeshBVH.hpp"
+#include "GeomUtil.hpp"
+#include <memory>
+
+/// <summary>
+/// A MeshInstance is one placement of a triangle mesh whose BVH is shared with other
+/// instances. The BVH is in object space, and each instance transforms rays into object
+/// space once before traversing it, so thousands of copies of the same Model only cost
+/// a modelToWorld matrix each, rather than a copy of every triangle.
+/// Make the shared BVH with std::make_shared<MeshBVH>(model), or take it from a BVHMesh.
+/// If the Model is deformed, update the shared BVH before updating the Scenes holding instances.
+/// </summary>
+class MeshInstance : public Renderable
+{
+private:
+	std::shared_ptr<const MeshBVH> bvh_;
+	const Model* model_;
+	bool culling_;
+	unsigned int bvhVersion_; // Version of the shared BVH when this instance last looked at it.
+public:
+	MeshInstance(const Shader* shader, std::shared_ptr<const MeshBVH> bvh, bool culling=true, IntersectMask mask=DEFAULT_BITMASK)
+		:Renderable(shader, mask), bvh_(std::move(bvh)), model_(bvh_->model()), culling_(culling), bvhVersion_(bvh_->version())
+	{}
+
+	const MeshBVH& bvh() const
+	{
+		return *bvh_;
+	}
+
+	const std::shared_ptr<const MeshBVH>& sharedBVH() const
+	{
+		return bvh_;
+	}
+
+	virtual bool bounds(AABB& box) const override
+	{
+		box = bvh_->bounds().transformed(modelToWorld());
+		return true;
+	}
+
+	/// <summary>
+	/// The shared BVH is refitted by its owner (see MeshBVH::update); this only reports
+	/// whether that has happened since the last call, as the bounds may have changed.
+	/// </summary>
+	virtual bool update() override
+	{
+		if (bvh_->version() == bvhVersion_) return false;
+		bvhVersion_ = bvh_->version();
+		return true;
+	}
+
+	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		// Transform ray from world space to object space.
+		Ray tRay;
+		tRay.origin = transformPosition(worldToModel(), ray.origin);
+		tRay.direction = transformDirection(worldToModel(), ray.direction);
+
+		MeshHit hit;
+		if (!bvh_->intersect(tRay, minT, maxT, culling_, hit)) return false;
+
+		info.hitT = hit.t;
+		info.object = this;
+		info.primitive = hit.face;
+		info.u = hit.u;
+		info.v = hit.v;
+		return true;
+	}
+
+	virtual void computeSurface(const Ray& ray, HitInfo& info) const override
+	{
+		info.inDirection = ray.direction;
+		info.location = ray.origin + info.hitT * ray.direction;
+		info.shader = shader();
+
+		Eigen::Vector3f normal;
+		model_->interpolate(info.primitive, info.u, info.v, normal, info.texCoords);
+		info.normal = (normalMatrix() * normal).normalized();
+	}
+
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		Ray tRay;
+		tRay.origin = transformPosition(worldToModel(), ray.origin);
+		tRay.direction = transformDirection(worldToModel(), ray.direction);
+		return bvh_->occluded(tRay, minT, maxT, culling_);
+	}
+};
@@ -9,29 +9,19 @@ class MirrorShader : public Shader
 {
 public:
 
-	virtual Eigen::Vector3f getColor(const HitInfo& hitInfo, 
-		const Renderable* scene, 
-		const std::vector<std::unique_ptr<Light>>& lights,
-		const Eigen::Vector3f& ambientLight,
+	virtual void shade(const HitInfo& hitInfo,
+		const std::vector<std::unique_ptr<Light>>& /*lights*/,
+		const Eigen::Vector3f& /*ambientLight*/,
 		int currBounceCount,
-		const int maxBounces) const
+		const int maxBounces,
+		ShadingOutput& output) const override
 	{
-		if (currBounceCount >= maxBounces) return Eigen::Vector3f::Zero();
+		if (currBounceCount >= maxBounces) return;
 
 		Ray reflectionRay;
 		reflectionRay.direction = reflect(hitInfo.inDirection, hitInfo.normal);
 		reflectionRay.origin = hitInfo.location + 1e-4f * hitInfo.normal;
 
-		Eigen::Vector3f color = Eigen::Vector3f::Zero();
-
-		HitInfo reflectionHit;
-		if (scene->intersect(reflectionRay, 1e-6f, 1e4f, reflectionHit, VISIBLE_BITMASK)) {
-			color = reflectionHit.shader->getColor(
-				reflectionHit, scene, 
-				lights, ambientLight, 
-				currBounceCount+1, maxBounces);
-		}
-
-		return color;
+		output.addRay(reflectionRay, 1e4f, Eigen::Vector3f::Ones());
 	}
 };
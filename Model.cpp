@@ -1,97 +1,468 @@
 #include <iostream>
 #include <string>
-#include <fstream>
-#include <sstream>
 #include <vector>
+#include <fstream>
+#include <chrono>
+#include <algorithm>
+#include <charconv>
+#include <stdexcept>
 #include "Model.hpp"
+#include "BinaryIO.hpp"
+
+namespace {
+
+const size_t CHUNK_SIZE = 1 << 22; // bytes of obj text parsed by each task; changing it changes contentHash
+
+const uint64_t MESH_MAGIC = 0x314853454d545221ull; // "!RTMESH1": bump when the format changes
+const int MESH_SECTIONS = 12; // positions x, y, z, normals x, y, z, texture coordinates u, v, the three index buffers, hierarchy
+const uint64_t MESH_ALIGNMENT = 64; // sections start on a cache line
+
+// Header of a mesh file written by Model::save. Each section is a flat array at the given offset.
+struct MeshFileHeader {
+    uint64_t magic;
+    uint64_t contentHash;
+    int32_t nverts, nvts, nvns, nfaces;
+    uint64_t offsets[MESH_SECTIONS];
+    uint64_t hierarchySize;
+};
 
-Model::Model(const char *filename) : verts_(), faces_(), vts_() {
-    std::ifstream in;
-    in.open (filename, std::ifstream::in);
-    if (in.fail()) throw std::runtime_error("Couldn't open input model file!");
-    std::string line;
-    while (!in.eof()) {
-        std::getline(in, line);
-        std::istringstream iss(line.c_str());
-        char trash;
-        if (!line.compare(0, 2, "v ")) {       // read 2 characters and check the line starts with "v"
-            iss >> trash;
-            Eigen::Vector3f v;
-            for (int i=0;i<3;i++) iss >> v[i];
-            verts_.push_back(v);
+void meshSectionSizes(const MeshFileHeader& header, uint64_t bytes[MESH_SECTIONS]) {
+    for (int i = 0; i < 3; i++) bytes[i] = (uint64_t)header.nverts * sizeof(float);
+    for (int i = 3; i < 6; i++) bytes[i] = (uint64_t)header.nvns * sizeof(float);
+    for (int i = 6; i < 8; i++) bytes[i] = (uint64_t)header.nvts * sizeof(float);
+    for (int i = 8; i < 11; i++) bytes[i] = 3 * (uint64_t)header.nfaces * sizeof(int);
+    bytes[11] = header.hierarchySize;
+}
+
+// Everything parsed from one chunk of an obj file. Face indices are zero based; where the file
+// used negative (relative) indices they are relative to the chunk's first element (so may be
+// negative themselves), and their positions are listed in relative so they can be fixed up
+// once the chunk's offset is known.
+struct ObjChunk {
+    std::vector<float> positions[3], normals[3], texCoords[2];
+    std::vector<int> indices[3]; // vertex, texture and normal index of every triangle corner, -1 if missing
+    std::vector<size_t> relative[3];
+};
+
+const char* skipSpaces(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    return p;
+}
+
+const char* parseFloat(const char* p, const char* end, float& value) {
+    p = skipSpaces(p, end);
+    if (p < end && *p == '+') p++; // from_chars doesn't accept a leading +
+    std::from_chars_result result = std::from_chars(p, end, value);
+    if (result.ec != std::errc()) value = 0.f;
+    return result.ptr;
+}
+
+// parse one v, v/vt, v//vn or v/vt/vn corner of a face, returning false at the end of the line
+bool parseCorner(const char*& p, const char* end, int corner[3]) {
+    p = skipSpaces(p, end);
+    corner[0] = corner[1] = corner[2] = 0;
+    for (int i = 0; i < 3; i++) {
+        if (p < end && *p != '/') {
+            if (*p == '+') p++;
+            std::from_chars_result result = std::from_chars(p, end, corner[i]);
+            if (result.ec != std::errc()) return false;
+            p = result.ptr;
         }
-        else if (!line.compare(0, 3, "vt ")) { // read 3 characters and check the line starts with "vt "
-            iss >> trash;
-            iss >> trash;
-            Eigen::Vector2f vt;
-            for (int i=0; i<2; i++) iss >> vt[i]; 
-            vts_.push_back(vt);
+        if (i == 2 || p >= end || *p != '/') break;
+        p++;
+    }
+    return corner[0] != 0;
+}
+
+void parseChunk(const char* p, const char* end, ObjChunk& chunk) {
+    std::vector<int> polygon[3];
+    std::vector<bool> polygonRelative[3];
+    while (p < end) {
+        const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (!lineEnd) lineEnd = end;
+        const char* q = skipSpaces(p, lineEnd);
+        if (lineEnd - q >= 2 && q[0] == 'v' && (q[1] == ' ' || q[1] == '\t')) {
+            q += 2;
+            for (int i = 0; i < 3; i++) {
+                float value;
+                q = parseFloat(q, lineEnd, value);
+                chunk.positions[i].push_back(value);
+            }
         }
-        if (!line.compare(0, 3, "vn ")) {       // read 2 characters and check the line starts with "v"
-            iss >> trash;
-            iss >> trash;
-            Eigen::Vector3f vn;
-            for (int i=0;i<3;i++) iss >> vn[i];
-            vns_.push_back(vn);
+        else if (lineEnd - q >= 3 && q[0] == 'v' && q[1] == 't' && (q[2] == ' ' || q[2] == '\t')) {
+            q += 3;
+            for (int i = 0; i < 2; i++) {
+                float value;
+                q = parseFloat(q, lineEnd, value);
+                chunk.texCoords[i].push_back(value);
+            }
         }
-        else if (!line.compare(0, 2, "f ")) { // f v1/vt1/vn1 v2/vt2/vn2 v3/vt3/vn3 ... making assumption v1==vt1 etc.
-            std::vector<int> f;
-            std::vector<int> tf;
-            std::vector<int> nf;
-            int itrash, idx, tidx, nidx;
-            iss >> trash;
-            while (iss >> idx >> trash >> tidx >> trash >> nidx) { // read in v_i to idx and discard /vt_i/vn_i
-                idx--; // in wavefront obj all indices start at 1, not zero, we need them to start at zero
-                tidx--;
-                nidx--;
-                f.push_back(idx);
-                tf.push_back(tidx);
-                nf.push_back(nidx);
+        else if (lineEnd - q >= 3 && q[0] == 'v' && q[1] == 'n' && (q[2] == ' ' || q[2] == '\t')) {
+            q += 3;
+            for (int i = 0; i < 3; i++) {
+                float value;
+                q = parseFloat(q, lineEnd, value);
+                chunk.normals[i].push_back(value);
             }
-            faces_.push_back(f);
-            tfaces_.push_back(tf);
-            nfaces_.push_back(nf);
+        }
+        else if (lineEnd - q >= 2 && q[0] == 'f' && (q[1] == ' ' || q[1] == '\t')) {
+            q += 2;
+            for (int i = 0; i < 3; i++) {
+                polygon[i].clear();
+                polygonRelative[i].clear();
+            }
+            int corner[3];
+            while (parseCorner(q, lineEnd, corner)) {
+                int counts[3] = { (int)chunk.positions[0].size(), (int)chunk.texCoords[0].size(), (int)chunk.normals[0].size() };
+                for (int i = 0; i < 3; i++) {
+                    // in wavefront obj indices start at 1, not zero, and negative ones count back from the latest element
+                    polygon[i].push_back(corner[i] > 0 ? corner[i] - 1 : corner[i] < 0 ? counts[i] + corner[i] : -1);
+                    polygonRelative[i].push_back(corner[i] < 0);
+                }
+            }
+            // split the polygon into a fan of triangles around its first vertex
+            for (size_t v = 2; v < polygon[0].size(); v++) {
+                size_t corners[3] = { 0, v - 1, v };
+                for (size_t c : corners) {
+                    for (int i = 0; i < 3; i++) {
+                        if (polygonRelative[i][c]) chunk.relative[i].push_back(chunk.indices[i].size());
+                        chunk.indices[i].push_back(polygon[i][c]);
+                    }
+                }
+            }
+        }
+        p = lineEnd + 1;
+    }
+}
+
+}
+
+Model::Model(const char *filename) : hierarchy_(nullptr), hierarchySize_(0), version_(0) {
+    auto start = std::chrono::high_resolution_clock::now();
+    mapping_ = std::make_unique<MappedFile>(filename);
+    if (!mapping_->isOpen()) throw std::runtime_error("Couldn't open input model file!");
+    size_t size = mapping_->size();
+    bool isMesh = mapMesh();
+    if (!isMesh) {
+        loadObj(mapping_->data(), size);
+        mapping_.reset();
+        useOwnArrays();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    double megabytes = size / (1024.0 * 1024.0);
+    std::cerr << "# v# " << nverts() << " f# "  << nfaces() << " (" << megabytes << " MB " << (isMesh ? "mapped" : "parsed")
+        << " in " << seconds << " s, " << megabytes / seconds << " MB/s)" << std::endl;
+}
+
+// Parse an obj file into the model's own vectors, and hash its contents to identify it (see contentHash).
+void Model::loadObj(const char* text, size_t size) {
+    // split the file into chunks that start at the beginning of a line, and parse them in parallel
+    std::vector<size_t> bounds(1, 0);
+    while (bounds.back() < size) {
+        size_t next = std::min(bounds.back() + CHUNK_SIZE, size);
+        const char* newline = static_cast<const char*>(memchr(text + next, '\n', size - next));
+        bounds.push_back(newline ? newline - text + 1 : size);
+    }
+    int nchunks = (int)bounds.size() - 1;
+    std::vector<ObjChunk> chunks(nchunks);
+    std::vector<uint64_t> chunkHashes(nchunks);
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < nchunks; c++) {
+        chunkHashes[c] = hashBytes(text + bounds[c], bounds[c + 1] - bounds[c]);
+        parseChunk(text + bounds[c], text + bounds[c + 1], chunks[c]);
+    }
+    // the chunks only depend on the text and CHUNK_SIZE, so this doesn't depend on the thread count
+    contentHash_ = hashBytes(chunkHashes.data(), chunkHashes.size() * sizeof(uint64_t));
+
+    // offsets of each chunk's vertices, texture coordinates, normals and triangle corners in the merged arrays
+    std::vector<size_t> offsets[4];
+    for (int i = 0; i < 4; i++) offsets[i].assign(nchunks + 1, 0);
+    for (int c = 0; c < nchunks; c++) {
+        offsets[0][c + 1] = offsets[0][c] + chunks[c].positions[0].size();
+        offsets[1][c + 1] = offsets[1][c] + chunks[c].texCoords[0].size();
+        offsets[2][c + 1] = offsets[2][c] + chunks[c].normals[0].size();
+        offsets[3][c + 1] = offsets[3][c] + chunks[c].indices[0].size();
+    }
+    for (int i = 0; i < 3; i++) positions_[i].resize(offsets[0][nchunks]);
+    for (int i = 0; i < 2; i++) texCoords_[i].resize(offsets[1][nchunks]);
+    for (int i = 0; i < 3; i++) normals_[i].resize(offsets[2][nchunks]);
+    std::vector<int>* indices[3] = { &vertIndices_, &texIndices_, &normalIndices_ };
+    for (int i = 0; i < 3; i++) indices[i]->resize(offsets[3][nchunks]);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < nchunks; c++) {
+        ObjChunk& chunk = chunks[c];
+        for (int i = 0; i < 3; i++) std::copy(chunk.positions[i].begin(), chunk.positions[i].end(), positions_[i].begin() + offsets[0][c]);
+        for (int i = 0; i < 2; i++) std::copy(chunk.texCoords[i].begin(), chunk.texCoords[i].end(), texCoords_[i].begin() + offsets[1][c]);
+        for (int i = 0; i < 3; i++) std::copy(chunk.normals[i].begin(), chunk.normals[i].end(), normals_[i].begin() + offsets[2][c]);
+        for (int i = 0; i < 3; i++) {
+            for (size_t r : chunk.relative[i]) chunk.indices[i][r] += (int)offsets[i][c];
+            std::copy(chunk.indices[i].begin(), chunk.indices[i].end(), indices[i]->begin() + offsets[3][c]);
+        }
+    }
+    chunks.clear();
+
+    // point corners missing texture coordinates at an extra (0, 0) one, and give corners missing
+    // normals the normal of their face, unless the file has no normals at all
+    int nvts = (int)texCoords_[0].size();
+    bool addedTexCoord = false;
+    for (int& t : texIndices_) {
+        if (t >= 0) continue;
+        if (!addedTexCoord) {
+            for (int i = 0; i < 2; i++) texCoords_[i].push_back(0.f);
+            addedTexCoord = true;
+        }
+        t = nvts;
+    }
+    if (!normals_[0].empty()) {
+        auto vert = [this](int i) { return Eigen::Vector3f(positions_[0][i], positions_[1][i], positions_[2][i]); };
+        for (size_t f = 0; f < vertIndices_.size() / 3; f++) {
+            int* nface = &normalIndices_[3 * f];
+            if (nface[0] >= 0 && nface[1] >= 0 && nface[2] >= 0) continue;
+            Eigen::Vector3f v0 = vert(vertIndices_[3 * f]);
+            Eigen::Vector3f n = (vert(vertIndices_[3 * f + 1]) - v0).cross(vert(vertIndices_[3 * f + 2]) - v0).normalized();
+            int faceNormal = (int)normals_[0].size();
+            for (int i = 0; i < 3; i++) normals_[i].push_back(n[i]);
+            for (int v = 0; v < 3; v++)
+                if (nface[v] < 0) nface[v] = faceNormal;
         }
     }
-    std::cerr << "# v# " << verts_.size() << " f# "  << faces_.size() << std::endl;
+}
+
+// Map the arrays of a mesh file straight out of mapping_. Returns false if it isn't a mesh file.
+bool Model::mapMesh() {
+    const char* data = mapping_->data();
+    size_t size = mapping_->size();
+    MeshFileHeader header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != MESH_MAGIC) return false;
+
+    int counts[4] = { header.nverts, header.nvts, header.nvns, header.nfaces };
+    for (int count : counts)
+        if (count < 0) throw std::runtime_error("Invalid mesh file!");
+    uint64_t bytes[MESH_SECTIONS];
+    meshSectionSizes(header, bytes);
+    const void* sections[MESH_SECTIONS];
+    for (int i = 0; i < MESH_SECTIONS; i++) {
+        // the arrays are read in place, so they must be aligned as well as inside the file
+        if (header.offsets[i] % 4 != 0 || header.offsets[i] > size || size - header.offsets[i] < bytes[i])
+            throw std::runtime_error("Invalid mesh file!");
+        sections[i] = data + header.offsets[i];
+    }
+
+    for (int i = 0; i < 3; i++) positionData_[i] = static_cast<const float*>(sections[i]);
+    for (int i = 0; i < 3; i++) normalData_[i] = static_cast<const float*>(sections[3 + i]);
+    for (int i = 0; i < 2; i++) texCoordData_[i] = static_cast<const float*>(sections[6 + i]);
+    vertIndexData_ = static_cast<const int*>(sections[8]);
+    texIndexData_ = static_cast<const int*>(sections[9]);
+    normalIndexData_ = static_cast<const int*>(sections[10]);
+    hierarchy_ = header.hierarchySize > 0 ? static_cast<const char*>(sections[11]) : nullptr;
+    hierarchySize_ = header.hierarchySize;
+    nverts_ = header.nverts;
+    nvts_ = header.nvts;
+    nvns_ = header.nvns;
+    nfaces_ = header.nfaces;
+    contentHash_ = header.contentHash;
+    return true;
+}
+
+// Point the arrays in use at the model's own vectors.
+void Model::useOwnArrays() {
+    for (int i = 0; i < 3; i++) positionData_[i] = positions_[i].data();
+    for (int i = 0; i < 3; i++) normalData_[i] = normals_[i].data();
+    for (int i = 0; i < 2; i++) texCoordData_[i] = texCoords_[i].data();
+    vertIndexData_ = vertIndices_.data();
+    texIndexData_ = texIndices_.data();
+    normalIndexData_ = normalIndices_.data();
+    nverts_ = (int)positions_[0].size();
+    nvts_ = (int)texCoords_[0].size();
+    nvns_ = (int)normals_[0].size();
+    nfaces_ = (int)(vertIndices_.size() / 3);
+}
+
+// Copy the arrays out of a mapped mesh file, so they can be changed. The prebuilt hierarchy
+// is dropped, as it wouldn't match the changed model.
+void Model::copyMappedArrays() {
+    if (!mapping_) return;
+    for (int i = 0; i < 3; i++) positions_[i].assign(positionData_[i], positionData_[i] + nverts_);
+    for (int i = 0; i < 3; i++) normals_[i].assign(normalData_[i], normalData_[i] + nvns_);
+    for (int i = 0; i < 2; i++) texCoords_[i].assign(texCoordData_[i], texCoordData_[i] + nvts_);
+    vertIndices_.assign(vertIndexData_, vertIndexData_ + 3 * (size_t)nfaces_);
+    texIndices_.assign(texIndexData_, texIndexData_ + 3 * (size_t)nfaces_);
+    normalIndices_.assign(normalIndexData_, normalIndexData_ + 3 * (size_t)nfaces_);
+    hierarchy_ = nullptr;
+    hierarchySize_ = 0;
+    mapping_.reset();
+    useOwnArrays();
+}
+
+// Write the model as a mesh file, which the constructor can map without parsing. hierarchy is
+// stored as is, for a MeshBVH to read back (see MeshBVH::writeHierarchy).
+bool Model::save(const char* filename, const std::string& hierarchy) const {
+    MeshFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = MESH_MAGIC;
+    header.contentHash = contentHash_;
+    header.nverts = nverts_;
+    header.nvts = nvts_;
+    header.nvns = nvns_;
+    header.nfaces = nfaces_;
+    header.hierarchySize = hierarchy.size();
+    uint64_t bytes[MESH_SECTIONS];
+    meshSectionSizes(header, bytes);
+    uint64_t offset = sizeof(header);
+    for (int i = 0; i < MESH_SECTIONS; i++) {
+        offset = (offset + MESH_ALIGNMENT - 1) / MESH_ALIGNMENT * MESH_ALIGNMENT;
+        header.offsets[i] = offset;
+        offset += bytes[i];
+    }
+
+    const void* sections[MESH_SECTIONS] = {
+        positionData_[0], positionData_[1], positionData_[2],
+        normalData_[0], normalData_[1], normalData_[2],
+        texCoordData_[0], texCoordData_[1],
+        vertIndexData_, texIndexData_, normalIndexData_,
+        hierarchy.data() };
+    std::ofstream out(filename, std::ofstream::binary);
+    if (!out) return false;
+    writeValue(out, header);
+    uint64_t written = sizeof(header);
+    const char padding[MESH_ALIGNMENT] = {};
+    for (int i = 0; i < MESH_SECTIONS; i++) {
+        out.write(padding, header.offsets[i] - written);
+        out.write(static_cast<const char*>(sections[i]), bytes[i]);
+        written = header.offsets[i] + bytes[i];
+    }
+    return (bool)out;
 }
 
 Model::~Model() {
 }
 
+bool Model::mapped() const {
+    return mapping_ != nullptr;
+}
+
+const char* Model::hierarchy() const {
+    return hierarchy_;
+}
+
+size_t Model::hierarchySize() const {
+    return hierarchySize_;
+}
+
 int Model::nverts() const {
-    return (int)verts_.size();
+    return nverts_;
 }
 
 int Model::nfaces() const {
-    return (int)faces_.size();
+    return nfaces_;
+}
+
+int Model::nvts() const {
+    return nvts_;
+}
+
+int Model::nvns() const {
+    return nvns_;
 }
 
 bool Model::hasNormals() const {
-    return vns_.size() > 0;
+    return nvns_ > 0;
+}
+
+const float* Model::positions(int axis) const {
+    return positionData_[axis];
+}
+
+const float* Model::normals(int axis) const {
+    return normalData_[axis];
+}
+
+const float* Model::texCoords(int component) const {
+    return texCoordData_[component];
+}
+
+const int* Model::vertIndices() const {
+    return vertIndexData_;
+}
+
+const int* Model::texIndices() const {
+    return texIndexData_;
+}
+
+const int* Model::normalIndices() const {
+    return normalIndexData_;
 }
 
 std::vector<int> Model::face(int idx) const {
-    return faces_[idx];
+    return std::vector<int>(vertIndexData_ + 3 * idx, vertIndexData_ + 3 * idx + 3);
 }
 
 Eigen::Vector3f Model::vert(int i) const {
-    return verts_[i];
+    return Eigen::Vector3f(positionData_[0][i], positionData_[1][i], positionData_[2][i]);
 }
 
 Eigen::Vector2f Model::vt(int i) const {
-    return vts_[i];
+    return Eigen::Vector2f(texCoordData_[0][i], texCoordData_[1][i]);
 }
 
 std::vector<int> Model::tface(int idx) const {
-    return tfaces_[idx];
+    return std::vector<int>(texIndexData_ + 3 * idx, texIndexData_ + 3 * idx + 3);
 }
 
 Eigen::Vector3f Model::vn(int i) const {
-    return vns_[i];
+    return Eigen::Vector3f(normalData_[0][i], normalData_[1][i], normalData_[2][i]);
 }
 
 std::vector<int> Model::nface(int idx) const {
-    return nfaces_[idx];
+    return std::vector<int>(normalIndexData_ + 3 * idx, normalIndexData_ + 3 * idx + 3);
+}
+
+// The normal and texture coordinates at barycentric coordinates (u, v) on face idx, in model space.
+// The normal is interpolated from the vertex normals, or is the face normal if the model has none,
+// and isn't normalised.
+void Model::interpolate(int idx, float u, float v, Eigen::Vector3f& normal, Eigen::Vector2f& texCoords) const {
+    float w = 1 - (u + v);
+    if (hasNormals()) {
+        const int* nface = normalIndexData_ + 3 * idx;
+        for (int axis = 0; axis < 3; axis++) {
+            const float* n = normalData_[axis];
+            normal[axis] = w * n[nface[0]] + u * n[nface[1]] + v * n[nface[2]];
+        }
+    } else {
+        const int* face = vertIndexData_ + 3 * idx;
+        Eigen::Vector3f v0 = vert(face[0]);
+        normal = (vert(face[1]) - v0).cross(vert(face[2]) - v0);
+    }
+
+    const int* tface = texIndexData_ + 3 * idx;
+    const float* s = texCoordData_[0];
+    const float* t = texCoordData_[1];
+    texCoords = Eigen::Vector2f(
+        w * s[tface[0]] + u * s[tface[1]] + v * s[tface[2]],
+        w * t[tface[0]] + u * t[tface[1]] + v * t[tface[2]]);
+}
+
+
+void Model::setVert(int i, const Eigen::Vector3f& v) {
+    copyMappedArrays();
+    for (int axis = 0; axis < 3; axis++) positions_[axis][i] = v[axis];
+    version_++;
 }
 
+void Model::setVn(int i, const Eigen::Vector3f& vn) {
+    copyMappedArrays();
+    for (int axis = 0; axis < 3; axis++) normals_[axis][i] = vn[axis];
+    version_++;
+}
+
+unsigned int Model::version() const {
+    return version_;
+}
+
+uint64_t Model::contentHash() const {
+    return contentHash_;
+}
@@ -1,29 +1,79 @@
 #pragma once
 
 #include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
 #include <Eigen/Dense>
 
+class MappedFile;
+
 /// <summary>
-/// A Model stores mesh data and can load this data from an obj file.
+/// A Model stores mesh data and can load this data from an obj file, or from a binary mesh
+/// file written by save.
+/// Vertex positions, normals and texture coordinates are each kept as one contiguous float
+/// array per component (structure of arrays), and faces as flat triangle index buffers, three
+/// indices per triangle. Polygons in the file are split into fans of triangles, so a "face"
+/// is always a triangle. Hot code should use the pointer accessors; the per-face vector
+/// accessors are kept for convenience but allocate on every call.
+/// A mesh file is memory-mapped and the arrays point straight into it, so loading one is
+/// nearly free however large it is. The arrays are only copied out if the model is changed.
 /// </summary>
 class Model {
 private:
-	std::vector<Eigen::Vector3f> verts_, vns_; // Vertices and vertex normals
-	std::vector<Eigen::Vector2f> vts_; // Texture coordinates
-	std::vector<std::vector<int> > faces_;  // Face indices of the vertices
-	std::vector<std::vector<int> > tfaces_;  // Face indices of the texture coordinates
-	std::vector<std::vector<int> > nfaces_;  // Face indices of the vertex normals
+	// Arrays parsed from an obj file, or copied out of a mapped mesh file once it is changed.
+	std::vector<float> positions_[3]; // Vertex positions, one array per axis
+	std::vector<float> normals_[3]; // Vertex normals, one array per axis
+	std::vector<float> texCoords_[2]; // Texture coordinates, one array per component
+	std::vector<int> vertIndices_; // Per triangle, the indices of its three vertices
+	std::vector<int> texIndices_; // Per triangle, the indices of its three texture coordinates
+	std::vector<int> normalIndices_; // Per triangle, the indices of its three vertex normals
+	// The arrays in use: either the vectors above, or views into mapping_.
+	const float* positionData_[3];
+	const float* normalData_[3];
+	const float* texCoordData_[2];
+	const int* vertIndexData_;
+	const int* texIndexData_;
+	const int* normalIndexData_;
+	int nverts_, nvts_, nvns_, nfaces_;
+	std::unique_ptr<MappedFile> mapping_; // Mesh file the arrays point into, if any
+	const char* hierarchy_; // Prebuilt hierarchy stored in the mesh file, if any
+	size_t hierarchySize_;
+	unsigned int version_; // Incremented whenever vertices or normals are changed
+	uint64_t contentHash_; // Hash of the obj file the model was loaded or converted from, combined from the hashes of its chunks
+	void loadObj(const char* text, size_t size);
+	bool mapMesh();
+	void useOwnArrays();
+	void copyMappedArrays();
 public:
 	Model(const char *filename);
 	~Model();
+	Model(const Model&) = delete;
+	Model& operator =(const Model&) = delete;
+	bool save(const char* filename, const std::string& hierarchy = std::string()) const;
+	bool mapped() const;
+	const char* hierarchy() const;
+	size_t hierarchySize() const;
 	int nverts() const;
 	int nfaces() const;
+	int nvts() const;
+	int nvns() const;
+	const float* positions(int axis) const;
+	const float* normals(int axis) const;
+	const float* texCoords(int component) const;
+	const int* vertIndices() const;
+	const int* texIndices() const;
+	const int* normalIndices() const;
 	Eigen::Vector3f vert(int i) const;
 	Eigen::Vector2f vt(int i) const;
 	Eigen::Vector3f vn(int i) const;
 	std::vector<int> face(int idx) const;
 	std::vector<int> tface(int idx) const;
 	std::vector<int> nface(int idx) const;
+	void interpolate(int idx, float u, float v, Eigen::Vector3f& normal, Eigen::Vector2f& texCoords) const;
 	bool hasNormals() const;
+	void setVert(int i, const Eigen::Vector3f& v);
+	void setVn(int i, const Eigen::Vector3f& vn);
+	unsigned int version() const;
+	uint64_t contentHash() const;
 };
-
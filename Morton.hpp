@@ -0,0 +1,162 @@
+#pragma once
+#include <Eigen/Dense>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/// <summary>
+/// Spread the low 10 bits of x out so there are two zero bits between each of them.
+/// </summary>
+uint32_t expandBits10(uint32_t x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+/// <summary>
+/// Spread the low 21 bits of x out so there are two zero bits between each of them.
+/// </summary>
+uint64_t expandBits21(uint64_t x)
+{
+	x &= 0x1fffff;
+	x = (x | (x << 32)) & 0x001f00000000ffffull;
+	x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+	x = (x | (x << 8)) & 0x100f00f00f00f00full;
+	x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+	x = (x | (x << 2)) & 0x1249249249249249ull;
+	return x;
+}
+
+/// <summary>
+/// 30-bit Morton code (10 bits per axis) of a point given in [0, 1]^3.
+/// Points that are close in space tend to have close Morton codes.
+/// </summary>
+uint32_t mortonCode30(const Eigen::Vector3f& p)
+{
+	uint32_t code = 0;
+	for (int a = 0; a < 3; ++a) {
+		float scaled = std::min(std::max(p[a] * 1024.f, 0.f), 1023.f);
+		code |= expandBits10(static_cast<uint32_t>(scaled)) << (2 - a);
+	}
+	return code;
+}
+
+/// <summary>
+/// 63-bit Morton code (21 bits per axis) of a point given in [0, 1]^3.
+/// </summary>
+uint64_t mortonCode63(const Eigen::Vector3f& p)
+{
+	uint64_t code = 0;
+	for (int a = 0; a < 3; ++a) {
+		float scaled = std::min(std::max(p[a] * 2097152.f, 0.f), 2097151.f);
+		code |= expandBits21(static_cast<uint64_t>(scaled)) << (2 - a);
+	}
+	return code;
+}
+
+/// <summary>
+/// Spread the low 16 bits of x out so there is a zero bit between each of them.
+/// </summary>
+uint32_t expandBits16(uint32_t x)
+{
+	x &= 0xffff;
+	x = (x | (x << 8)) & 0x00ff00ff;
+	x = (x | (x << 4)) & 0x0f0f0f0f;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+/// <summary>
+/// 32-bit Morton code of a point on a 2D grid, with x and y below 65536.
+/// </summary>
+uint32_t mortonCode2D(uint32_t x, uint32_t y)
+{
+	return expandBits16(x) | expandBits16(y) << 1;
+}
+
+/// <summary>
+/// Distance along a Hilbert curve filling a side x side grid (side a power of two) to the
+/// cell (x, y). Unlike a Morton curve, consecutive cells on the curve are always neighbours.
+/// </summary>
+uint32_t hilbertIndex(uint32_t side, uint32_t x, uint32_t y)
+{
+	uint32_t d = 0;
+	for (uint32_t s = side / 2; s > 0; s /= 2) {
+		uint32_t rx = (x & s) > 0, ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+		// Rotate the quadrant so the curve within it starts and ends in the right corners.
+		if (ry == 0) {
+			if (rx == 1) {
+				x = side - 1 - x;
+				y = side - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+/// <summary>
+/// Stable least-significant-digit radix sort of keys, applying the same permutation to values.
+/// Only the low keyBits bits of the keys are sorted on. Each pass gives every thread a
+/// contiguous chunk of the input: threads count their digits, the counts are turned into
+/// per-thread output offsets, and then each thread scatters its own chunk.
+/// </summary>
+template <typename Key>
+void radixSort(std::vector<Key>& keys, std::vector<int>& values, int keyBits)
+{
+	const int DIGIT_BITS = 8, BUCKETS = 1 << DIGIT_BITS;
+	int n = static_cast<int>(keys.size());
+	std::vector<Key> keysOut(n);
+	std::vector<int> valuesOut(n);
+	std::vector<int> offsets;
+
+	for (int shift = 0; shift < keyBits; shift += DIGIT_BITS) {
+#pragma omp parallel
+		{
+#ifdef _OPENMP
+			int threads = omp_get_num_threads(), thread = omp_get_thread_num();
+#else
+			int threads = 1, thread = 0;
+#endif
+#pragma omp single
+			offsets.assign(static_cast<size_t>(threads) * BUCKETS, 0);
+
+			int begin = static_cast<int>(static_cast<int64_t>(n) * thread / threads);
+			int end = static_cast<int>(static_cast<int64_t>(n) * (thread + 1) / threads);
+			int* counts = &offsets[static_cast<size_t>(thread) * BUCKETS];
+			for (int i = begin; i < end; ++i)
+				counts[(keys[i] >> shift) & (BUCKETS - 1)]++;
+#pragma omp barrier
+
+			// Bucket-major prefix sum, so each thread writes after lower threads in the same bucket.
+#pragma omp single
+			{
+				int sum = 0;
+				for (int b = 0; b < BUCKETS; ++b) {
+					for (int t = 0; t < threads; ++t) {
+						int count = offsets[static_cast<size_t>(t) * BUCKETS + b];
+						offsets[static_cast<size_t>(t) * BUCKETS + b] = sum;
+						sum += count;
+					}
+				}
+			}
+
+			for (int i = begin; i < end; ++i) {
+				int out = counts[(keys[i] >> shift) & (BUCKETS - 1)]++;
+				keysOut[out] = keys[i];
+				valuesOut[out] = values[i];
+			}
+		}
+		keys.swap(keysOut);
+		values.swap(valuesOut);
+	}
+}
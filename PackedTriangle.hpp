@@ -0,0 +1,20 @@
+#pragma once
+#include <Eigen/Dense>
+
+/// <summary>
+/// A triangle stored in the form used by the ray/triangle test: one vertex and the
+/// two edges leaving it. Also records which Model face it came from, so the vertex
+/// attributes can be looked up once a hit has been found.
+/// </summary>
+struct PackedTriangle
+{
+	Eigen::Vector3f v0, e1, e2; // e1 = v1 - v0, e2 = v2 - v0.
+	int face;
+
+	PackedTriangle()
+	{}
+
+	PackedTriangle(const Eigen::Vector3f& v0, const Eigen::Vector3f& v1, const Eigen::Vector3f& v2, int face)
+		:v0(v0), e1(v1 - v0), e2(v2 - v0), face(face)
+	{}
+};
@@ -0,0 +1,95 @@
+#pragma once
+#include <cstdint>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+/// <summary>
+/// Hardware events a PerfCounter can count.
+/// </summary>
+enum class PerfEvent
+{
+	CacheMisses, // Misses in the last level cache.
+	L1DataReadMisses,
+};
+
+/// <summary>
+/// Counts a hardware event on the calling thread, using Linux perf events. On other systems,
+/// or where the kernel doesn't allow it (see /proc/sys/kernel/perf_event_paranoid),
+/// available() is false and the count is always zero.
+/// </summary>
+class PerfCounter
+{
+private:
+	int fd_;
+
+public:
+	PerfCounter(PerfEvent event = PerfEvent::CacheMisses)
+		:fd_(-1)
+	{
+#ifdef __linux__
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		if (event == PerfEvent::CacheMisses) {
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		}
+		else {
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		}
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+		(void)event;
+#endif
+	}
+
+	~PerfCounter()
+	{
+#ifdef __linux__
+		if (fd_ >= 0) close(fd_);
+#endif
+	}
+
+	PerfCounter(const PerfCounter&) = delete;
+	PerfCounter& operator =(const PerfCounter&) = delete;
+
+	bool available() const
+	{
+		return fd_ >= 0;
+	}
+
+	/// <summary>
+	/// Reset the count to zero and start counting.
+	/// </summary>
+	void start()
+	{
+#ifdef __linux__
+		if (fd_ < 0) return;
+		ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+	}
+
+	/// <summary>
+	/// Stop counting, and return the count since start.
+	/// </summary>
+	long long stop()
+	{
+		long long count = 0;
+#ifdef __linux__
+		if (fd_ < 0) return 0;
+		ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd_, &count, sizeof(count)) != sizeof(count)) count = 0;
+#endif
+		return count;
+	}
+};
@@ -15,31 +15,30 @@ public:
 		:albedo_(albedo), specular_(specular), shininess_(shininess), shadowTest_(shadowTest)
 	{}
 
-	virtual Eigen::Vector3f getColor(const HitInfo& hitInfo, 
-		const Renderable* scene, 
+	virtual void shade(const HitInfo& hitInfo,
 		const std::vector<std::unique_ptr<Light>>& lights,
 		const Eigen::Vector3f& ambientLight,
 		int currBounceCount,
-		const int maxBounces) const
+		const int maxBounces,
+		ShadingOutput& output) const override
 	{
-		Eigen::Vector3f color = coefftWiseMul(albedo_, ambientLight);
+		output.addColor(coefftWiseMul(albedo_, ambientLight));
 
 		for (auto& light : lights) {
-			if (shadowTest_) {
-				if (!light->visibilityCheck(hitInfo.location, scene))
-					continue;
-			}
 			Eigen::Vector3f lightVec = light->getVecToLight(hitInfo.location);
 			float dotProd = std::max(lightVec.dot(hitInfo.normal), 0.f);
-			color += dotProd * coefftWiseMul(light->getIntensity(hitInfo.location), albedo_);
+			Eigen::Vector3f color = dotProd * coefftWiseMul(light->getIntensity(hitInfo.location), albedo_);
 
 			Eigen::Vector3f reflectVec = reflect(hitInfo.inDirection, hitInfo.normal);
 			float dotSpec = std::max(lightVec.dot(reflectVec), 0.f); 
 			dotSpec = powf(dotSpec, shininess_);
 			color += dotSpec * coefftWiseMul(light->getIntensity(hitInfo.location), specular_);
-		}
 
-		return color;
+			if (shadowTest_)
+				output.addLitColor(*light, hitInfo.location, color);
+			else
+				output.addColor(color);
+		}
 	}
 };
 
@@ -10,6 +10,40 @@ class Plane : public Renderable
 {
 private:
 	Eigen::Vector3f normal_;
+
+	/// <summary>
+	/// Intersect PACKET_LANES rays at a time with the plane, as intersect does one. For each
+	/// group of rays in active starting at ray first, calls recordHits(first, lanes, t) with
+	/// lanes set for the rays hitting it with minT <= t <= maxT[i].
+	/// </summary>
+	template <typename RecordHits>
+	void packetHitDistances(const RayPacket& packet, uint64_t active, float minT, const float* maxTs, RecordHits recordHits) const
+	{
+		Eigen::Vector3f centreWorldSpace = transformPosition(modelToWorld(), Eigen::Vector3f::Zero());
+		Eigen::Vector3f normalWorldSpace = normalMatrix() * normal_;
+		PacketFloat normal[3];
+		for (int axis = 0; axis < 3; ++axis)
+			normal[axis] = PacketFloat::broadcast(normalWorldSpace[axis]);
+		PacketFloat centreDotNorm = PacketFloat::broadcast(centreWorldSpace.dot(normalWorldSpace));
+		PacketFloat minTs = PacketFloat::broadcast(minT), zero = PacketFloat::broadcast(0.f);
+		PacketFloat epsilon = PacketFloat::broadcast(1e-6f), minusEpsilon = PacketFloat::broadcast(-1e-6f);
+
+		for (int first = 0; first < packet.size; first += PACKET_LANES) {
+			int lanes = RayPacket::laneBits(active, first);
+			if (!lanes) continue;
+
+			PacketFloat rayDotNorm = zero, originDotNorm = zero;
+			for (int axis = 0; axis < 3; ++axis) {
+				rayDotNorm = rayDotNorm + PacketFloat::load(&packet.direction[axis][first]) * normal[axis];
+				originDotNorm = originDotNorm + PacketFloat::load(&packet.origin[axis][first]) * normal[axis];
+			}
+			PacketFloat t = (centreDotNorm - originDotNorm) / rayDotNorm;
+			PacketFloat maxT = PacketFloat::load(&maxTs[first]);
+			lanes &= ((rayDotNorm > epsilon) | (rayDotNorm < minusEpsilon)).bits() & ((t >= minTs) & (t <= maxT)).bits();
+			if (lanes) recordHits(first, lanes, t);
+		}
+	}
+
 public:
 	Plane(const Shader* shader, const Eigen::Vector3f& normal, IntersectMask mask=DEFAULT_BITMASK)
 		:Renderable(shader, mask), normal_(normal)
@@ -24,7 +58,7 @@ public:
 
 		// Work out plane position and normal in world space.
 		Eigen::Vector3f centreWorldSpace = transformPosition(modelToWorld(), Eigen::Vector3f::Zero());
-		Eigen::Vector3f normalWorldSpace = transformNormal(modelToWorld(), normal_);
+		Eigen::Vector3f normalWorldSpace = normalMatrix() * normal_;
 
 		float rayDotNorm = ray.direction.dot(normalWorldSpace);
 		if (abs(rayDotNorm) < 1e-6f) return false; // ray parallel to plane.
@@ -33,15 +67,59 @@ public:
 		if (t < minT || t > maxT) return false; // intersection not in range.
 
 		info.hitT = t;
+		info.object = this;
+		info.primitive = 0;
+		info.u = info.v = 0.f;
+		return true;
+	}
+
+	virtual void intersectPacket(const RayPacket& packet, uint64_t active, float minT, PacketHits& hits, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return;
+
+		packetHitDistances(packet, active, minT, hits.t, [&](int first, int lanes, const PacketFloat& t) {
+			float ts[PACKET_LANES];
+			t.store(ts);
+			for (int i = 0; i < PACKET_LANES; ++i) {
+				if (lanes >> i & 1)
+					hits.record(first + i, ts[i], this, 0, 0.f, 0.f);
+			}
+		});
+	}
+
+	virtual uint64_t occludedPacket(const RayPacket& packet, uint64_t active, float minT, const float* maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return 0;
+
+		uint64_t result = 0;
+		packetHitDistances(packet, active, minT, maxT, [&](int first, int lanes, const PacketFloat&) {
+			result |= static_cast<uint64_t>(lanes) << first;
+		});
+		return result;
+	}
+
+	virtual void computeSurface(const Ray& ray, HitInfo& info) const override
+	{
 		info.inDirection = ray.direction;
-		info.location = ray.origin + t * ray.direction;
-		info.normal = normalWorldSpace;
+		info.location = ray.origin + info.hitT * ray.direction;
+		info.normal = normalMatrix() * normal_;
 		info.shader = shader();
 		info.texCoords = Eigen::Vector2f(
 			fmodf(info.location.x(), 1.0f),
 			fmodf(info.location.y(), 1.0f));
-		
-		return true;
 	}
-};
 
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		Eigen::Vector3f centreWorldSpace = transformPosition(modelToWorld(), Eigen::Vector3f::Zero());
+		Eigen::Vector3f normalWorldSpace = normalMatrix() * normal_;
+
+		float rayDotNorm = ray.direction.dot(normalWorldSpace);
+		if (abs(rayDotNorm) < 1e-6f) return false; // ray parallel to plane.
+
+		float t = (centreWorldSpace - ray.origin).dot(normalWorldSpace) / rayDotNorm;
+		return t >= minT && t <= maxT;
+	}
+};
@@ -11,14 +11,14 @@ public:
 	{}
 
 
-	virtual bool visibilityCheck(const Eigen::Vector3f& location, const Renderable* renderable) const override
+	virtual Ray shadowRay(const Eigen::Vector3f& location, float& minT, float& maxT) const override
 	{
 		Ray shadowRay;
 		shadowRay.origin = location;
 		shadowRay.direction = (location_ - location).normalized();
-		float maxT = (location_ - location).norm();
-		HitInfo info;
-		return !renderable->intersect(shadowRay, 1e-4f, maxT, info, SHADOW_BITMASK);
+		minT = 1e-4f;
+		maxT = (location_ - location).norm();
+		return shadowRay;
 	}
 
 	virtual Eigen::Vector3f getIntensity(const Eigen::Vector3f& location) const override
@@ -0,0 +1,100 @@
+#pragma once
+#include "Ray.hpp"
+#include "HitInfo.hpp"
+#include "AffineTransform.hpp"
+#include "Simd.hpp"
+#include <cstdint>
+
+// Rays of a packet are tested PACKET_LANES at a time: 8 with AVX, otherwise 4.
+#ifdef RAYTRACER_AVX
+constexpr int PACKET_LANES = 8;
+#else
+constexpr int PACKET_LANES = 4;
+#endif
+typedef SimdFloat<PACKET_LANES> PacketFloat;
+
+/// <summary>
+/// A bundle of up to MAX_SIZE rays, such as the primary rays through a 4x4 or 8x8 block of
+/// pixels, stored as a structure of arrays so PACKET_LANES of them can be tested at once.
+/// size is a multiple of PACKET_LANES. Which rays to trace is given separately, as a mask with
+/// bit i set for ray i, so containers can narrow it without copying the packet.
+/// </summary>
+struct RayPacket
+{
+	static constexpr int MAX_SIZE = 64;
+
+	int size;
+	alignas(32) float origin[3][MAX_SIZE];
+	alignas(32) float direction[3][MAX_SIZE];
+
+	Ray ray(int i) const
+	{
+		Ray r;
+		r.origin = Eigen::Vector3f(origin[0][i], origin[1][i], origin[2][i]);
+		r.direction = Eigen::Vector3f(direction[0][i], direction[1][i], direction[2][i]);
+		return r;
+	}
+
+	void setRay(int i, const Ray& r)
+	{
+		for (int axis = 0; axis < 3; ++axis) {
+			origin[axis][i] = r.origin[axis];
+			direction[axis][i] = r.direction[axis];
+		}
+	}
+
+	/// <summary>
+	/// The bits of a ray mask for the PACKET_LANES rays starting at ray first.
+	/// </summary>
+	static int laneBits(uint64_t rays, int first)
+	{
+		return static_cast<int>((rays >> first) & ((1ull << PACKET_LANES) - 1));
+	}
+
+	/// <summary>
+	/// The same rays with a transform applied, such as into a Scene's space.
+	/// Directions aren't normalised, so distances along the rays are unchanged.
+	/// </summary>
+	RayPacket transformed(const AffineTransform& transform) const
+	{
+		RayPacket result;
+		result.size = size;
+		for (int i = 0; i < size; ++i) {
+			Ray r = ray(i);
+			r.origin = transform.position(r.origin);
+			r.direction = transform.direction(r.direction);
+			result.setRay(i, r);
+		}
+		return result;
+	}
+};
+
+/// <summary>
+/// The closest hits found so far for the rays of a RayPacket. t[i] is the far limit for
+/// ray i, reduced with each hit, and bit i of hit is set once the ray has hit something,
+/// when info[i] holds the hit as Renderable::intersect fills it in.
+/// </summary>
+struct PacketHits
+{
+	uint64_t hit;
+	alignas(32) float t[RayPacket::MAX_SIZE];
+	HitInfo info[RayPacket::MAX_SIZE];
+
+	PacketHits(int size, float maxT)
+		:hit(0)
+	{
+		for (int i = 0; i < size; ++i)
+			t[i] = maxT;
+	}
+
+	void record(int i, float hitT, const Renderable* object, int primitive, float u, float v)
+	{
+		t[i] = hitT;
+		info[i].hitT = hitT;
+		info[i].object = object;
+		info[i].primitive = primitive;
+		info[i].u = u;
+		info[i].v = v;
+		hit |= 1ull << i;
+	}
+};
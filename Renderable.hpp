@@ -2,8 +2,9 @@
 #include "Entity.hpp"
 #include "Ray.hpp"
 #include "HitInfo.hpp"
-#include "Shader.hpp"
+#include "RayPacket.hpp"
 #include "BitMasks.hpp"
+#include "AABB.hpp"
 
 class Shader;
 
@@ -16,6 +17,8 @@ class Shader;
 /// Renderable is an Abstract Data Type (ADT) as it has a pure virtual function.
 /// To make a Renderable subclass you can instantiate, you must implement
 /// the intersect function.
+/// Renderables of finite size should also implement bounds, so that containers
+/// like Scene can put them in an acceleration structure.
 /// </summary>
 class Renderable : public Entity
 {
@@ -26,8 +29,87 @@ public:
 		:shader_(shader), mask_(mask)
 	{}
 
+	/// <summary>
+	/// Find the closest hit with minT <= t <= maxT. Only hitT, object, primitive, u and v
+	/// need be filled in: call computeSurface for the rest.
+	/// </summary>
 	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const = 0;
 
+	/// <summary>
+	/// Fill in the surface fields of a hit found by intersect with the same ray: location,
+	/// normal, texture coordinates, shader and incoming direction. Containers such as Scene
+	/// finish the surface of their closest hit in intersect, so for them this does nothing.
+	/// </summary>
+	virtual void computeSurface(const Ray& /*ray*/, HitInfo& /*info*/) const
+	{}
+
+	/// <summary>
+	/// Find the closest hits for the rays of a packet with bits set in active, as intersect
+	/// does for one ray, with minT <= t <= hits.t[i]. Rays hitting closer than hits.t[i] are
+	/// recorded in hits. The default tests each ray in turn; overrides test several at once.
+	/// </summary>
+	virtual void intersectPacket(const RayPacket& packet, uint64_t active, float minT, PacketHits& hits, IntersectMask mask) const
+	{
+		if (!checkMask(mask)) return;
+
+		HitInfo info;
+		for (int i = 0; i < packet.size; ++i) {
+			if (!(active >> i & 1)) continue;
+			if (intersect(packet.ray(i), minT, hits.t[i], info, mask) && info.hitT < hits.t[i]) {
+				hits.t[i] = info.hitT;
+				hits.info[i] = info;
+				hits.hit |= 1ull << i;
+			}
+		}
+	}
+
+	/// <summary>
+	/// Does the ray hit anything with minT <= t <= maxT? Used for shadow rays, where any hit
+	/// will do, so overrides should return at the first hit found and skip working out the
+	/// hit's attributes. The default falls back on intersect.
+	/// </summary>
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const
+	{
+		HitInfo info;
+		return intersect(ray, minT, maxT, info, mask);
+	}
+
+	/// <summary>
+	/// Which rays of a packet with bits set in active hit anything with minT <= t <= maxT[i],
+	/// as occluded finds for one ray. Returns a mask of the rays that do. The default tests
+	/// each ray in turn; overrides test several at once.
+	/// </summary>
+	virtual uint64_t occludedPacket(const RayPacket& packet, uint64_t active, float minT, const float* maxT, IntersectMask mask) const
+	{
+		if (!checkMask(mask)) return 0;
+
+		uint64_t result = 0;
+		for (int i = 0; i < packet.size; ++i) {
+			if ((active >> i & 1) && occluded(packet.ray(i), minT, maxT[i], mask))
+				result |= 1ull << i;
+		}
+		return result;
+	}
+
+	/// <summary>
+	/// Get the bounding box of this Renderable in its parent's space (i.e. with modelToWorld applied).
+	/// Returns false if the Renderable is unbounded (e.g. an infinite Plane), which is the default.
+	/// </summary>
+	virtual bool bounds(AABB& /*box*/) const
+	{
+		return false;
+	}
+
+	/// <summary>
+	/// Bring any acceleration structures up to date after objects have been moved.
+	/// Returns true if the bounds of this Renderable's contents may have changed.
+	/// This must not be called while rays are being traced.
+	/// </summary>
+	virtual bool update()
+	{
+		return false;
+	}
+
 	bool checkMask(IntersectMask mask) const
 	{
 		return mask_ & mask;
@@ -1,25 +1,141 @@
 #pragma once
 #include "Renderable.hpp"
 #include "GeomUtil.hpp"
+#include "BVH.hpp"
 #include <vector>
 #include <limits>
+#include <algorithm>
 
 /// <summary>
 /// A Scene is a container for other Renderable objects.
 /// Scenes can be nested if desired, and changing the ModelToWorld will
 /// transform the sub-scenes.
 /// Add objects to the scene by pushing them into the renderables vector.
+/// For scenes with many objects, call buildBVH once they have all been added to
+/// test rays against a BVH over the bounded objects, rather than every object in turn.
+/// Unbounded objects (e.g. Planes) are kept in a separate list and always tested.
+/// After moving objects or adding new ones, call update to refit or rebuild the BVH.
 /// </summary>
 class Scene : public Renderable
 {
+private:
+	bool useBVH_;
+	BVHBuildOptions bvhOptions_;
+	BVH bvh_;
+	std::vector<int> boundedChildren_, unboundedChildren_; // Indices into renderables.
+	std::vector<unsigned int> childVersions_; // transformVersion of each child at the last build/refit.
+
+	/// <summary>
+	/// Is the BVH in sync with the renderables vector?
+	/// If not, intersect falls back to testing every child.
+	/// </summary>
+	bool bvhValid() const
+	{
+		return useBVH_ && childVersions_.size() == renderables.size();
+	}
+
+	/// <summary>
+	/// Get the current bounds of the children in the BVH. Returns false if any
+	/// of them has become unbounded, in which case the BVH must be rebuilt.
+	/// </summary>
+	bool childBounds(std::vector<AABB>& bounds) const
+	{
+		bounds.resize(boundedChildren_.size());
+		for (size_t i = 0; i < boundedChildren_.size(); ++i) {
+			if (!renderables[boundedChildren_[i]]->bounds(bounds[i])) return false;
+		}
+		return true;
+	}
+
 public:
 	Scene(IntersectMask mask=DEFAULT_BITMASK)
-		:Renderable(nullptr, mask)
+		:Renderable(nullptr, mask), useBVH_(false)
 	{}
 
 
 	std::vector<std::unique_ptr<Renderable>> renderables;
 
+	/// <summary>
+	/// Build a BVH over the bounds of the objects currently in the scene.
+	/// Child scenes are brought up to date first.
+	/// </summary>
+	void buildBVH(const BVHBuildOptions& options=BVHBuildOptions())
+	{
+		useBVH_ = true;
+		bvhOptions_ = options;
+
+		boundedChildren_.clear();
+		unboundedChildren_.clear();
+		childVersions_.resize(renderables.size());
+		for (size_t i = 0; i < renderables.size(); ++i) {
+			renderables[i]->update();
+			AABB box;
+			if (renderables[i]->bounds(box))
+				boundedChildren_.push_back(static_cast<int>(i));
+			else
+				unboundedChildren_.push_back(static_cast<int>(i));
+			childVersions_[i] = renderables[i]->transformVersion();
+		}
+
+		std::vector<AABB> bounds;
+		childBounds(bounds);
+		bvh_.build(bounds, bvhOptions_);
+	}
+
+	/// <summary>
+	/// Bring the BVH up to date with the renderables vector. If objects were added or
+	/// removed it is rebuilt, otherwise if any object moved it is refitted, unless that
+	/// degrades it past the build options' rebuildCostRatio.
+	/// </summary>
+	virtual bool update() override
+	{
+		bool moved = false;
+		for (const auto& object : renderables) {
+			if (object->update()) moved = true;
+		}
+
+		if (!useBVH_) return moved;
+
+		if (childVersions_.size() != renderables.size()) {
+			buildBVH(bvhOptions_);
+			return true;
+		}
+
+		for (size_t i = 0; i < renderables.size(); ++i) {
+			if (childVersions_[i] != renderables[i]->transformVersion()) {
+				childVersions_[i] = renderables[i]->transformVersion();
+				moved = true;
+			}
+		}
+		if (moved) {
+			std::vector<AABB> bounds;
+			bool bounded = childBounds(bounds);
+			if (bounded)
+				bvh_.refit(bounds);
+			if (!bounded || bvh_.needsRebuild())
+				buildBVH(bvhOptions_);
+		}
+
+		return moved;
+	}
+
+	const BVH& bvh() const
+	{
+		return bvh_;
+	}
+
+	virtual bool bounds(AABB& box) const override
+	{
+		AABB sceneBox;
+		for (const auto& object : renderables) {
+			AABB childBox;
+			if (!object->bounds(childBox)) return false;
+			sceneBox.expand(childBox);
+		}
+		box = sceneBox.transformed(modelToWorld());
+		return true;
+	}
+
 	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const
 	{
 		if (!checkMask(mask)) return false;
@@ -29,24 +145,143 @@ public:
 		tRay.origin = transformPosition(worldToModel(), ray.origin);
 		tRay.direction = transformDirection(worldToModel(), ray.direction);
 
-		// Identify closest valid hit.
-		float t = std::numeric_limits<float>::max();
-		for (const auto& object : renderables) {
-			HitInfo currInfo;
-			if (object->intersect(tRay, minT, maxT, currInfo, mask)) {
-				if (currInfo.hitT < t) {
-					info = currInfo;
-					t = currInfo.hitT;
-				}
+		// Identify closest valid hit. Each hit narrows the range for the following tests.
+		float t = maxT;
+		const Renderable* closestChild = nullptr;
+		HitInfo currInfo;
+		auto testChild = [&](const Renderable* object, float& closestT) {
+			if (object->intersect(tRay, minT, closestT, currInfo, mask) && currInfo.hitT <= closestT) {
+				info = currInfo;
+				closestT = currInfo.hitT;
+				closestChild = object;
+				return true;
 			}
+			return false;
+		};
+
+		if (bvhValid()) {
+			bvh_.traverse(tRay.origin, tRay.direction, minT, t, [&](int ref, float& closestT) {
+				return testChild(renderables[boundedChildren_[bvh_.primIndices()[ref]]].get(), closestT);
+			});
+			for (int i : unboundedChildren_)
+				testChild(renderables[i].get(), t);
 		}
+		else {
+			for (const auto& object : renderables)
+				testChild(object.get(), t);
+		}
+
+		if (!closestChild) return false;
 
-		// Transform hit location and normal back into world space.
+		// Only the closest hit needs its surface worked out. Transform it back into world space.
+		closestChild->computeSurface(tRay, info);
 		info.location = transformPosition(modelToWorld(), info.location);
-		info.normal = transformDirection(modelToWorld(), info.normal);
+		info.normal = (normalMatrix() * info.normal).normalized();
 
-		return t < std::numeric_limits<float>::max();
+		return true;
 	}
 
-};
+	/// <summary>
+	/// Find the closest hits for a packet of rays, walking the BVH with the whole packet.
+	/// </summary>
+	virtual void intersectPacket(const RayPacket& packet, uint64_t active, float minT, PacketHits& hits, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return;
+
+		RayPacket tPacket = packet.transformed(worldToModel());
+
+		// Children record hits straight into hits. Note which child each ray hit last, by
+		// seeing whose test brought its distance down, to finish the surfaces at the end.
+		const Renderable* closestChild[RayPacket::MAX_SIZE] = {};
+		auto testChild = [&](const Renderable* object, uint64_t rays) {
+			float before[RayPacket::MAX_SIZE];
+			std::copy(hits.t, hits.t + tPacket.size, before);
+			object->intersectPacket(tPacket, rays, minT, hits, mask);
+			for (int i = 0; i < tPacket.size; ++i) {
+				if (hits.t[i] < before[i]) closestChild[i] = object;
+			}
+		};
+
+		if (bvhValid()) {
+			bvh_.traversePacket(tPacket, active, minT, hits.t, [&](int ref, uint64_t rays) {
+				testChild(renderables[boundedChildren_[bvh_.primIndices()[ref]]].get(), rays);
+			});
+			for (int i : unboundedChildren_)
+				testChild(renderables[i].get(), active);
+		}
+		else {
+			for (const auto& object : renderables)
+				testChild(object.get(), active);
+		}
+
+		for (int i = 0; i < tPacket.size; ++i) {
+			if (!closestChild[i]) continue;
+			closestChild[i]->computeSurface(tPacket.ray(i), hits.info[i]);
+			hits.info[i].location = transformPosition(modelToWorld(), hits.info[i].location);
+			hits.info[i].normal = (normalMatrix() * hits.info[i].normal).normalized();
+		}
+	}
+
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		Ray tRay;
+		tRay.origin = transformPosition(worldToModel(), ray.origin);
+		tRay.direction = transformDirection(worldToModel(), ray.direction);
+
+		if (bvhValid()) {
+			for (int i : unboundedChildren_) {
+				if (renderables[i]->occluded(tRay, minT, maxT, mask)) return true;
+			}
+			return bvh_.traverseAny(tRay.origin, tRay.direction, minT, maxT, [&](int ref) {
+				return renderables[boundedChildren_[bvh_.primIndices()[ref]]]->occluded(tRay, minT, maxT, mask);
+			});
+		}
+
+		for (const auto& object : renderables) {
+			if (object->occluded(tRay, minT, maxT, mask)) return true;
+		}
+		return false;
+	}
 
+	/// <summary>
+	/// Find which rays of a packet are occluded, walking the BVH with the whole packet. Rays
+	/// are dropped from the walk once something is found to block them.
+	/// </summary>
+	virtual uint64_t occludedPacket(const RayPacket& packet, uint64_t active, float minT, const float* maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return 0;
+
+		RayPacket tPacket = packet.transformed(worldToModel());
+		uint64_t result = 0;
+		auto testChild = [&](const Renderable* object, uint64_t rays) {
+			rays &= ~result;
+			if (rays) result |= object->occludedPacket(tPacket, rays, minT, maxT, mask);
+		};
+
+		if (!bvhValid()) {
+			for (const auto& object : renderables)
+				testChild(object.get(), active);
+			return result;
+		}
+
+		for (int i : unboundedChildren_)
+			testChild(renderables[i].get(), active);
+
+		// The walk skips boxes beyond each ray's far limit, so an empty range takes a ray out of it.
+		alignas(32) float walkMaxT[RayPacket::MAX_SIZE];
+		auto updateWalkMaxT = [&]() {
+			for (int i = 0; i < tPacket.size; ++i)
+				walkMaxT[i] = (result >> i & 1) ? -std::numeric_limits<float>::max() : maxT[i];
+		};
+		updateWalkMaxT();
+		bvh_.traversePacket(tPacket, active & ~result, minT, walkMaxT, [&](int ref, uint64_t rays) {
+			uint64_t before = result;
+			testChild(renderables[boundedChildren_[bvh_.primIndices()[ref]]].get(), rays);
+			if (result != before) updateWalkMaxT();
+		});
+		return result;
+	}
+
+};
@@ -1,23 +1,118 @@
 #pragma once
 #include "Renderable.hpp"
 #include "Light.hpp"
+#include "GeomUtil.hpp"
 #include <vector>
 
+/// <summary>
+/// Receives what a Shader works out for a hit: colour to add straight away, colour to add only
+/// if a light turns out to be visible, and rays whose colour should be added once traced.
+/// Shader::getColor traces these at once, recursively; a wavefront renderer queues them up
+/// and traces each kind in a batch with the others.
+/// </summary>
+class ShadingOutput
+{
+public:
+	virtual ~ShadingOutput() throw()
+	{}
+
+	/// <summary>
+	/// Add color to the pixel.
+	/// </summary>
+	virtual void addColor(const Eigen::Vector3f& color) = 0;
+
+	/// <summary>
+	/// Add color to the pixel if location can see light.
+	/// </summary>
+	virtual void addLitColor(const Light& light, const Eigen::Vector3f& location, const Eigen::Vector3f& color) = 0;
+
+	/// <summary>
+	/// Trace ray, like a camera ray from minT = 1e-6 up to maxT, and add the colour of what it
+	/// hits to the pixel, scaled coefficient-wise by weight.
+	/// </summary>
+	virtual void addRay(const Ray& ray, float maxT, const Eigen::Vector3f& weight) = 0;
+};
+
 /// <summary>
 /// ADT for a Shader class that can be run on intersection with an associated
 /// Renderable instance.
+/// Shaders implement shade, which doesn't trace any rays itself but says which it needs to
+/// through a ShadingOutput, so the rays can be traced either straight away or in batches.
 /// </summary>
 class Shader
 {
+private:
+	/// <summary>
+	/// Output which traces rays as soon as a shader asks for them, summing up the colour.
+	/// </summary>
+	class RecursiveOutput : public ShadingOutput
+	{
+	private:
+		const Renderable* scene_;
+		const std::vector<std::unique_ptr<Light>>& lights_;
+		const Eigen::Vector3f& ambientLight_;
+		int currBounceCount_, maxBounces_;
+
+	public:
+		Eigen::Vector3f color;
+
+		RecursiveOutput(const Renderable* scene, const std::vector<std::unique_ptr<Light>>& lights,
+			const Eigen::Vector3f& ambientLight, int currBounceCount, int maxBounces)
+			:scene_(scene), lights_(lights), ambientLight_(ambientLight),
+			currBounceCount_(currBounceCount), maxBounces_(maxBounces), color(Eigen::Vector3f::Zero())
+		{}
+
+		virtual void addColor(const Eigen::Vector3f& c) override
+		{
+			color += c;
+		}
+
+		virtual void addLitColor(const Light& light, const Eigen::Vector3f& location, const Eigen::Vector3f& c) override
+		{
+			if (light.visibilityCheck(location, scene_))
+				color += c;
+		}
+
+		virtual void addRay(const Ray& ray, float maxT, const Eigen::Vector3f& weight) override
+		{
+			HitInfo hit;
+			if (scene_->intersect(ray, 1e-6f, maxT, hit, VISIBLE_BITMASK)) {
+				color += coefftWiseMul(weight, hit.shader->getColor(
+					hit, scene_,
+					lights_, ambientLight_,
+					currBounceCount_ + 1, maxBounces_));
+			}
+		}
+	};
+
 public:
 	virtual ~Shader() throw()
 	{}
 
-	virtual Eigen::Vector3f getColor(const HitInfo& hitInfo, 
-		const Renderable* scene, 
+	/// <summary>
+	/// Shade a hit, passing the colour and any rays needed to output. Rays added with addRay
+	/// are one bounce further on than currBounceCount; none should be added once it reaches
+	/// maxBounces.
+	/// </summary>
+	virtual void shade(const HitInfo& hitInfo,
 		const std::vector<std::unique_ptr<Light>>& lights,
 		const Eigen::Vector3f& ambientLight,
 		int currBounceCount,
-		const int maxBounces) const = 0;
-};
+		const int maxBounces,
+		ShadingOutput& output) const = 0;
 
+	/// <summary>
+	/// The colour of a hit, tracing the rays shade asks for straight away.
+	/// </summary>
+	virtual Eigen::Vector3f getColor(const HitInfo& hitInfo,
+		const Renderable* scene,
+		const std::vector<std::unique_ptr<Light>>& lights,
+		const Eigen::Vector3f& ambientLight,
+		int currBounceCount,
+		const int maxBounces) const
+	{
+		RecursiveOutput output(scene, lights, ambientLight, currBounceCount, maxBounces);
+		shade(hitInfo, lights, ambientLight, currBounceCount, maxBounces, output);
+		return output.color;
+	}
+};
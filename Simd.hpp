@@ -0,0 +1,145 @@
+#pragma once
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define RAYTRACER_SSE
+#endif
+#if defined(__AVX__)
+#define RAYTRACER_AVX
+#endif
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// Minimal wrappers around SIMD registers, used to test a ray against several boxes or
+// triangles at once, or several rays of a RayPacket against one. SimdFloat<4> maps to SSE and SimdFloat<8> to AVX where the compiler
+// supports them, and otherwise to plain arrays that the compiler may still vectorize.
+// Comparisons give a SimdMask, whose bits() has bit i set if lane i compared true.
+// loadBytes converts N unsigned bytes to floats, for decoding quantized bounds.
+// select(mask, a, b) takes lane i from a if bit i of mask is set, and from b otherwise.
+
+/// <summary>
+/// Portable fallback: N floats and an N-bit mask.
+/// </summary>
+template <int N>
+struct SimdMask
+{
+	int m;
+	SimdMask operator &(const SimdMask& o) const { return { m & o.m }; }
+	SimdMask operator |(const SimdMask& o) const { return { m | o.m }; }
+	int bits() const { return m; }
+};
+
+template <int N>
+struct SimdFloat
+{
+	float v[N];
+
+	static SimdFloat load(const float* p) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = p[i]; return r; }
+	static SimdFloat broadcast(float f) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = f; return r; }
+	static SimdFloat loadBytes(const uint8_t* p) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = p[i]; return r; }
+	void store(float* p) const { for (int i = 0; i < N; ++i) p[i] = v[i]; }
+
+	SimdFloat operator +(const SimdFloat& o) const { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = v[i] + o.v[i]; return r; }
+	SimdFloat operator -(const SimdFloat& o) const { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = v[i] - o.v[i]; return r; }
+	SimdFloat operator *(const SimdFloat& o) const { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = v[i] * o.v[i]; return r; }
+	SimdFloat operator /(const SimdFloat& o) const { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = v[i] / o.v[i]; return r; }
+
+	SimdMask<N> operator <(const SimdFloat& o) const { int m = 0; for (int i = 0; i < N; ++i) m |= (v[i] < o.v[i]) << i; return { m }; }
+	SimdMask<N> operator <=(const SimdFloat& o) const { int m = 0; for (int i = 0; i < N; ++i) m |= (v[i] <= o.v[i]) << i; return { m }; }
+	SimdMask<N> operator >(const SimdFloat& o) const { return o < *this; }
+	SimdMask<N> operator >=(const SimdFloat& o) const { return o <= *this; }
+
+	friend SimdFloat min(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = std::min(a.v[i], b.v[i]); return r; }
+	friend SimdFloat max(const SimdFloat& a, const SimdFloat& b) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = std::max(a.v[i], b.v[i]); return r; }
+	friend SimdFloat sqrt(const SimdFloat& a) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = std::sqrt(a.v[i]); return r; }
+	friend SimdFloat select(const SimdMask<N>& mask, const SimdFloat& a, const SimdFloat& b) { SimdFloat r; for (int i = 0; i < N; ++i) r.v[i] = (mask.m >> i & 1) ? a.v[i] : b.v[i]; return r; }
+};
+
+#ifdef RAYTRACER_SSE
+template <>
+struct SimdMask<4>
+{
+	__m128 m;
+	SimdMask operator &(const SimdMask& o) const { return { _mm_and_ps(m, o.m) }; }
+	SimdMask operator |(const SimdMask& o) const { return { _mm_or_ps(m, o.m) }; }
+	int bits() const { return _mm_movemask_ps(m); }
+};
+
+template <>
+struct SimdFloat<4>
+{
+	__m128 v;
+
+	static SimdFloat load(const float* p) { return { _mm_loadu_ps(p) }; }
+	static SimdFloat broadcast(float f) { return { _mm_set1_ps(f) }; }
+	static SimdFloat loadBytes(const uint8_t* p)
+	{
+		int bytes;
+		std::memcpy(&bytes, p, 4);
+		__m128i zero = _mm_setzero_si128();
+		__m128i ints = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+		return { _mm_cvtepi32_ps(ints) };
+	}
+	void store(float* p) const { _mm_storeu_ps(p, v); }
+
+	SimdFloat operator +(const SimdFloat& o) const { return { _mm_add_ps(v, o.v) }; }
+	SimdFloat operator -(const SimdFloat& o) const { return { _mm_sub_ps(v, o.v) }; }
+	SimdFloat operator *(const SimdFloat& o) const { return { _mm_mul_ps(v, o.v) }; }
+	SimdFloat operator /(const SimdFloat& o) const { return { _mm_div_ps(v, o.v) }; }
+
+	SimdMask<4> operator <(const SimdFloat& o) const { return { _mm_cmplt_ps(v, o.v) }; }
+	SimdMask<4> operator <=(const SimdFloat& o) const { return { _mm_cmple_ps(v, o.v) }; }
+	SimdMask<4> operator >(const SimdFloat& o) const { return { _mm_cmpgt_ps(v, o.v) }; }
+	SimdMask<4> operator >=(const SimdFloat& o) const { return { _mm_cmpge_ps(v, o.v) }; }
+
+	friend SimdFloat min(const SimdFloat& a, const SimdFloat& b) { return { _mm_min_ps(a.v, b.v) }; }
+	friend SimdFloat max(const SimdFloat& a, const SimdFloat& b) { return { _mm_max_ps(a.v, b.v) }; }
+	friend SimdFloat sqrt(const SimdFloat& a) { return { _mm_sqrt_ps(a.v) }; }
+	friend SimdFloat select(const SimdMask<4>& mask, const SimdFloat& a, const SimdFloat& b) { return { _mm_or_ps(_mm_and_ps(mask.m, a.v), _mm_andnot_ps(mask.m, b.v)) }; }
+};
+#endif
+
+#ifdef RAYTRACER_AVX
+template <>
+struct SimdMask<8>
+{
+	__m256 m;
+	SimdMask operator &(const SimdMask& o) const { return { _mm256_and_ps(m, o.m) }; }
+	SimdMask operator |(const SimdMask& o) const { return { _mm256_or_ps(m, o.m) }; }
+	int bits() const { return _mm256_movemask_ps(m); }
+};
+
+template <>
+struct SimdFloat<8>
+{
+	__m256 v;
+
+	static SimdFloat load(const float* p) { return { _mm256_loadu_ps(p) }; }
+	static SimdFloat broadcast(float f) { return { _mm256_set1_ps(f) }; }
+	static SimdFloat loadBytes(const uint8_t* p)
+	{
+#ifdef __AVX2__
+		return { _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)))) };
+#else
+		return { _mm256_set_m128(SimdFloat<4>::loadBytes(p + 4).v, SimdFloat<4>::loadBytes(p).v) };
+#endif
+	}
+	void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+	SimdFloat operator +(const SimdFloat& o) const { return { _mm256_add_ps(v, o.v) }; }
+	SimdFloat operator -(const SimdFloat& o) const { return { _mm256_sub_ps(v, o.v) }; }
+	SimdFloat operator *(const SimdFloat& o) const { return { _mm256_mul_ps(v, o.v) }; }
+	SimdFloat operator /(const SimdFloat& o) const { return { _mm256_div_ps(v, o.v) }; }
+
+	SimdMask<8> operator <(const SimdFloat& o) const { return { _mm256_cmp_ps(v, o.v, _CMP_LT_OQ) }; }
+	SimdMask<8> operator <=(const SimdFloat& o) const { return { _mm256_cmp_ps(v, o.v, _CMP_LE_OQ) }; }
+	SimdMask<8> operator >(const SimdFloat& o) const { return { _mm256_cmp_ps(v, o.v, _CMP_GT_OQ) }; }
+	SimdMask<8> operator >=(const SimdFloat& o) const { return { _mm256_cmp_ps(v, o.v, _CMP_GE_OQ) }; }
+
+	friend SimdFloat min(const SimdFloat& a, const SimdFloat& b) { return { _mm256_min_ps(a.v, b.v) }; }
+	friend SimdFloat max(const SimdFloat& a, const SimdFloat& b) { return { _mm256_max_ps(a.v, b.v) }; }
+	friend SimdFloat sqrt(const SimdFloat& a) { return { _mm256_sqrt_ps(a.v) }; }
+	friend SimdFloat select(const SimdMask<8>& mask, const SimdFloat& a, const SimdFloat& b) { return { _mm256_blendv_ps(b.v, a.v, mask.m) }; }
+};
+#endif
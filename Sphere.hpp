@@ -12,6 +12,57 @@ class Sphere : public Renderable
 {
 private:
 	float radius_;
+
+	/// <summary>
+	/// Solve the same quadratic as hitDistance for PACKET_LANES rays at a time. For each group
+	/// of rays in active starting at ray first, calls recordHits(first, lanes, t) with lanes set
+	/// for the rays hitting the sphere with minT <= t <= maxT[i], and t as hitDistance picks it.
+	/// </summary>
+	template <typename RecordHits>
+	void packetHitDistances(const RayPacket& packet, uint64_t active, float minT, const float* maxTs, RecordHits recordHits) const
+	{
+		Eigen::Vector3f centreWorldSpace = transformPosition(modelToWorld(), Eigen::Vector3f::Zero());
+		PacketFloat centre[3];
+		for (int axis = 0; axis < 3; ++axis)
+			centre[axis] = PacketFloat::broadcast(centreWorldSpace[axis]);
+		PacketFloat radiusSquared = PacketFloat::broadcast(radius_ * radius_);
+		PacketFloat minTs = PacketFloat::broadcast(minT), zero = PacketFloat::broadcast(0.f);
+		PacketFloat two = PacketFloat::broadcast(2.f), four = PacketFloat::broadcast(4.f), half = PacketFloat::broadcast(.5f);
+
+		for (int first = 0; first < packet.size; first += PACKET_LANES) {
+			int lanes = RayPacket::laneBits(active, first);
+			if (!lanes) continue;
+
+			// As in hitDistance.
+			PacketFloat centreToOrigin[3], direction[3];
+			PacketFloat b = zero, c = zero - radiusSquared;
+			for (int axis = 0; axis < 3; ++axis) {
+				centreToOrigin[axis] = PacketFloat::load(&packet.origin[axis][first]) - centre[axis];
+				direction[axis] = PacketFloat::load(&packet.direction[axis][first]);
+				b = b + centreToOrigin[axis] * direction[axis];
+				c = c + centreToOrigin[axis] * centreToOrigin[axis];
+			}
+			PacketFloat distanceSquared = zero;
+			for (int axis = 0; axis < 3; ++axis) {
+				PacketFloat perpendicular = centreToOrigin[axis] - b * direction[axis];
+				distanceSquared = distanceSquared + perpendicular * perpendicular;
+			}
+			b = b * two;
+			PacketFloat discriminant = four * (radiusSquared - distanceSquared);
+			PacketFloat root = sqrt(max(discriminant, zero));
+			PacketFloat q = half * select(b < zero, root - b, zero - b - root);
+			// q is only zero on lanes that miss, which are masked out below.
+			PacketFloat t0 = min(q, c / q), t1 = max(q, c / q);
+
+			// Take t0 if it is in range, otherwise t1.
+			PacketFloat maxT = PacketFloat::load(&maxTs[first]);
+			SimdMask<PACKET_LANES> nearHits = (t0 >= minTs) & (t0 <= maxT);
+			int farHits = ((t1 >= minTs) & (t1 < maxT)).bits();
+			lanes &= (discriminant >= PacketFloat::broadcast(1e-6f)).bits() & (nearHits.bits() | farHits);
+			if (lanes) recordHits(first, lanes, select(nearHits, t0, t1));
+		}
+	}
+
 public:
 	Sphere(const Shader* shader, float radius, IntersectMask mask=DEFAULT_BITMASK)
 		:Renderable(shader, mask), radius_(radius)
@@ -20,49 +71,107 @@ public:
 	virtual ~Sphere()
 	{}
 
-	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
+	virtual bool bounds(AABB& box) const override
 	{
-		if (!checkMask(mask)) return false;
-
 		Eigen::Vector3f centreWorldSpace = transformPosition(modelToWorld(), Eigen::Vector3f::Zero());
+		box = AABB(
+			centreWorldSpace - Eigen::Vector3f::Constant(radius_),
+			centreWorldSpace + Eigen::Vector3f::Constant(radius_));
+		return true;
+	}
 
+	/// <summary>
+	/// Find the nearest hit with minT <= t <= maxT against the sphere centred at centreWorldSpace.
+	/// The discriminant is found from how far the ray passes from the centre, and the roots as
+	/// q and c / q, which avoids the cancellation in b * b - 4 * c and in -b + sqrt(discriminant)
+	/// when the ray starts far from the sphere or on it.
+	/// </summary>
+	bool hitDistance(const Ray& ray, const Eigen::Vector3f& centreWorldSpace, float minT, float maxT, float& t) const
+	{
 		Eigen::Vector3f centreToOrigin = ray.origin - centreWorldSpace;
 
-		// Quadratic equation coefficients
-		float a = 1.0f;
+		// Quadratic equation coefficients, for a unit length direction.
 		float b = 2 * centreToOrigin.dot(ray.direction);
 		float c = centreToOrigin.dot(centreToOrigin) - radius_ * radius_;
-
-		double discriminant = b * b - 4 * a * c;
+		Eigen::Vector3f perpendicular = centreToOrigin - .5f * b * ray.direction;
+		float discriminant = 4 * (radius_ * radius_ - perpendicular.dot(perpendicular));
 
 		// No intersection at all. Note we don't worry about the tangent case here!
 		if (discriminant < 1e-6f) return false;
 
 		// Two intersections.
-		discriminant = sqrtf(discriminant); // This is safe now we know discriminant > 0.f
-		float t0 = (-b - discriminant) / (2.f * a);
-		float t1 = (-b + discriminant) / (2.f * a);
+		float q = -.5f * (b < 0.f ? b - sqrtf(discriminant) : b + sqrtf(discriminant));
+		float t0 = q;
+		float t1 = c / q;
 
 		if (t0 > t1) std::swap(t0, t1);
 
-		float t;
-
 		if (t0 > maxT || t1 < minT) return false;
 		else if (t0 < minT) {
 			if (t1 < maxT) t = t1;
 			else return false;
 		}
 		else t = t0;
+		return true;
+	}
+
+	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		Eigen::Vector3f centreWorldSpace = transformPosition(modelToWorld(), Eigen::Vector3f::Zero());
+		float t;
+		if (!hitDistance(ray, centreWorldSpace, minT, maxT, t)) return false;
 
 		info.hitT = t;
-		info.location = ray.origin + t * ray.direction;
+		info.object = this;
+		info.primitive = 0;
+		info.u = info.v = 0.f;
+		return true;
+	}
+
+	virtual void intersectPacket(const RayPacket& packet, uint64_t active, float minT, PacketHits& hits, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return;
+
+		packetHitDistances(packet, active, minT, hits.t, [&](int first, int lanes, const PacketFloat& t) {
+			float ts[PACKET_LANES];
+			t.store(ts);
+			for (int i = 0; i < PACKET_LANES; ++i) {
+				if (lanes >> i & 1)
+					hits.record(first + i, ts[i], this, 0, 0.f, 0.f);
+			}
+		});
+	}
+
+	virtual uint64_t occludedPacket(const RayPacket& packet, uint64_t active, float minT, const float* maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return 0;
+
+		uint64_t result = 0;
+		packetHitDistances(packet, active, minT, maxT, [&](int first, int lanes, const PacketFloat&) {
+			result |= static_cast<uint64_t>(lanes) << first;
+		});
+		return result;
+	}
+
+	virtual void computeSurface(const Ray& ray, HitInfo& info) const override
+	{
+		Eigen::Vector3f centreWorldSpace = transformPosition(modelToWorld(), Eigen::Vector3f::Zero());
+		info.location = ray.origin + info.hitT * ray.direction;
 		info.normal = (info.location - centreWorldSpace).normalized();
 		info.inDirection = ray.direction;
 		info.shader = shader();
-		Eigen::Vector3f modelSpaceLoc = transformPosition(modelToWorld().inverse(), info.location);
+		Eigen::Vector3f modelSpaceLoc = transformPosition(worldToModel(), info.location);
 		modelSpaceLoc = modelSpaceLoc.normalized();
 		info.texCoords = Eigen::Vector2f((atan2f(modelSpaceLoc.x(), modelSpaceLoc.z()) + M_PI) / (2.f * M_PI), (asinf(modelSpaceLoc.y()) / M_PI) + 0.5f);
-		return true;
 	}
-};
 
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		float t;
+		return hitDistance(ray, transformPosition(modelToWorld(), Eigen::Vector3f::Zero()), minT, maxT, t);
+	}
+};
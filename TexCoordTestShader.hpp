@@ -7,15 +7,15 @@
 class TexCoordTestShader : public Shader
 {
 public:
-	virtual Eigen::Vector3f getColor(const HitInfo& hitInfo, 
-		const Renderable* scene, 
+	virtual void shade(const HitInfo& hitInfo,
 		const std::vector<std::unique_ptr<Light>>& lights,
 		const Eigen::Vector3f& ambientLight,
 		int currBounceCount,
-		const int maxBounces) const
+		const int maxBounces,
+		ShadingOutput& output) const override
 	{
 		Eigen::Vector3f color = Eigen::Vector3f(hitInfo.texCoords.x(), hitInfo.texCoords.y(), 0.f);
-		return color;
+		output.addColor(color);
 	}
 };
 
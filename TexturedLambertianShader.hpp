@@ -16,12 +16,12 @@ public:
 		:shadowTest_(shadowTest), albedoTexture_(albedoTexture)
 	{}
 
-	virtual Eigen::Vector3f getColor(const HitInfo& hitInfo, 
-		const Renderable* scene, 
+	virtual void shade(const HitInfo& hitInfo,
 		const std::vector<std::unique_ptr<Light>>& lights,
 		const Eigen::Vector3f& ambientLight,
 		int currBounceCount,
-		const int maxBounces) const
+		const int maxBounces,
+		ShadingOutput& output) const override
 	{
 		Eigen::Vector3f albedo;
 
@@ -38,19 +38,17 @@ public:
 		albedo.y() = static_cast<float>(albedoTGA.g) / 255.f;
 		albedo.z() = static_cast<float>(albedoTGA.b) / 255.f;
 
-		Eigen::Vector3f color = coefftWiseMul(albedo, ambientLight);
+		output.addColor(coefftWiseMul(albedo, ambientLight));
 
 		for (auto& light : lights) {
-			if (shadowTest_) {
-				if (!light->visibilityCheck(hitInfo.location, scene))
-					continue;
-			}
 			Eigen::Vector3f lightVec = light->getVecToLight(hitInfo.location);
 			float dotProd = std::max(lightVec.dot(hitInfo.normal), 0.f);
-			color += dotProd * coefftWiseMul(light->getIntensity(hitInfo.location), albedo);
+			Eigen::Vector3f color = dotProd * coefftWiseMul(light->getIntensity(hitInfo.location), albedo);
+			if (shadowTest_)
+				output.addLitColor(*light, hitInfo.location, color);
+			else
+				output.addColor(color);
 		}
-
-		return color;
 	}
 };
 
@@ -0,0 +1,208 @@
+#pragma once
+#include "Morton.hpp"
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <ostream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/// <summary>
+/// A rectangle of pixels, with its bottom left corner at (x, y).
+/// </summary>
+struct Tile
+{
+	int x, y, width, height;
+};
+
+/// <summary>
+/// Order the tiles of an image are handed out in.
+/// </summary>
+enum class TileOrder
+{
+	Scanline, // Row by row.
+	Morton, // Along a Morton (Z-order) curve.
+	Hilbert // Along a Hilbert curve, where consecutive tiles always share an edge.
+};
+
+/// <summary>
+/// What one thread did while rendering the tiles.
+/// </summary>
+struct TileThreadStats
+{
+	double busySeconds = 0.0; // Time spent rendering tiles.
+	int tiles = 0; // Tiles rendered.
+	int stolen = 0; // Tiles rendered that were stolen from other threads.
+};
+
+std::ostream& operator <<(std::ostream& str, const TileThreadStats& stats)
+{
+	str << "busy " << stats.busySeconds << " s, " << stats.tiles << " tiles (" << stats.stolen << " stolen)";
+	return str;
+}
+
+/// <summary>
+/// Splits an image into square tiles and renders them in parallel with work stealing.
+/// The tiles are put in order along a space-filling curve and each thread is dealt a
+/// contiguous run of them, so a thread works on one compact patch of the image and its rays
+/// tend to visit the same parts of the scene. Each thread takes tiles from the front of its
+/// own queue; a thread with none left steals the back half of another thread's queue, the
+/// tiles that thread would have reached last. Tiles that take longer than others, such as
+/// those full of reflections, are then evened out between threads.
+/// </summary>
+class TileScheduler
+{
+private:
+	struct WorkQueue
+	{
+		std::mutex mutex;
+		std::deque<int> tiles;
+	};
+
+	std::vector<Tile> tiles_;
+	bool stealing_;
+
+	/// <summary>
+	/// Take the next tile for thread from its own queue, or failing that, steal from the
+	/// others. remaining counts the tiles not yet taken. Returns false once there are none left.
+	/// </summary>
+	bool takeTile(WorkQueue* queues, std::atomic<int>& remaining, int threads, int thread, int& tile, bool& stolen) const
+	{
+		WorkQueue& own = queues[thread];
+		{
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.tiles.empty()) {
+				tile = own.tiles.front();
+				own.tiles.pop_front();
+				remaining--;
+				stolen = false;
+				return true;
+			}
+		}
+		if (!stealing_) return false;
+
+		// A scan can miss tiles being stolen from a queue it has yet to reach into one it has
+		// already passed, so keep looking until every tile has been taken.
+		while (remaining > 0) {
+			for (int i = 1; i < threads; ++i) {
+				WorkQueue& victim = queues[(thread + i) % threads];
+				// Move the loot under both locks, so the tiles are always in one queue or the other.
+				std::scoped_lock lock(own.mutex, victim.mutex);
+				if (victim.tiles.empty()) continue;
+
+				size_t count = (victim.tiles.size() + 1) / 2;
+				tile = *(victim.tiles.end() - count);
+				own.tiles.insert(own.tiles.end(), victim.tiles.end() - count + 1, victim.tiles.end());
+				victim.tiles.erase(victim.tiles.end() - count, victim.tiles.end());
+				remaining--;
+				stolen = true;
+				return true;
+			}
+			std::this_thread::yield();
+		}
+		return false;
+	}
+
+public:
+	/// <summary>
+	/// Split a pixWidth x pixHeight image into tiles of tileSize x tileSize pixels (smaller
+	/// along the top and right edges if the image isn't a multiple of tileSize).
+	/// With stealing off, each thread only renders the tiles it is dealt, for comparison.
+	/// </summary>
+	TileScheduler(int pixWidth, int pixHeight, int tileSize, TileOrder order, bool stealing=true)
+		:stealing_(stealing)
+	{
+		int tilesX = (pixWidth + tileSize - 1) / tileSize, tilesY = (pixHeight + tileSize - 1) / tileSize;
+		uint32_t side = 1;
+		while (side < static_cast<uint32_t>(std::max(tilesX, tilesY)))
+			side *= 2;
+
+		std::vector<uint32_t> keys;
+		std::vector<int> indices;
+		for (int ty = 0; ty < tilesY; ++ty) {
+			for (int tx = 0; tx < tilesX; ++tx) {
+				Tile tile;
+				tile.x = tx * tileSize;
+				tile.y = ty * tileSize;
+				tile.width = std::min(tileSize, pixWidth - tile.x);
+				tile.height = std::min(tileSize, pixHeight - tile.y);
+				tiles_.push_back(tile);
+
+				if (order == TileOrder::Morton)
+					keys.push_back(mortonCode2D(tx, ty));
+				else if (order == TileOrder::Hilbert)
+					keys.push_back(hilbertIndex(side, tx, ty));
+				else
+					keys.push_back(ty * tilesX + tx);
+				indices.push_back(static_cast<int>(indices.size()));
+			}
+		}
+
+		radixSort(keys, indices, 32);
+		std::vector<Tile> ordered(tiles_.size());
+		for (size_t i = 0; i < ordered.size(); ++i)
+			ordered[i] = tiles_[indices[i]];
+		tiles_.swap(ordered);
+	}
+
+	/// <summary>
+	/// The tiles, in the order they are dealt out to threads.
+	/// </summary>
+	const std::vector<Tile>& tiles() const
+	{
+		return tiles_;
+	}
+
+	/// <summary>
+	/// Render every tile once, calling renderTile(tile, thread) on an OpenMP team of threads,
+	/// where thread is below omp_get_max_threads(). Returns what each thread did.
+	/// </summary>
+	template <typename RenderTile>
+	std::vector<TileThreadStats> run(RenderTile renderTile) const
+	{
+		std::unique_ptr<WorkQueue[]> queues;
+		std::atomic<int> remaining(static_cast<int>(tiles_.size()));
+		std::vector<TileThreadStats> stats;
+		int threads = 1;
+
+#pragma omp parallel
+		{
+#pragma omp single
+			{
+#ifdef _OPENMP
+				threads = omp_get_num_threads();
+#endif
+				queues.reset(new WorkQueue[threads]);
+				stats.resize(threads);
+				int tileCount = static_cast<int>(tiles_.size());
+				for (int t = 0; t < threads; ++t) {
+					for (int i = tileCount * t / threads; i < tileCount * (t + 1) / threads; ++i)
+						queues[t].tiles.push_back(i);
+				}
+			}
+
+#ifdef _OPENMP
+			int thread = omp_get_thread_num();
+#else
+			int thread = 0;
+#endif
+			TileThreadStats& threadStats = stats[thread];
+			int tile;
+			bool stolen;
+			while (takeTile(queues.get(), remaining, threads, thread, tile, stolen)) {
+				auto startTime = std::chrono::steady_clock::now();
+				renderTile(tiles_[tile], thread);
+				threadStats.busySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+				threadStats.tiles++;
+				if (stolen) threadStats.stolen++;
+			}
+		}
+		return stats;
+	}
+};
@@ -18,53 +18,58 @@ public:
 		:Renderable(shader, mask), v0_(v0), v1_(v1), v2_(v2), culling_(culling)
 	{}
 
+	virtual bool bounds(AABB& box) const override
+	{
+		box = AABB();
+		box.expand(transformPosition(modelToWorld(), v0_));
+		box.expand(transformPosition(modelToWorld(), v1_));
+		box.expand(transformPosition(modelToWorld(), v2_));
+		return true;
+	}
 
 	virtual bool intersect(const Ray& ray, float minT, float maxT, HitInfo& info, IntersectMask mask) const override
 	{
 		if (!checkMask(mask)) return false;
-		// Intersection code from
-		// https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection.html
 		Eigen::Vector3f v0World = transformPosition(modelToWorld(), v0_);
 		Eigen::Vector3f v1World = transformPosition(modelToWorld(), v1_);
 		Eigen::Vector3f v2World = transformPosition(modelToWorld(), v2_);
 
-		Eigen::Vector3f v0v1 = v1World - v0World;
-		Eigen::Vector3f v0v2 = v2World - v0World;
-		Eigen::Vector3f pvec = ray.direction.cross(v0v2);
-		float det = v0v1.dot(pvec);
-
-		if (culling_) {
-			// if the determinant is negative, the triangle is 'back facing'
-			// if the determinant is close to 0, the ray misses the triangle
-			if (det < 1e-6) return false;
-		}
-		else {
-			// ray and triangle are parallel if det is close to 0
-			if (fabs(det) < 1e-6) return false;
-		}
-
-		float invDet = 1 / det;
-
-		Eigen::Vector3f tvec = ray.origin - v0World;
-		float u = tvec.dot(pvec) * invDet;
-		if (u < 0 || u > 1) return false;
-
-		Eigen::Vector3f qvec = tvec.cross(v0v1);
-		float v = ray.direction.dot(qvec) * invDet;
-		if (v < 0 || u + v > 1) return false;
-
-		float t = v0v2.dot(qvec) * invDet;
-
+		float t, u, v;
+		if (!intersectTriangle(ray.origin, ray.direction, v0World, v1World - v0World, v2World - v0World, culling_, t, u, v))
+			return false;
 		if (t < minT || t > maxT) return false;
 
 		info.hitT = t;
+		info.object = this;
+		info.primitive = 0;
+		info.u = u;
+		info.v = v;
+		return true;
+	}
+
+	virtual void computeSurface(const Ray& ray, HitInfo& info) const override
+	{
+		Eigen::Vector3f v0World = transformPosition(modelToWorld(), v0_);
+		Eigen::Vector3f v1World = transformPosition(modelToWorld(), v1_);
+		Eigen::Vector3f v2World = transformPosition(modelToWorld(), v2_);
+
 		info.inDirection = ray.direction;
-		info.location = ray.origin + t * ray.direction;
-		info.normal = v0v1.cross(v0v2).normalized();
+		info.location = ray.origin + info.hitT * ray.direction;
+		info.normal = (v1World - v0World).cross(v2World - v0World).normalized();
 		info.shader = shader();
-		info.texCoords = Eigen::Vector2f(u, v);
+		info.texCoords = Eigen::Vector2f(info.u, info.v);
+	}
 
-		return true;
+	virtual bool occluded(const Ray& ray, float minT, float maxT, IntersectMask mask) const override
+	{
+		if (!checkMask(mask)) return false;
+
+		Eigen::Vector3f v0World = transformPosition(modelToWorld(), v0_);
+		Eigen::Vector3f v1World = transformPosition(modelToWorld(), v1_);
+		Eigen::Vector3f v2World = transformPosition(modelToWorld(), v2_);
+
+		float t, u, v;
+		return intersectTriangle(ray.origin, ray.direction, v0World, v1World - v0World, v2World - v0World, culling_, t, u, v)
+			&& t >= minT && t <= maxT;
 	}
 };
-
@@ -0,0 +1,295 @@
+#pragma once
+#include "Renderable.hpp"
+#include "Shader.hpp"
+#include "Camera.hpp"
+#include "RayPacket.hpp"
+#include "Morton.hpp"
+#include "AABB.hpp"
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+/// <summary>
+/// Ray counts from wavefront rendering, summed over tiles.
+/// </summary>
+struct WavefrontStats
+{
+	uint64_t cameraRays = 0;
+	uint64_t bounceRays = 0; // Rays added by shaders with addRay, such as mirror reflections.
+	uint64_t shadowRays = 0;
+	size_t largestStream = 0; // Most rays in any one stream.
+	double sortSeconds = 0.0; // Time spent sorting the bounce and shadow streams.
+	double secondarySeconds = 0.0; // Time spent tracing and shading bounce rays and the shadow rays cast where they hit, not counting sorting.
+	double cameraShadowSeconds = 0.0; // Time spent tracing the shadow rays cast where camera rays hit, which are never sorted.
+
+	WavefrontStats& operator +=(const WavefrontStats& rhs)
+	{
+		cameraRays += rhs.cameraRays;
+		bounceRays += rhs.bounceRays;
+		shadowRays += rhs.shadowRays;
+		largestStream = std::max(largestStream, rhs.largestStream);
+		sortSeconds += rhs.sortSeconds;
+		secondarySeconds += rhs.secondarySeconds;
+		cameraShadowSeconds += rhs.cameraShadowSeconds;
+		return *this;
+	}
+};
+
+std::ostream& operator <<(std::ostream& str, const WavefrontStats& stats)
+{
+	str << stats.cameraRays << " camera rays, " << stats.bounceRays << " bounce rays, "
+		<< stats.shadowRays << " shadow rays, largest stream " << stats.largestStream << " rays; "
+		<< "secondary rays traced in " << stats.secondarySeconds << " s, sorted in " << stats.sortSeconds << " s; "
+		<< "shadow rays from camera ray hits traced in " << stats.cameraShadowSeconds << " s";
+	return str;
+}
+
+/// <summary>
+/// Renders a tile of the image breadth first rather than one pixel at a time: all the tile's
+/// camera rays are intersected as one stream, the hits are shaded, and the shadow rays and
+/// bounce rays the shaders ask for are queued into two more streams. Shadow rays are then
+/// traced, and the bounce rays become the next stream to intersect, until maxBounces or until
+/// none are left. Each ray carries the weight its colour counts for and the pixel it adds to.
+/// Streams are traced RayPacket::MAX_SIZE rays at a time, with intersectPacket or, for shadow
+/// rays, occludedPacket, so secondary rays get the SIMD tests too; camera rays are queued in
+/// 8x8 pixel blocks so those packets are coherent.
+/// Bounce rays, and the shadow rays cast from where they hit, come out in pixel order, which
+/// says little about where they go. With sortRays set they are sorted by the octant of their
+/// direction and then along a Morton curve through their origins before being traced, so
+/// neighbouring rays visit the same nodes. Shadow rays cast from camera ray hits are left in
+/// pixel order, which is already coherent.
+/// </summary>
+class WavefrontRenderer
+{
+private:
+	struct StreamRay
+	{
+		Ray ray;
+		float maxT;
+		Eigen::Vector3f weight;
+		int pixel; // Index into the tile.
+	};
+
+	struct ShadowRay
+	{
+		Ray ray;
+		float minT, maxT;
+		Eigen::Vector3f color; // Added to the pixel if nothing is hit.
+		int pixel;
+	};
+
+	/// <summary>
+	/// Queues what a shader outputs for one stream ray.
+	/// </summary>
+	class StreamOutput : public ShadingOutput
+	{
+	private:
+		Eigen::Vector3f* colors_;
+		std::vector<ShadowRay>& shadowRays_;
+		std::vector<StreamRay>& bounceRays_;
+
+	public:
+		Eigen::Vector3f weight;
+		int pixel;
+
+		StreamOutput(Eigen::Vector3f* colors, std::vector<ShadowRay>& shadowRays, std::vector<StreamRay>& bounceRays)
+			:colors_(colors), shadowRays_(shadowRays), bounceRays_(bounceRays), pixel(0)
+		{}
+
+		virtual void addColor(const Eigen::Vector3f& color) override
+		{
+			colors_[pixel] += coefftWiseMul(weight, color);
+		}
+
+		virtual void addLitColor(const Light& light, const Eigen::Vector3f& location, const Eigen::Vector3f& color) override
+		{
+			ShadowRay shadowRay;
+			shadowRay.ray = light.shadowRay(location, shadowRay.minT, shadowRay.maxT);
+			shadowRay.color = coefftWiseMul(weight, color);
+			shadowRay.pixel = pixel;
+			shadowRays_.push_back(shadowRay);
+		}
+
+		virtual void addRay(const Ray& ray, float maxT, const Eigen::Vector3f& rayWeight) override
+		{
+			bounceRays_.push_back({ ray, maxT, coefftWiseMul(weight, rayWeight), pixel });
+		}
+	};
+
+	static constexpr int BLOCK_SIDE = 8; // Camera rays are queued in blocks of this many pixels square.
+
+	const Renderable& scene_;
+	const Camera& cam_;
+	const std::vector<std::unique_ptr<Light>>& lights_;
+	Eigen::Vector3f ambientLight_;
+	int maxBounces_;
+	bool sortRays_;
+
+	/// <summary>
+	/// Sort a stream of rays by a 30-bit key: the octant of the direction in the top 3 bits,
+	/// above a 27-bit Morton code of the origin within the bounds of the stream's origins.
+	/// </summary>
+	template <typename StreamEntry>
+	static void sortStream(std::vector<StreamEntry>& rays)
+	{
+		int n = static_cast<int>(rays.size());
+		AABB bounds;
+		for (const StreamEntry& r : rays)
+			bounds.expand(r.ray.origin);
+		Eigen::Vector3f extent = bounds.extent();
+		Eigen::Vector3f scale;
+		for (int a = 0; a < 3; ++a)
+			scale[a] = extent[a] > 0.f ? 1.f / extent[a] : 0.f;
+
+		std::vector<uint32_t> keys(n);
+		std::vector<int> order(n);
+		for (int i = 0; i < n; ++i) {
+			const Ray& ray = rays[i].ray;
+			uint32_t octant = (ray.direction.x() < 0.f) | (ray.direction.y() < 0.f) << 1 | (ray.direction.z() < 0.f) << 2;
+			keys[i] = octant << 27 | mortonCode30((ray.origin - bounds.min).cwiseProduct(scale)) >> 3;
+			order[i] = i;
+		}
+		radixSort(keys, order, 30);
+
+		std::vector<StreamEntry> sorted(n);
+		for (int i = 0; i < n; ++i)
+			sorted[i] = rays[order[i]];
+		rays.swap(sorted);
+	}
+
+	/// <summary>
+	/// Intersect a stream of rays a packet at a time, calling shadeHit(ray, hit) for each ray
+	/// that hits something.
+	/// </summary>
+	template <typename ShadeHit>
+	void intersectStream(const std::vector<StreamRay>& rays, ShadeHit shadeHit) const
+	{
+		RayPacket packet;
+		for (size_t first = 0; first < rays.size(); first += RayPacket::MAX_SIZE) {
+			int count = static_cast<int>(std::min<size_t>(RayPacket::MAX_SIZE, rays.size() - first));
+			packet.size = (count + PACKET_LANES - 1) / PACKET_LANES * PACKET_LANES;
+			PacketHits hits(packet.size, 0.f);
+			for (int i = 0; i < packet.size; ++i) {
+				// Lanes past the end repeat the last ray, but are left out of the active mask.
+				const StreamRay& r = rays[first + std::min(i, count - 1)];
+				packet.setRay(i, r.ray);
+				hits.t[i] = r.maxT;
+			}
+			uint64_t active = count == RayPacket::MAX_SIZE ? ~0ull : (1ull << count) - 1;
+
+			scene_.intersectPacket(packet, active, 1e-6f, hits, VISIBLE_BITMASK);
+
+			for (int i = 0; i < count; ++i) {
+				if (hits.hit >> i & 1)
+					shadeHit(rays[first + i], hits.info[i]);
+			}
+		}
+	}
+
+	/// <summary>
+	/// Trace a stream of shadow rays a packet at a time, adding the colour of each ray that
+	/// nothing blocks to its pixel. A packet has one minT, so it holds a run of rays sharing it.
+	/// </summary>
+	void traceShadowStream(const std::vector<ShadowRay>& rays, Eigen::Vector3f* colors) const
+	{
+		RayPacket packet;
+		alignas(32) float maxT[RayPacket::MAX_SIZE];
+		for (size_t first = 0; first < rays.size(); ) {
+			float minT = rays[first].minT;
+			int count = 1;
+			while (count < RayPacket::MAX_SIZE && first + count < rays.size() && rays[first + count].minT == minT)
+				++count;
+			packet.size = (count + PACKET_LANES - 1) / PACKET_LANES * PACKET_LANES;
+			for (int i = 0; i < packet.size; ++i) {
+				// Lanes past the end repeat the last ray, but are left out of the active mask.
+				const ShadowRay& r = rays[first + std::min(i, count - 1)];
+				packet.setRay(i, r.ray);
+				maxT[i] = r.maxT;
+			}
+			uint64_t active = count == RayPacket::MAX_SIZE ? ~0ull : (1ull << count) - 1;
+
+			uint64_t occluded = scene_.occludedPacket(packet, active, minT, maxT, SHADOW_BITMASK);
+
+			for (int i = 0; i < count; ++i) {
+				if (!(occluded >> i & 1))
+					colors[rays[first + i].pixel] += rays[first + i].color;
+			}
+			first += count;
+		}
+	}
+
+public:
+	WavefrontRenderer(const Renderable& scene, const Camera& cam,
+		const std::vector<std::unique_ptr<Light>>& lights,
+		const Eigen::Vector3f& ambientLight, int maxBounces, bool sortRays=true)
+		:scene_(scene), cam_(cam), lights_(lights), ambientLight_(ambientLight), maxBounces_(maxBounces),
+		sortRays_(sortRays)
+	{}
+
+	/// <summary>
+	/// Render the width x height pixels with their bottom left corner at (pixX, pixY).
+	/// The colour of pixel (pixX + x, pixY + y) goes in colors[y * width + x], unclamped, and
+	/// hit[y * width + x] says whether its camera ray hit anything.
+	/// Ray counts are added to stats.
+	/// </summary>
+	void renderTile(int pixX, int pixY, int width, int height, Eigen::Vector3f* colors, bool* hit, WavefrontStats& stats) const
+	{
+		std::vector<StreamRay> rays, bounceRays;
+		std::vector<ShadowRay> shadowRays;
+		rays.reserve(static_cast<size_t>(width) * height);
+
+		for (int blockY = 0; blockY < height; blockY += BLOCK_SIDE) {
+			for (int blockX = 0; blockX < width; blockX += BLOCK_SIDE) {
+				for (int y = blockY; y < std::min(blockY + BLOCK_SIDE, height); ++y) {
+					for (int x = blockX; x < std::min(blockX + BLOCK_SIDE, width); ++x)
+						rays.push_back({ cam_.getRay(pixX + x, pixY + y), 1e6f, Eigen::Vector3f::Ones(), y * width + x });
+				}
+			}
+		}
+		for (int i = 0; i < width * height; ++i) {
+			colors[i] = Eigen::Vector3f::Zero();
+			hit[i] = false;
+		}
+		stats.cameraRays += rays.size();
+
+		typedef std::chrono::steady_clock Clock;
+		StreamOutput output(colors, shadowRays, bounceRays);
+		for (int bounce = 0; !rays.empty(); ++bounce) {
+			stats.largestStream = std::max(stats.largestStream, rays.size());
+
+			auto intersectStartTime = Clock::now();
+			intersectStream(rays, [&](const StreamRay& ray, const HitInfo& info) {
+				if (bounce == 0) hit[ray.pixel] = true;
+				output.weight = ray.weight;
+				output.pixel = ray.pixel;
+				info.shader->shade(info, lights_, ambientLight_, bounce, maxBounces_, output);
+			});
+			if (bounce > 0)
+				stats.secondarySeconds += std::chrono::duration<double>(Clock::now() - intersectStartTime).count();
+
+			stats.shadowRays += shadowRays.size();
+			stats.largestStream = std::max(stats.largestStream, shadowRays.size());
+			if (sortRays_) {
+				auto sortStartTime = Clock::now();
+				if (bounce > 0) sortStream(shadowRays);
+				sortStream(bounceRays);
+				stats.sortSeconds += std::chrono::duration<double>(Clock::now() - sortStartTime).count();
+			}
+
+			auto shadowStartTime = Clock::now();
+			traceShadowStream(shadowRays, colors);
+			double shadowSeconds = std::chrono::duration<double>(Clock::now() - shadowStartTime).count();
+			if (bounce > 0)
+				stats.secondarySeconds += shadowSeconds;
+			else
+				stats.cameraShadowSeconds += shadowSeconds;
+			shadowRays.clear();
+
+			stats.bounceRays += bounceRays.size();
+			rays.swap(bounceRays);
+			bounceRays.clear();
+		}
+	}
+};
@@ -0,0 +1,475 @@
+#pragma once
+#include "BVH.hpp"
+#include "PackedTriangle.hpp"
+#include "MeshHit.hpp"
+#include "Simd.hpp"
+#include "Ray.hpp"
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <type_traits>
+
+/// <summary>
+/// A node of an N-wide BVH. The bounds of all N children are stored in structure-of-arrays
+/// form, so one ray can be tested against all of them at once with SIMD instructions.
+/// </summary>
+template <int N>
+struct WideBVHNode
+{
+	float bounds[6][N]; // Child minX, minY, minZ, maxX, maxY, maxZ.
+	int child[N]; // Interior child: node index. Leaf child: index of its first TrianglePacket.
+	int count[N]; // 0 for interior children, number of packets for leaves, -1 for empty slots.
+};
+
+/// <summary>
+/// A compressed node of an N-wide BVH. Child bounds are stored as 8-bit steps from the minimum
+/// corner of the node's own box, which is split into 255 steps along each axis. Child boxes
+/// are rounded outwards, so they only ever grow. The bounds take a quarter of the space.
+/// </summary>
+template <int N>
+struct QuantizedWideBVHNode
+{
+	float origin[3]; // Minimum corner of the node's box.
+	float scale[3]; // Size of one step along each axis.
+	uint8_t bounds[6][N]; // Child minX, minY, minZ, maxX, maxY, maxZ, in steps from origin.
+	int child[N];
+	int count[N];
+};
+
+/// <summary>
+/// N triangles in structure-of-arrays form, so a ray can be tested against all of them at
+/// once. Leaves that don't fill their last packet are padded with degenerate triangles,
+/// which can never be hit, and have face index -1.
+/// </summary>
+template <int N>
+struct TrianglePacket
+{
+	float v0[3][N], e1[3][N], e2[3][N];
+	int face[N];
+};
+
+/// <summary>
+/// A WideBVH is a BVH with N children per node (N = 4 for SSE, or 8 for AVX), made by
+/// collapsing a binary BVH: each wide node takes the largest interior nodes of the binary
+/// subtree below it until it has N children. Traversal tests a ray against all the children
+/// of a node at once, and against the triangles of a leaf N at a time.
+/// If Quantized, nodes store child bounds in 8 bits per plane (see QuantizedWideBVHNode).
+/// </summary>
+template <int N, bool Quantized = false>
+class WideBVH
+{
+private:
+	typedef SimdFloat<N> FloatN;
+	typedef typename std::conditional<Quantized, QuantizedWideBVHNode<N>, WideBVHNode<N>>::type Node;
+
+	std::vector<Node, AlignedAllocator<Node>> nodes_; // In depth-first order.
+	std::vector<TrianglePacket<N>> packets_;
+	std::vector<int> sourceNodes_; // Per wide node, the binary node in each child slot (-1 if empty), for refitting.
+	std::vector<int> packetSources_; // Per packet, the first triangle and triangle count, for refitting.
+
+	/// <summary>
+	/// Fill a packet with count (at most N) triangles starting at first, padding the rest.
+	/// </summary>
+	static void fillPacket(TrianglePacket<N>& packet, const std::vector<PackedTriangle>& triangles, int first, int count)
+	{
+		for (int lane = 0; lane < N; ++lane) {
+			bool padding = lane >= count;
+			const PackedTriangle& tri = triangles[first + (padding ? 0 : lane)];
+			for (int a = 0; a < 3; ++a) {
+				packet.v0[a][lane] = tri.v0[a];
+				packet.e1[a][lane] = padding ? 0.f : tri.e1[a];
+				packet.e2[a][lane] = padding ? 0.f : tri.e2[a];
+			}
+			packet.face[lane] = padding ? -1 : tri.face;
+		}
+	}
+
+	/// <summary>
+	/// Set the bounds of a node's children. Empty boxes mark empty slots.
+	/// </summary>
+	static void setBounds(WideBVHNode<N>& node, const AABB* boxes)
+	{
+		for (int i = 0; i < N; ++i) {
+			// Empty slots get inverted bounds, so rays never hit them.
+			for (int a = 0; a < 3; ++a) {
+				node.bounds[a][i] = boxes[i].empty() ? std::numeric_limits<float>::max() : boxes[i].min[a];
+				node.bounds[a + 3][i] = boxes[i].empty() ? -std::numeric_limits<float>::max() : boxes[i].max[a];
+			}
+		}
+	}
+
+	static void setBounds(QuantizedWideBVHNode<N>& node, const AABB* boxes)
+	{
+		AABB parent;
+		for (int i = 0; i < N; ++i) {
+			if (!boxes[i].empty()) parent.expand(boxes[i]);
+		}
+
+		for (int a = 0; a < 3; ++a) {
+			// Make sure the 255th step reaches the top of the box, despite rounding.
+			float origin = parent.min[a], scale = (parent.max[a] - parent.min[a]) / 255.f;
+			while (origin + 255.f * scale < parent.max[a])
+				scale = std::nextafter(scale, std::numeric_limits<float>::max());
+			node.origin[a] = origin;
+			node.scale[a] = scale;
+
+			for (int i = 0; i < N; ++i) {
+				if (boxes[i].empty()) {
+					node.bounds[a][i] = 255;
+					node.bounds[a + 3][i] = 0;
+					continue;
+				}
+				int lo = 0, hi = 255;
+				if (scale > 0.f) {
+					lo = std::max(0, static_cast<int>(std::floor((boxes[i].min[a] - origin) / scale)));
+					hi = std::min(255, static_cast<int>(std::ceil((boxes[i].max[a] - origin) / scale)));
+					// Round outwards, whatever the rounding of the divisions above.
+					while (lo > 0 && origin + lo * scale > boxes[i].min[a]) --lo;
+					while (hi < 255 && origin + hi * scale < boxes[i].max[a]) ++hi;
+				}
+				node.bounds[a][i] = static_cast<uint8_t>(lo);
+				node.bounds[a + 3][i] = static_cast<uint8_t>(hi);
+			}
+		}
+	}
+
+	/// <summary>
+	/// Slab test of a ray against all N children of a node, narrowing [tNear, tFar] for each.
+	/// </summary>
+	static void intersectChildren(const WideBVHNode<N>& node, const Eigen::Vector3f& origin, const Eigen::Vector3f& invDir,
+		const int* nearPlane, const int* farPlane, FloatN& tNear, FloatN& tFar)
+	{
+		// Planes are offset by the origin before scaling, as in AABB::intersect: folding the origin
+		// into bound * invDir - origin * invDir gives inf - inf for a zero direction component.
+		for (int a = 0; a < 3; ++a) {
+			FloatN invDirN = FloatN::broadcast(invDir[a]), originN = FloatN::broadcast(origin[a]);
+			tNear = max(tNear, (FloatN::load(node.bounds[nearPlane[a]]) - originN) * invDirN);
+			tFar = min(tFar, (FloatN::load(node.bounds[farPlane[a]]) - originN) * invDirN);
+		}
+	}
+
+	static void intersectChildren(const QuantizedWideBVHNode<N>& node, const Eigen::Vector3f& origin, const Eigen::Vector3f& invDir,
+		const int* nearPlane, const int* farPlane, FloatN& tNear, FloatN& tFar)
+	{
+		// A plane at step q is at distance (nodeOrigin + q * scale - origin) * invDir along the ray.
+		// The plane is placed before scaling by invDir, so a huge invDir never meets a zero step.
+		// A node that is flat along an axis has scale 0, and all its planes there at nodeOrigin.
+		for (int a = 0; a < 3; ++a) {
+			FloatN invDirN = FloatN::broadcast(invDir[a]);
+			FloatN offset = FloatN::broadcast(node.origin[a] - origin[a]);
+			if (node.scale[a] > 0.f) {
+				FloatN scale = FloatN::broadcast(node.scale[a]);
+				tNear = max(tNear, (FloatN::loadBytes(node.bounds[nearPlane[a]]) * scale + offset) * invDirN);
+				tFar = min(tFar, (FloatN::loadBytes(node.bounds[farPlane[a]]) * scale + offset) * invDirN);
+			}
+			else {
+				tNear = max(tNear, offset * invDirN);
+				tFar = min(tFar, offset * invDirN);
+			}
+		}
+	}
+
+	/// <summary>
+	/// Pack the triangles of a binary leaf into packets, returning the first packet index.
+	/// </summary>
+	int packLeaf(const BVHNode& leaf, const std::vector<PackedTriangle>& triangles)
+	{
+		int first = static_cast<int>(packets_.size());
+		for (int i = 0; i < leaf.count; i += N) {
+			int count = std::min(N, leaf.count - i);
+			TrianglePacket<N> packet;
+			fillPacket(packet, triangles, leaf.leftOrFirst + i, count);
+			packets_.push_back(packet);
+			packetSources_.push_back(leaf.leftOrFirst + i);
+			packetSources_.push_back(count);
+		}
+		return first;
+	}
+
+	int collapseNode(const BVHNodeArray& binary, int binaryIndex, const std::vector<PackedTriangle>& triangles)
+	{
+		// Open up the largest interior nodes until there are N children.
+		std::vector<int> children;
+		if (binary[binaryIndex].isLeaf())
+			children.push_back(binaryIndex);
+		else {
+			children.push_back(binary[binaryIndex].leftOrFirst);
+			children.push_back(binary[binaryIndex].leftOrFirst + 1);
+		}
+		while (static_cast<int>(children.size()) < N) {
+			int best = -1;
+			float bestArea = -1.f;
+			for (int i = 0; i < static_cast<int>(children.size()); ++i) {
+				const BVHNode& node = binary[children[i]];
+				if (!node.isLeaf() && node.bounds.surfaceArea() > bestArea) {
+					bestArea = node.bounds.surfaceArea();
+					best = i;
+				}
+			}
+			if (best < 0) break;
+			int left = binary[children[best]].leftOrFirst;
+			children[best] = left;
+			children.push_back(left + 1);
+		}
+
+		int nodeIndex = static_cast<int>(nodes_.size());
+		nodes_.emplace_back();
+		sourceNodes_.resize(sourceNodes_.size() + N, -1);
+
+		Node node;
+		AABB boxes[N];
+		for (int i = 0; i < N; ++i) {
+			if (i >= static_cast<int>(children.size())) {
+				node.child[i] = 0;
+				node.count[i] = -1;
+				continue;
+			}
+
+			const BVHNode& child = binary[children[i]];
+			boxes[i] = child.bounds;
+			sourceNodes_[nodeIndex * N + i] = children[i];
+			if (child.isLeaf()) {
+				node.child[i] = packLeaf(child, triangles);
+				node.count[i] = static_cast<int>(packets_.size()) - node.child[i];
+			}
+			else {
+				node.child[i] = collapseNode(binary, children[i], triangles);
+				node.count[i] = 0;
+			}
+		}
+		setBounds(node, boxes);
+		nodes_[nodeIndex] = node;
+		return nodeIndex;
+	}
+
+	/// <summary>
+	/// Test a ray against the N triangles of a packet, updating hit if one is closer than closestT.
+	/// </summary>
+	bool intersectPacket(const TrianglePacket<N>& packet, const FloatN* origin, const FloatN* direction,
+		float minT, float& closestT, bool culling, MeshHit& hit) const
+	{
+		FloatN v0[3], e1[3], e2[3];
+		for (int a = 0; a < 3; ++a) {
+			v0[a] = FloatN::load(packet.v0[a]);
+			e1[a] = FloatN::load(packet.e1[a]);
+			e2[a] = FloatN::load(packet.e2[a]);
+		}
+
+		// Moller-Trumbore, as in intersectTriangle, for N triangles at once.
+		FloatN pvec[3] = {
+			direction[1] * e2[2] - direction[2] * e2[1],
+			direction[2] * e2[0] - direction[0] * e2[2],
+			direction[0] * e2[1] - direction[1] * e2[0] };
+		FloatN det = e1[0] * pvec[0] + e1[1] * pvec[1] + e1[2] * pvec[2];
+
+		FloatN epsilon = FloatN::broadcast(1e-6f), zero = FloatN::broadcast(0.f), one = FloatN::broadcast(1.f);
+		SimdMask<N> valid = culling ? det > epsilon : max(det, zero - det) > epsilon;
+		if (!valid.bits()) return false;
+
+		FloatN invDet = one / det;
+		FloatN tvec[3] = { origin[0] - v0[0], origin[1] - v0[1], origin[2] - v0[2] };
+		FloatN u = (tvec[0] * pvec[0] + tvec[1] * pvec[1] + tvec[2] * pvec[2]) * invDet;
+		valid = valid & (u >= zero) & (u <= one);
+		if (!valid.bits()) return false;
+
+		FloatN qvec[3] = {
+			tvec[1] * e1[2] - tvec[2] * e1[1],
+			tvec[2] * e1[0] - tvec[0] * e1[2],
+			tvec[0] * e1[1] - tvec[1] * e1[0] };
+		FloatN v = (direction[0] * qvec[0] + direction[1] * qvec[1] + direction[2] * qvec[2]) * invDet;
+		valid = valid & (v >= zero) & (u + v <= one);
+		if (!valid.bits()) return false;
+
+		FloatN t = (e2[0] * qvec[0] + e2[1] * qvec[1] + e2[2] * qvec[2]) * invDet;
+		valid = valid & (t >= FloatN::broadcast(minT)) & (t <= FloatN::broadcast(closestT));
+		int bits = valid.bits();
+		if (!bits) return false;
+
+		// Pick the closest of the lanes that hit.
+		float ts[N], us[N], vs[N];
+		t.store(ts);
+		u.store(us);
+		v.store(vs);
+		int best = -1;
+		for (int lane = 0; lane < N; ++lane) {
+			if ((bits >> lane) & 1) {
+				if (best < 0 || ts[lane] < ts[best]) best = lane;
+			}
+		}
+
+		closestT = ts[best];
+		hit.t = ts[best];
+		hit.face = packet.face[best];
+		hit.u = us[best];
+		hit.v = vs[best];
+		return true;
+	}
+
+public:
+	/// <summary>
+	/// Make an empty WideBVH, to read into.
+	/// </summary>
+	WideBVH()
+	{}
+
+	/// <summary>
+	/// Build by collapsing a binary BVH, whose primitive references index triangles
+	/// (which must be in the BVH's leaf order).
+	/// </summary>
+	WideBVH(const BVH& binary, const std::vector<PackedTriangle>& triangles)
+	{
+		if (!binary.nodes().empty())
+			collapseNode(binary.nodes(), 0, triangles);
+	}
+
+	void write(std::ostream& out) const
+	{
+		writeArray(out, nodes_);
+		writeArray(out, packets_);
+		writeArray(out, sourceNodes_);
+		writeArray(out, packetSources_);
+	}
+
+	bool read(BinaryReader& in)
+	{
+		return in.readArray(nodes_) && in.readArray(packets_)
+			&& in.readArray(sourceNodes_) && in.readArray(packetSources_);
+	}
+
+	/// <summary>
+	/// Update the bounds and triangles in place after the binary BVH it was built from has
+	/// been refitted, keeping the tree topology.
+	/// </summary>
+	void refit(const BVH& binary, const std::vector<PackedTriangle>& triangles)
+	{
+		const BVHNodeArray& binaryNodes = binary.nodes();
+		int nodeCount = static_cast<int>(nodes_.size());
+#pragma omp parallel for
+		for (int n = 0; n < nodeCount; ++n) {
+			AABB boxes[N];
+			for (int i = 0; i < N; ++i) {
+				int source = sourceNodes_[n * N + i];
+				if (source >= 0) boxes[i] = binaryNodes[source].bounds;
+			}
+			setBounds(nodes_[n], boxes);
+		}
+
+		int packetCount = static_cast<int>(packets_.size());
+#pragma omp parallel for
+		for (int p = 0; p < packetCount; ++p)
+			fillPacket(packets_[p], triangles, packetSources_[2 * p], packetSources_[2 * p + 1]);
+	}
+
+	int nodeCount() const
+	{
+		return static_cast<int>(nodes_.size());
+	}
+
+	int packetCount() const
+	{
+		return static_cast<int>(packets_.size());
+	}
+
+	size_t memoryBytes() const
+	{
+		return nodeBytes() + packets_.size() * sizeof(TrianglePacket<N>)
+			+ (sourceNodes_.size() + packetSources_.size()) * sizeof(int);
+	}
+
+	/// <summary>
+	/// Memory used by the nodes alone.
+	/// </summary>
+	size_t nodeBytes() const
+	{
+		return nodes_.size() * sizeof(Node);
+	}
+
+private:
+	/// <summary>
+	/// Shared by intersect and occluded. With AnyHit, returns at the first hit found.
+	/// </summary>
+	template <bool AnyHit>
+	bool traverse(const Ray& ray, float minT, float maxT, bool culling, MeshHit& hit, TraversalStats* stats) const
+	{
+		if (stats) stats->rays++;
+		if (nodes_.empty()) return false;
+
+		// Per-ray values for the slab tests. Near and far planes are picked by the direction's sign.
+		Eigen::Vector3f invDir = slabInverse(ray.direction);
+		FloatN origin[3], direction[3];
+		int nearPlane[3], farPlane[3];
+		for (int a = 0; a < 3; ++a) {
+			origin[a] = FloatN::broadcast(ray.origin[a]);
+			direction[a] = FloatN::broadcast(ray.direction[a]);
+			nearPlane[a] = invDir[a] < 0.f ? a + 3 : a;
+			farPlane[a] = invDir[a] < 0.f ? a : a + 3;
+		}
+
+		struct StackEntry { int index, count; float tEntry; };
+		StackEntry stack[BVH::MAX_DEPTH * N];
+		int stackSize = 0;
+		stack[stackSize++] = { 0, 0, minT };
+
+		float closestT = maxT;
+		bool found = false;
+		while (stackSize > 0) {
+			StackEntry entry = stack[--stackSize];
+			if (entry.tEntry > closestT) continue;
+
+			if (stats) stats->nodeVisits++;
+			if (entry.count > 0) {
+				if (stats) stats->primitiveTests += entry.count * N;
+				for (int p = entry.index; p < entry.index + entry.count; ++p) {
+					if (intersectPacket(packets_[p], origin, direction, minT, closestT, culling, hit)) {
+						if (AnyHit) return true;
+						found = true;
+					}
+				}
+				continue;
+			}
+
+			// Slab test against all N children at once.
+			const Node& node = nodes_[entry.index];
+			FloatN tNear = FloatN::broadcast(minT), tFar = FloatN::broadcast(closestT);
+			intersectChildren(node, ray.origin, invDir, nearPlane, farPlane, tNear, tFar);
+			int bits = (tNear <= tFar).bits();
+			if (!bits) continue;
+
+			// Push hit children furthest first, so the nearest is popped next.
+			float tNears[N];
+			tNear.store(tNears);
+			int first = stackSize;
+			for (int i = 0; i < N; ++i) {
+				if (!((bits >> i) & 1) || node.count[i] < 0) continue;
+				StackEntry child = { node.child[i], node.count[i], tNears[i] };
+				int j = stackSize++;
+				while (j > first && stack[j - 1].tEntry < child.tEntry) {
+					stack[j] = stack[j - 1];
+					--j;
+				}
+				stack[j] = child;
+			}
+		}
+
+		return found;
+	}
+
+public:
+	/// <summary>
+	/// Find the closest triangle hit with minT <= t <= maxT. If stats is given, the nodes
+	/// visited and triangles tested (including padding lanes of packets) are added to it.
+	/// </summary>
+	bool intersect(const Ray& ray, float minT, float maxT, bool culling, MeshHit& hit, TraversalStats* stats = nullptr) const
+	{
+		return traverse<false>(ray, minT, maxT, culling, hit, stats);
+	}
+
+	/// <summary>
+	/// Is any triangle hit with minT <= t <= maxT? Stops at the first hit found.
+	/// </summary>
+	bool occluded(const Ray& ray, float minT, float maxT, bool culling, TraversalStats* stats = nullptr) const
+	{
+		MeshHit hit;
+		return traverse<true>(ray, minT, maxT, culling, hit, stats);
+	}
+};
@@ -3,8 +3,8 @@
 #include <json/json.hpp>
 #include <iostream>
 #include <vector>
-#include <random>
 #include <chrono>
+#include <sstream>
 #include "Sphere.hpp"
 #include "Plane.hpp"
 #include "Triangle.hpp"
@@ -19,6 +19,12 @@
 #include "TexCoordTestShader.hpp"
 #include "Model.hpp"
 #include "AABBMesh.hpp"
+#include "BVHMesh.hpp"
+#include "KdTreeMesh.hpp"
+#include "Benchmark.hpp"
+#include "WavefrontRenderer.hpp"
+#include "TileScheduler.hpp"
+#include <atomic>
 
 /// <summary>
 /// Load a JSON config file using the nlohmann library.
@@ -39,12 +45,271 @@ Eigen::Vector3f loadVec3FromConfig(const nlohmann::json& config)
 	return Eigen::Vector3f(config[0], config[1], config[2]);
 }
 
+/// <summary>
+/// Load the mesh BVH build options from the config file.
+/// </summary>
+BVHBuildOptions loadBVHOptionsFromConfig(const nlohmann::json& config)
+{
+	BVHBuildOptions options;
+	options.width = config["meshBVHWidth"];
+	options.quantized = config["meshBVHQuantized"];
+	std::string builder = config["meshBVHBuilder"];
+	if (builder == "sweep")
+		options.method = BVHBuildMethod::SweepSAH;
+	else if (builder == "binned")
+		options.method = BVHBuildMethod::BinnedSAH;
+	else if (builder == "lbvh")
+		options.method = BVHBuildMethod::LBVH;
+	else if (builder == "spatial")
+		options.method = BVHBuildMethod::SpatialSAH;
+	else
+		throw std::runtime_error("Unknown meshBVHBuilder in config file!");
+	return options;
+}
+
+/// <summary>
+/// Convert an obj file into a binary mesh file, which Model maps without parsing. A BVH built
+/// with the given options is stored in it too, so BVHMeshes built with the same options load it.
+/// </summary>
+void convertModel(const std::string& objFilename, const std::string& meshFilename, const BVHBuildOptions& options)
+{
+	Model model(objFilename.c_str());
+	MeshBVH bvh(&model, options);
+	std::ostringstream hierarchy;
+	bvh.writeHierarchy(hierarchy);
+	if (!model.save(meshFilename.c_str(), hierarchy.str())) {
+		throw std::runtime_error("Couldn't write mesh file!");
+	}
+	std::cout << "Converted " << objFilename << " to " << meshFilename << " (BVH: " << bvh.stats() << ")" << std::endl;
+}
+
+/// <summary>
+/// Compare the mesh acceleration structures on each model listed in the "benchmark"
+/// section of the config, reporting BVH build statistics and primary ray throughput.
+/// Brute-force meshes are only timed on small models, as they are too slow otherwise.
+/// Also compares linear and BVH Scenes on random clouds of spheres.
+/// </summary>
+void benchmarkModels(const nlohmann::json& config)
+{
+	const int bruteForceMaxFaces = 10000, sweepMaxFaces = 1000000;
+	int pixWidth = config["pixWidth"], pixHeight = config["pixHeight"];
+
+	for (const auto& entry : config["models"]) {
+		std::string filename = entry.get<std::string>();
+		Model model(filename.c_str());
+		std::cout << "*** Benchmark " << filename << " (" << model.nfaces() << " faces) ***" << std::endl;
+
+		BVHMesh bvhMesh(nullptr, &model, false);
+		std::cout << "Binned SAH BVH: " << bvhMesh.bvh().stats() << ", " << bvhMesh.bvh().memoryBytes() / 1024 << " KiB" << std::endl;
+		if (model.nfaces() <= sweepMaxFaces) {
+			BVHBuildOptions options;
+			options.method = BVHBuildMethod::SweepSAH;
+			MeshBVH sweepBVH(&model, options);
+			std::cout << "Sweep SAH BVH: " << sweepBVH.stats() << std::endl;
+		}
+
+		// Time loading a BVH from the cache, after making sure it is there.
+		std::string cacheDirectory = config["bvhCacheDirectory"];
+		if (!cacheDirectory.empty()) {
+			MeshBVH cachedBVH(&model, BVHBuildOptions(), cacheDirectory);
+			auto loadStartTime = std::chrono::steady_clock::now();
+			MeshBVH loadedBVH(&model, BVHBuildOptions(), cacheDirectory);
+			double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStartTime).count();
+			std::cout << "BVH " << (loadedBVH.loadedFromCache() ? "loaded from cache" : "not cached, built")
+				<< " in " << loadMs << " ms" << std::endl;
+		}
+
+		Camera cam = makeBenchmarkCamera(bvhMesh.bvh().bounds(), pixWidth, pixHeight);
+		std::cout << "BVHMesh: " << measureRayThroughput(bvhMesh, cam, pixWidth, pixHeight) << " Mrays/s" << std::endl;
+
+		// Spatial splits cost build time and memory, but help most where triangle boxes overlap.
+		{
+			BVHBuildOptions options;
+			options.method = BVHBuildMethod::SpatialSAH;
+			BVHMesh sbvhMesh(nullptr, &model, false, DEFAULT_BITMASK, options);
+			std::cout << "Spatial split BVH: " << sbvhMesh.bvh().stats() << ", "
+				<< measureRayThroughput(sbvhMesh, cam, pixWidth, pixHeight) << " Mrays/s, "
+				<< sbvhMesh.bvh().memoryBytes() / 1024 << " KiB" << std::endl;
+			TraversalStats sahTraversal = measureTraversal(bvhMesh.bvh(), cam, pixWidth, pixHeight);
+			TraversalStats sbvhTraversal = measureTraversal(sbvhMesh.bvh(), cam, pixWidth, pixHeight);
+			std::cout << "Per ray, binned SAH: " << static_cast<double>(sahTraversal.nodeVisits) / sahTraversal.rays << " nodes, "
+				<< static_cast<double>(sahTraversal.primitiveTests) / sahTraversal.rays << " triangles; spatial split: "
+				<< static_cast<double>(sbvhTraversal.nodeVisits) / sbvhTraversal.rays << " nodes, "
+				<< static_cast<double>(sbvhTraversal.primitiveTests) / sbvhTraversal.rays << " triangles" << std::endl;
+		}
+
+		// Node layout only changes which nodes share cache lines and pages.
+		const char* layoutNames[] = { "build order", "depth-first", "treelet" };
+		for (BVHNodeLayout layout : { BVHNodeLayout::BuildOrder, BVHNodeLayout::DepthFirst, BVHNodeLayout::Treelet }) {
+			BVHBuildOptions options;
+			options.layout = layout;
+			BVHMesh layoutMesh(nullptr, &model, false, DEFAULT_BITMASK, options);
+			double cacheMisses = measurePerfEvent(layoutMesh.bvh(), cam, pixWidth, pixHeight, PerfEvent::CacheMisses);
+			double l1Misses = measurePerfEvent(layoutMesh.bvh(), cam, pixWidth, pixHeight, PerfEvent::L1DataReadMisses);
+			std::cout << "BVH nodes in " << layoutNames[static_cast<int>(layout)] << " layout: "
+				<< measureRayThroughput(layoutMesh, cam, pixWidth, pixHeight) << " Mrays/s, ";
+			if (cacheMisses < 0.0)
+				std::cout << "cache miss counters not available" << std::endl;
+			else
+				std::cout << cacheMisses << " cache misses/ray, " << l1Misses << " L1 data misses/ray" << std::endl;
+		}
+
+		// Kd-tree traversal stops at the first cell holding a hit.
+		{
+			KdTreeMesh kdTreeMesh(nullptr, &model, false);
+			std::cout << "Kd-tree: " << kdTreeMesh.tree().stats() << ", "
+				<< measureRayThroughput(kdTreeMesh, cam, pixWidth, pixHeight) << " Mrays/s, "
+				<< kdTreeMesh.memoryBytes() / 1024 << " KiB" << std::endl;
+			TraversalStats kdTraversal = measureTraversal(kdTreeMesh, cam, pixWidth, pixHeight);
+			std::cout << "Per ray, kd-tree: " << static_cast<double>(kdTraversal.nodeVisits) / kdTraversal.rays << " nodes, "
+				<< static_cast<double>(kdTraversal.primitiveTests) / kdTraversal.rays << " triangles" << std::endl;
+		}
+
+		// LBVHs build much faster, at the cost of slower traversal.
+		for (int mortonBits : { 30, 63 }) {
+			BVHBuildOptions options;
+			options.method = BVHBuildMethod::LBVH;
+			options.mortonBits = mortonBits;
+			BVHMesh lbvhMesh(nullptr, &model, false, DEFAULT_BITMASK, options);
+			std::cout << mortonBits << "-bit LBVH: " << lbvhMesh.bvh().stats() << ", "
+				<< measureRayThroughput(lbvhMesh, cam, pixWidth, pixHeight) << " Mrays/s" << std::endl;
+		}
+
+		// Quantized nodes trade some traversal speed for memory.
+		for (int width : { 4, 8 }) {
+			for (bool quantized : { false, true }) {
+				BVHBuildOptions options;
+				options.width = width;
+				options.quantized = quantized;
+				BVHMesh wideMesh(nullptr, &model, false, DEFAULT_BITMASK, options);
+				std::cout << (quantized ? "Quantized BVH" : "BVH") << width << "Mesh: "
+					<< measureRayThroughput(wideMesh, cam, pixWidth, pixHeight) << " Mrays/s, "
+					<< wideMesh.bvh().memoryBytes() / 1024 << " KiB, "
+					<< static_cast<double>(wideMesh.bvh().nodeBytes()) / model.nfaces() << " node bytes/triangle, "
+					<< static_cast<double>(wideMesh.bvh().memoryBytes()) / model.nfaces() << " bytes/triangle, "
+					<< countAxisAlignedMismatches(bvhMesh.bvh(), wideMesh.bvh()) << " axis-aligned rays disagreeing with the binary BVH" << std::endl;
+			}
+		}
+
+		if (model.nfaces() <= bruteForceMaxFaces) {
+			AABBMesh aabbMesh(nullptr, &model, false);
+			std::cout << "AABBMesh: " << measureRayThroughput(aabbMesh, cam, pixWidth, pixHeight) << " Mrays/s" << std::endl;
+			Mesh mesh(nullptr, &model, false);
+			reportPrimaryThroughput("Mesh", mesh, cam, pixWidth, pixHeight);
+		}
+
+		// Scatter instances sharing the one BVH, with a Scene BVH over the instances.
+		for (int count : config["instanceCounts"]) {
+			Scene scene;
+			makeSphereCloud(scene, count, nullptr);
+			for (size_t i = 0; i < scene.renderables.size(); ++i) {
+				AffineTransform placement = scene.renderables[i]->modelToWorld() * AffineTransform(rotateY(static_cast<float>(i)));
+				scene.renderables[i] = std::make_unique<MeshInstance>(nullptr, bvhMesh.sharedBVH(), false);
+				scene.renderables[i]->modelToWorld(placement);
+			}
+			scene.buildBVH();
+			AABB bounds;
+			scene.bounds(bounds);
+			Camera instanceCam = makeBenchmarkCamera(bounds, pixWidth, pixHeight);
+			std::cout << count << " instances: "
+				<< measureRayThroughput(scene, instanceCam, pixWidth, pixHeight) << " Mrays/s, "
+				<< (bvhMesh.bvh().memoryBytes() + count * sizeof(MeshInstance)) / 1024 << " KiB" << std::endl;
+		}
+
+		// Deform the model, and compare refitting its BVH with rebuilding it.
+		std::vector<Eigen::Vector3f> restVerts(model.nverts());
+		for (int i = 0; i < model.nverts(); ++i)
+			restVerts[i] = model.vert(i);
+		for (float amplitude : { .002f, .02f }) {
+			BVHMesh deformedMesh(nullptr, &model, false);
+			deformModel(model, restVerts, amplitude);
+			auto refitStartTime = std::chrono::steady_clock::now();
+			deformedMesh.update();
+			double refitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - refitStartTime).count();
+			MeshBVH rebuiltBVH(&model);
+			std::cout << "Deformed by " << amplitude << ": refit in " << refitMs << " ms, SAH cost "
+				<< deformedMesh.bvh().stats().sahCost << "; rebuilt in " << rebuiltBVH.stats().buildMs
+				<< " ms, SAH cost " << rebuiltBVH.stats().sahCost << std::endl;
+			deformModel(model, restVerts, 0.f);
+		}
+	}
+
+	for (int count : config["sphereCounts"]) {
+		std::cout << "*** Benchmark cloud of " << count << " spheres ***" << std::endl;
+		Scene scene;
+		makeSphereCloud(scene, count, nullptr);
+		AABB bounds;
+		scene.bounds(bounds);
+		Camera cam = makeBenchmarkCamera(bounds, pixWidth, pixHeight);
+
+		reportPrimaryThroughput("Linear Scene", scene, cam, pixWidth, pixHeight);
+		scene.buildBVH();
+		std::cout << "Scene BVH: " << scene.bvh().stats() << std::endl;
+		reportPrimaryThroughput("BVH Scene", scene, cam, pixWidth, pixHeight);
+
+		// The same cloud in a uniform and a two-level grid.
+		for (int subGridThreshold : { 0, 8 }) {
+			GridScene gridScene;
+			makeSphereCloud(gridScene, count, nullptr);
+			GridBuildOptions options;
+			options.subGridThreshold = subGridThreshold;
+			auto gridStartTime = std::chrono::steady_clock::now();
+			gridScene.buildGrid(options);
+			double gridMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - gridStartTime).count();
+			std::cout << (subGridThreshold > 0 ? "Two-level grid: " : "Uniform grid: ") << gridScene.cellCount() << " cells, "
+				<< gridScene.subGridCount() << " sub-grids, built in " << gridMs << " ms, "
+				<< measureRayThroughput(gridScene, cam, pixWidth, pixHeight) << " Mrays/s" << std::endl;
+		}
+	}
+
+	// Wavefront rendering with and without sorting the secondary rays, on clouds of mirror
+	// spheres mixed with a quarter as many diffuse ones, so that many rays bounce around the
+	// cloud before ending on a diffuse sphere and casting shadow rays from there.
+	for (int count : config["mirrorSphereCounts"]) {
+		std::cout << "*** Benchmark wavefront rendering of " << count << " mirror spheres ***" << std::endl;
+		MirrorShader mirrorShader;
+		LambertianShader diffuseShader(Eigen::Vector3f(.8f, .8f, .8f));
+		Scene scene;
+		makeSphereCloud(scene, count, &mirrorShader);
+		makeSphereCloud(scene, count / 4, &diffuseShader, 2);
+		AABB bounds;
+		scene.bounds(bounds);
+		scene.buildBVH();
+		Camera cam = makeBenchmarkCamera(bounds, pixWidth, pixHeight);
+
+		std::vector<std::unique_ptr<Light>> lights;
+		lights.push_back(std::make_unique<PointLight>(bounds.centroid() + Eigen::Vector3f(0.f, bounds.extent().y(), 0.f),
+			bounds.extent().squaredNorm() * Eigen::Vector3f(1.f, 1.f, 1.f)));
+		lights.push_back(std::make_unique<DirectionalLight>(Eigen::Vector3f(1.f, -1.f, 1.f), .5f * Eigen::Vector3f(1.f, 1.f, 1.f)));
+
+		double unsortedSeconds = 0.0;
+		for (bool sortRays : { false, true }) {
+			WavefrontRenderer renderer(scene, cam, lights, Eigen::Vector3f(.1f, .1f, .1f), config["mirrorBounces"], sortRays);
+			WavefrontStats stats = measureWavefront(renderer, pixWidth, pixHeight);
+			std::cout << (sortRays ? "Sorted: " : "Unsorted: ") << stats << std::endl;
+			if (!sortRays)
+				unsortedSeconds = stats.secondarySeconds;
+			else
+				std::cout << "Secondary ray speedup from sorting " << unsortedSeconds / stats.secondarySeconds << "x, "
+					<< unsortedSeconds / (stats.secondarySeconds + stats.sortSeconds) << "x counting the sort" << std::endl;
+		}
+	}
+}
+
 
 int main(int argc, char* argv[]) {
 
 	// *** Load the config file ***
 	auto config = loadConfig("../config/config.json");
 
+	// main --convert model.obj model.mesh converts an obj file into a mesh file and exits.
+	if (argc == 4 && std::string(argv[1]) == "--convert") {
+		convertModel(argv[2], argv[3], loadBVHOptionsFromConfig(config));
+		return 0;
+	}
+
+	benchmarkModels(config["benchmark"]);
+
 	int pixHeight = config["pixHeight"], pixWidth = config["pixWidth"];
 
 	// Color that will be drawn where no objects are present.
@@ -80,21 +345,23 @@ int main(int argc, char* argv[]) {
 	TexCoordTestShader texCoordTestShader;
 
 	// *** Set up scene ***
+	auto buildStartTime = std::chrono::steady_clock::now();
+
 	Scene scene;
 	scene.renderables.push_back(std::make_unique<Sphere>(&bluePlasticShader, .8f));
-	scene.renderables.back()->modelToWorld(makeTranslationMatrix(Eigen::Vector3f(-2.f, 0.f, 0.f)));
+	scene.renderables.back()->modelToWorld(AffineTransform(makeTranslationMatrix(Eigen::Vector3f(-2.f, 0.f, 0.f))));
 
 	scene.renderables.push_back(std::make_unique<Sphere>(&mirrorShader, 1.f));
-	scene.renderables.back()->modelToWorld(makeTranslationMatrix(Eigen::Vector3f(0.f, 0.f, 0.f)));
+	scene.renderables.back()->modelToWorld(AffineTransform(makeTranslationMatrix(Eigen::Vector3f(0.f, 0.f, 0.f))));
 
 	scene.renderables.push_back(std::make_unique<Plane>(&aquaLambertianShader, Eigen::Vector3f(0.f, 0.f, -1.f)));
-	scene.renderables.back()->modelToWorld(makeTranslationMatrix(Eigen::Vector3f(0.f, 0.f, 3.f)));
+	scene.renderables.back()->modelToWorld(AffineTransform(makeTranslationMatrix(Eigen::Vector3f(0.f, 0.f, 3.f))));
 
 	scene.renderables.push_back(std::make_unique<Plane>(&lavenderLambertianShader, Eigen::Vector3f(0.f, 1.f, 0.f)));
-	scene.renderables.back()->modelToWorld(makeTranslationMatrix(Eigen::Vector3f(0.f, -3.f, 0.f)));
+	scene.renderables.back()->modelToWorld(AffineTransform(makeTranslationMatrix(Eigen::Vector3f(0.f, -3.f, 0.f))));
 
 	scene.renderables.push_back(std::make_unique<Plane>(&aquaLambertianShader, Eigen::Vector3f(0.f, 0.f, 1.f), VISIBLE_BITMASK));
-	scene.renderables.back()->modelToWorld(makeTranslationMatrix(Eigen::Vector3f(0.f, 0.f, -6.f)));
+	scene.renderables.back()->modelToWorld(AffineTransform(makeTranslationMatrix(Eigen::Vector3f(0.f, 0.f, -6.f))));
 
 	scene.renderables.push_back(std::make_unique<Triangle>(
 		&texCoordTestShader,
@@ -102,15 +369,42 @@ int main(int argc, char* argv[]) {
 		Eigen::Vector3f(1.f, 2.f, 1.f),
 		Eigen::Vector3f(0.f, 1.f, 1.f)));
 
-	Model spotModel("../models/spot.obj");
-
-	scene.renderables.push_back(std::make_unique<AABBMesh>(
-		&spotShader,
-		&spotModel));
-	scene.renderables.back()->modelToWorld(
+	// Either the obj file or a mesh file converted from it.
+	std::string spotModelFile = config["spotModelFile"];
+	Model spotModel(spotModelFile.c_str());
+
+	// Select the mesh acceleration structure.
+	std::string meshAccelerator = config["meshAccelerator"];
+	if (meshAccelerator == "bvh") {
+		BVHBuildOptions options = loadBVHOptionsFromConfig(config);
+		auto spotMesh = std::make_unique<BVHMesh>(&spotShader, &spotModel, true, DEFAULT_BITMASK, options,
+			config["bvhCacheDirectory"]);
+		std::cout << "Spot BVH: " << spotMesh->bvh().stats()
+			<< (spotMesh->bvh().loadedFromCache() ? " (loaded from cache)" : "") << std::endl;
+		scene.renderables.push_back(std::move(spotMesh));
+	}
+	else if (meshAccelerator == "kdtree") {
+		auto spotMesh = std::make_unique<KdTreeMesh>(&spotShader, &spotModel);
+		std::cout << "Spot kd-tree: " << spotMesh->tree().stats() << std::endl;
+		scene.renderables.push_back(std::move(spotMesh));
+	}
+	else if (meshAccelerator == "aabb")
+		scene.renderables.push_back(std::make_unique<AABBMesh>(&spotShader, &spotModel));
+	else if (meshAccelerator == "none")
+		scene.renderables.push_back(std::make_unique<Mesh>(&spotShader, &spotModel));
+	else
+		throw std::runtime_error("Unknown meshAccelerator in config file!");
+	scene.renderables.back()->modelToWorld(AffineTransform(
 		makeTranslationMatrix(Eigen::Vector3f(2.f, 0.f, 0.f))
-		* rotateY(0.f));
+		* rotateY(0.f)));
+
+
+	if (config["sceneBVH"]) {
+		scene.buildBVH();
+		std::cout << "Scene BVH: " << scene.bvh().stats() << std::endl;
+	}
 
+	auto buildTime = std::chrono::steady_clock::now() - buildStartTime;
 
 	// *** Add lights to scene ***
 	Eigen::Vector3f ambientLight(.1f, .1f, .1f);
@@ -121,49 +415,137 @@ int main(int argc, char* argv[]) {
 
 	// *** Render the scene ***
 
-	// Shuffling the scanline order gets better CPU usage between threads
-	// when some lines take longer to render than others.
-	std::vector<unsigned int> scanlines(pixHeight);
-	for (int i = 0; i < pixHeight; ++i) scanlines[i] = i;
-
-	if (config["shuffleScanlines"]) {
-		std::random_device rd;
-		std::mt19937 g(rd());
-		std::shuffle(scanlines.begin(), scanlines.end(), g);
+	// The image is split into square tiles, which a TileScheduler hands out to threads.
+	// Within a tile, primary rays are traced one at a time, or with packetSize 4 or 8 in
+	// packets of packetSize x packetSize pixels.
+	int packetSize = config["packetSize"];
+	if (packetSize != 0 && packetSize != 4 && packetSize != 8)
+		throw std::runtime_error("packetSize in config file must be 0, 4 or 8!");
+	int tileSize = config["tileSize"];
+	if (tileSize <= 0 || (packetSize != 0 && tileSize % packetSize != 0))
+		throw std::runtime_error("tileSize in config file must be a positive multiple of packetSize!");
+
+	std::string tileOrderName = config["tileOrder"];
+	TileOrder tileOrder;
+	if (tileOrderName == "scanline")
+		tileOrder = TileOrder::Scanline;
+	else if (tileOrderName == "morton")
+		tileOrder = TileOrder::Morton;
+	else if (tileOrderName == "hilbert")
+		tileOrder = TileOrder::Hilbert;
+	else
+		throw std::runtime_error("Unknown tileOrder in config file!");
+	TileScheduler scheduler(pixWidth, pixHeight, tileSize, tileOrder, config["workStealing"]);
+
+	int maxBounces = config["maxBounces"];
+	auto shadePixel = [&](int x, int y, const HitInfo* hitInfo) {
+		if (hitInfo) {
+			Eigen::Vector3f color = hitInfo->shader->getColor(
+				*hitInfo, &scene,
+				lightSources, ambientLight,
+				0, maxBounces);
+
+			color.x() = std::min(color.x(), 1.f);
+			color.y() = std::min(color.y(), 1.f);
+			color.z() = std::min(color.z(), 1.f);
+
+			TGAColor tgaColor(color.x() * 255, color.y() * 255, color.z() * 255, 255);
+			outImage.set(x, y, tgaColor);
+		}
+		else
+			outImage.set(x, y, clearColor);
+	};
+
+	// The wavefront renderer instead traces each tile breadth first, optionally sorting the
+	// secondary rays of each bounce before tracing them. Each thread has its own buffers.
+	bool wavefront = config["wavefront"];
+	WavefrontRenderer wavefrontRenderer(scene, cam, lightSources, ambientLight, maxBounces, config["wavefrontSortRays"]);
+	int maxThreads = omp_get_max_threads();
+	std::vector<std::vector<Eigen::Vector3f>> tileColors(maxThreads);
+	std::vector<std::unique_ptr<bool[]>> tileHits(maxThreads);
+	std::vector<WavefrontStats> threadWavefrontStats(maxThreads);
+	if (wavefront) {
+		for (int t = 0; t < maxThreads; ++t) {
+			tileColors[t].resize(tileSize * tileSize);
+			tileHits[t].reset(new bool[tileSize * tileSize]);
+		}
 	}
 
-	auto startTime = std::chrono::steady_clock::now();
-
-#pragma omp parallel for
-	for (int y = 0; y < pixHeight; ++y) {
-		for (int x = 0; x < pixWidth; ++x) {
-			Ray ray = cam.getRay(x, scanlines[y]);
-			HitInfo hitInfo;
-			if (scene.intersect(ray, 1e-6f, 1e6f, hitInfo, VISIBLE_BITMASK)) {
-				Eigen::Vector3f color = hitInfo.shader->getColor(
-					hitInfo, &scene,
-					lightSources, ambientLight,
-					0, config["maxBounces"]);
-
-				color.x() = std::min(color.x(), 1.f);
-				color.y() = std::min(color.y(), 1.f);
-				color.z() = std::min(color.z(), 1.f);
-
-				TGAColor tgaColor(color.x() * 255, color.y() * 255, color.z() * 255, 255);
-				outImage.set(x, scanlines[y], tgaColor);
+	std::atomic<int> tilesRemaining(static_cast<int>(scheduler.tiles().size()));
+	auto renderTile = [&](const Tile& tile, int thread) {
+		if (wavefront) {
+			std::vector<Eigen::Vector3f>& colors = tileColors[thread];
+			bool* hit = tileHits[thread].get();
+			wavefrontRenderer.renderTile(tile.x, tile.y, tile.width, tile.height, colors.data(), hit, threadWavefrontStats[thread]);
+
+			for (int y = 0; y < tile.height; ++y) {
+				for (int x = 0; x < tile.width; ++x) {
+					if (hit[y * tile.width + x]) {
+						Eigen::Vector3f color = colors[y * tile.width + x].cwiseMin(1.f);
+						outImage.set(tile.x + x, tile.y + y, TGAColor(color.x() * 255, color.y() * 255, color.z() * 255, 255));
+					}
+					else
+						outImage.set(tile.x + x, tile.y + y, clearColor);
+				}
+			}
+		}
+		else if (packetSize == 0) {
+			for (int y = tile.y; y < tile.y + tile.height; ++y) {
+				for (int x = tile.x; x < tile.x + tile.width; ++x) {
+					Ray ray = cam.getRay(x, y);
+					HitInfo hitInfo;
+					bool hit = scene.intersect(ray, 1e-6f, 1e6f, hitInfo, VISIBLE_BITMASK);
+					shadePixel(x, y, hit ? &hitInfo : nullptr);
+				}
 			}
-			else
-				outImage.set(x, scanlines[y], clearColor);
 		}
-		if (omp_get_thread_num() == omp_get_num_threads() - 1) {
-			std::clog << "\rScanlines remaining: " << (pixHeight - y) << ' ' << std::flush;
+		else {
+			// tileSize is a multiple of packetSize, so packets only overhang the image's edges.
+			RayPacket packet;
+			for (int y = tile.y; y < tile.y + tile.height; y += packetSize) {
+				for (int x = tile.x; x < tile.x + tile.width; x += packetSize) {
+					uint64_t active = cam.getPacket(x, y, packetSize, packet);
+					PacketHits hits(packet.size, 1e6f);
+					scene.intersectPacket(packet, active, 1e-6f, hits, VISIBLE_BITMASK);
+					for (int i = 0; i < packet.size; ++i) {
+						if (active >> i & 1)
+							shadePixel(x + i % packetSize, y + i / packetSize, (hits.hit >> i & 1) ? &hits.info[i] : nullptr);
+					}
+				}
+			}
 		}
 
-	}
+		int remaining = --tilesRemaining;
+		if (thread == 0) {
+			std::clog << "\rTiles remaining: " << remaining << ' ' << std::flush;
+		}
+	};
+
+	auto startTime = std::chrono::steady_clock::now();
+
+	std::vector<TileThreadStats> threadStats = scheduler.run(renderTile);
 
 	auto renderTime = std::chrono::steady_clock::now() - startTime;
 
-	std::cout << "Render duration " << std::chrono::duration_cast<std::chrono::seconds>(renderTime).count() << " seconds." << std::endl;
+	std::cout << "Scene build duration " << std::chrono::duration<double>(buildTime).count() << " seconds." << std::endl;
+	std::cout << "Render duration " << std::chrono::duration<double>(renderTime).count() << " seconds." << std::endl;
+
+	// Per-thread busy time shows how evenly the tiles were shared out.
+	double maxBusy = 0.0, totalBusy = 0.0;
+	for (size_t t = 0; t < threadStats.size(); ++t) {
+		std::cout << "Thread " << t << ": " << threadStats[t] << std::endl;
+		maxBusy = std::max(maxBusy, threadStats[t].busySeconds);
+		totalBusy += threadStats[t].busySeconds;
+	}
+	std::cout << scheduler.tiles().size() << " tiles of " << tileSize << "x" << tileSize << ", busiest thread "
+		<< maxBusy * threadStats.size() / totalBusy << "x the mean busy time" << std::endl;
+
+	if (wavefront) {
+		WavefrontStats wavefrontStats;
+		for (const WavefrontStats& stats : threadWavefrontStats)
+			wavefrontStats += stats;
+		std::cout << "Wavefront: " << wavefrontStats << std::endl;
+	}
 
 	// *** Save the output image ***
 	outImage.flip_vertically();